@@ -0,0 +1,356 @@
+/*
+File: access_log.h
+Description: asynchronous access log (wserver -l).
+    One JSON object per line for every response: time, client address,
+    method, path, status, bytes sent, how long the connection waited in the
+    accepted connection buffer and how long the request took to answer.
+    Threads answering requests never touch the file. Each one copies a
+    fixed size record into a ring of its own (single producer, single
+    consumer: two indices on separate cache lines, no lock, no atomic
+    read-modify-write) and goes on. A background thread drains every ring,
+    formats the records and writes them out in large batches, one write()
+    for up to ACCESS_BATCH bytes of log lines.
+    When a ring is full (the disk or the writer can't keep up) the record
+    is dropped and counted, a request is never held up by its log line.
+    The file is rotated once it grows past -z MB: access.log becomes
+    access.log.1, .1 becomes .2 and so on, ACCESS_LOG_KEEP old files are
+    kept.
+*/
+
+#ifndef ACCESS_LOG_H
+#define ACCESS_LOG_H
+
+// stdlib
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+// files and addresses
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+
+// concurrency control
+#include <atomic>
+
+// stl
+#include <string>
+
+#define ACCESS_RING_SIZE 1024 // records per thread waiting for the writer, a power of 2
+#define ACCESS_PATH_MAX 192 // longer paths are cut off in the log
+#define ACCESS_METHOD_MAX 16
+#define ACCESS_BATCH (256 * 1024) // bytes of log lines per write()
+#define ACCESS_IDLE_NS 5000000 // the writer's nap when every ring is empty
+#define ACCESS_LOG_KEEP 4 // rotated files kept, access.log.1 is the newest
+
+// a client's address without the rest of a sockaddr, copied into every record
+struct client_addr {
+    int family; // AF_INET, AF_INET6, or 0 when unknown
+    unsigned char bytes[16];
+};
+
+void client_addr_set(struct client_addr* client, const struct sockaddr_storage* addr) {
+    if (addr->ss_family == AF_INET) {
+        client->family = AF_INET;
+        memcpy(client->bytes, &((const struct sockaddr_in*) addr)->sin_addr, 4);
+    } else if (addr->ss_family == AF_INET6) {
+        client->family = AF_INET6;
+        memcpy(client->bytes, &((const struct sockaddr_in6*) addr)->sin6_addr, 16);
+    } else {
+        client->family = 0;
+    }
+}
+
+struct access_record {
+    struct timespec time; // when the response went out
+    struct client_addr client;
+    int status;
+    unsigned long bytes;
+    long queue_us;
+    long service_us;
+    unsigned short method_len;
+    unsigned short path_len;
+    char method[ACCESS_METHOD_MAX];
+    char path[ACCESS_PATH_MAX];
+};
+
+struct access_ring {
+    alignas(64) std::atomic<size_t> head; // next slot the owning thread fills
+    alignas(64) std::atomic<size_t> tail; // next slot the writer formats
+    alignas(64) std::atomic<unsigned long> dropped; // written by the owning thread only
+    struct access_ring* next;
+    struct access_record slots[ACCESS_RING_SIZE];
+};
+
+struct access_log {
+    int on;
+    const char* file;
+    int fd;
+    size_t size; // bytes in the current file
+    size_t max_size; // rotate when the next batch would pass this
+    pthread_mutex_t lock; // only taken to add a ring
+    std::atomic<struct access_ring*> rings;
+
+    // for the stats thread
+    std::atomic<unsigned long> written;
+    std::atomic<unsigned long> rotations;
+    std::atomic<unsigned long> write_errors;
+};
+struct access_log access_log;
+
+thread_local struct access_ring* access_ring_self = NULL;
+
+int access_log_open(struct access_log* log) {
+    log->fd = open(log->file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (log->fd == -1) {
+        return -1;
+    }
+    struct stat st;
+    log->size = fstat(log->fd, &st) == 0 ? st.st_size : 0;
+    return 0;
+}
+
+// open (appending to) file, exits if it can't be opened since the operator asked for a log
+void access_log_init(struct access_log* log, const char* file, size_t max_size) {
+    log->file = file;
+    log->max_size = max_size;
+    pthread_mutex_init(&log->lock, NULL);
+    log->rings.store(NULL);
+    log->written = 0;
+    log->rotations = 0;
+    log->write_errors = 0;
+    if (access_log_open(log) == -1) {
+        perror(file);
+        exit(1);
+    }
+    log->on = 1;
+}
+
+struct access_ring* access_ring_get(struct access_log* log) {
+    if (access_ring_self == NULL) {
+        struct access_ring* ring = new struct access_ring;
+        ring->head.store(0);
+        ring->tail.store(0);
+        ring->dropped.store(0);
+        pthread_mutex_lock(&log->lock);
+        ring->next = log->rings.load();
+        log->rings.store(ring, std::memory_order_release); // the writer picks it up on its next pass
+        pthread_mutex_unlock(&log->lock);
+        access_ring_self = ring;
+    }
+    return access_ring_self;
+}
+
+void copy_field(char* dst, unsigned short* dst_len, size_t cap, const char* src, size_t len) {
+    if (len > cap) {
+        len = cap;
+    }
+    memcpy(dst, src, len);
+    *dst_len = len;
+}
+
+// queue a line for the writer, never blocks: a full ring drops the record
+void access_log_add(struct access_log* log, const struct client_addr* client, const char* method, size_t method_len,
+        const char* path, size_t path_len, int status, size_t bytes, long queue_us, long service_us) {
+    struct access_ring* ring = access_ring_get(log);
+    size_t head = ring->head.load(std::memory_order_relaxed);
+    if (head - ring->tail.load(std::memory_order_acquire) == ACCESS_RING_SIZE) {
+        ring->dropped.store(ring->dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        return;
+    }
+    struct access_record* r = &ring->slots[head & (ACCESS_RING_SIZE - 1)];
+    clock_gettime(CLOCK_REALTIME, &r->time);
+    if (client != NULL) {
+        r->client = *client;
+    } else {
+        r->client.family = 0;
+    }
+    r->status = status;
+    r->bytes = bytes;
+    r->queue_us = queue_us;
+    r->service_us = service_us;
+    copy_field(r->method, &r->method_len, ACCESS_METHOD_MAX, method, method_len);
+    copy_field(r->path, &r->path_len, ACCESS_PATH_MAX, path, path_len);
+    ring->head.store(head + 1, std::memory_order_release); // the record is complete before the writer can see it
+}
+
+/*
+The writer formats every line by hand: snprintf() was most of the writer's time (about 0.8 us a line),
+and on a busy server the writer shares the cpus with the threads answering requests.
+*/
+#define ACCESS_LINE_MAX (256 + 6 * (ACCESS_METHOD_MAX + ACCESS_PATH_MAX)) // every byte of method and path escaped
+
+char* put_str(char* p, const char* s) {
+    size_t len = strlen(s);
+    memcpy(p, s, len);
+    return p + len;
+}
+
+char* put_ulong(char* p, unsigned long v) {
+    char digits[24];
+    int n = 0;
+    do {
+        digits[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v > 0);
+    while (n > 0) {
+        *p++ = digits[--n];
+    }
+    return p;
+}
+
+char* put_long(char* p, long v) {
+    if (v < 0) {
+        *p++ = '-';
+        return put_ulong(p, -(unsigned long) v);
+    }
+    return put_ulong(p, v);
+}
+
+// s as a JSON string body: quotes, backslashes, control characters and non-ASCII bytes (which might not be valid UTF-8) escaped
+char* put_json(char* p, const char* s, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\') {
+            *p++ = '\\';
+            *p++ = c;
+        } else if (c < 0x20 || c >= 0x7f) {
+            p = put_str(p, "\\u00");
+            *p++ = hex[c >> 4];
+            *p++ = hex[c & 15];
+        } else {
+            *p++ = c;
+        }
+    }
+    return p;
+}
+
+// one record as a line of JSON, time_buf caches the formatted second since most records share it
+void access_format(std::string* out, const struct access_record* r, time_t* time_sec, char* time_buf) {
+    if (r->time.tv_sec != *time_sec) {
+        struct tm tm;
+        gmtime_r(&r->time.tv_sec, &tm);
+        strftime(time_buf, 32, "%Y-%m-%dT%H:%M:%S.", &tm);
+        *time_sec = r->time.tv_sec;
+    }
+    char line[ACCESS_LINE_MAX];
+    char* p = put_str(line, "{\"time\":\"");
+    p = put_str(p, time_buf);
+    long ms = r->time.tv_nsec / 1000000;
+    *p++ = '0' + ms / 100;
+    *p++ = '0' + ms / 10 % 10;
+    *p++ = '0' + ms % 10;
+    p = put_str(p, "Z\",\"client\":\"");
+    if (r->client.family == 0 || inet_ntop(r->client.family, r->client.bytes, p, INET6_ADDRSTRLEN) == NULL) {
+        *p++ = '-';
+    } else {
+        p += strlen(p);
+    }
+    p = put_str(p, "\",\"method\":\"");
+    p = put_json(p, r->method, r->method_len);
+    p = put_str(p, "\",\"path\":\"");
+    p = put_json(p, r->path, r->path_len);
+    p = put_str(p, "\",\"status\":");
+    p = put_long(p, r->status);
+    p = put_str(p, ",\"bytes\":");
+    p = put_ulong(p, r->bytes);
+    p = put_str(p, ",\"queue_us\":");
+    p = put_long(p, r->queue_us);
+    p = put_str(p, ",\"service_us\":");
+    p = put_long(p, r->service_us);
+    p = put_str(p, "}\n");
+    out->append(line, p - line);
+}
+
+// access.log -> access.log.1 -> ... -> access.log.<ACCESS_LOG_KEEP>, then start a new access.log
+void access_log_rotate(struct access_log* log) {
+    close(log->fd);
+    std::string base = log->file;
+    for (int i = ACCESS_LOG_KEEP - 1; i >= 1; i--) {
+        rename((base + "." + std::to_string(i)).c_str(), (base + "." + std::to_string(i + 1)).c_str());
+    }
+    rename(base.c_str(), (base + ".1").c_str());
+    if (access_log_open(log) == -1) {
+        perror(log->file);
+        log->fd = -1;
+    }
+    log->rotations.fetch_add(1, std::memory_order_relaxed);
+}
+
+void access_log_flush(struct access_log* log, std::string* batch) {
+    if (batch->empty()) {
+        return;
+    }
+    if (log->size > 0 && log->size + batch->size() > log->max_size) {
+        access_log_rotate(log);
+    }
+    if (log->fd == -1 && access_log_open(log) == -1) { // couldn't reopen after a rotation, try again next batch
+        log->write_errors.fetch_add(1, std::memory_order_relaxed);
+        batch->clear();
+        return;
+    }
+    size_t done = 0;
+    while (done < batch->size()) {
+        ssize_t n = write(log->fd, batch->data() + done, batch->size() - done);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            log->write_errors.fetch_add(1, std::memory_order_relaxed);
+            break;
+        }
+        done += n;
+    }
+    log->size += done;
+    batch->clear();
+}
+
+// the writer thread: drain every ring, write in batches, nap only when there was nothing to do
+void* access_log_thread(void* arg) {
+    struct access_log* log = (struct access_log*) arg;
+    std::string batch;
+    batch.reserve(ACCESS_BATCH + 1024);
+    time_t time_sec = 0;
+    char time_buf[32];
+    while (1) {
+        unsigned long drained = 0;
+        for (struct access_ring* ring = log->rings.load(std::memory_order_acquire); ring != NULL; ring = ring->next) {
+            size_t tail = ring->tail.load(std::memory_order_relaxed);
+            size_t head = ring->head.load(std::memory_order_acquire);
+            for (; tail != head; tail++) {
+                access_format(&batch, &ring->slots[tail & (ACCESS_RING_SIZE - 1)], &time_sec, time_buf);
+                drained++;
+                if (batch.size() >= ACCESS_BATCH) {
+                    ring->tail.store(tail + 1, std::memory_order_release);
+                    access_log_flush(log, &batch);
+                }
+            }
+            ring->tail.store(tail, std::memory_order_release); // the slots can be filled again
+        }
+        access_log_flush(log, &batch);
+        log->written.fetch_add(drained, std::memory_order_relaxed);
+        if (drained == 0) {
+            struct timespec nap = {0, ACCESS_IDLE_NS};
+            nanosleep(&nap, NULL);
+        }
+    }
+    return NULL;
+}
+
+void access_log_stats(struct access_log* log, char* buf, size_t cap) {
+    unsigned long dropped = 0;
+    for (struct access_ring* ring = log->rings.load(std::memory_order_acquire); ring != NULL; ring = ring->next) {
+        dropped += ring->dropped.load(std::memory_order_relaxed);
+    }
+    snprintf(buf, cap, "access log: written %lu dropped %lu rotations %lu write errors %lu\n",
+        log->written.load(), dropped, log->rotations.load(), log->write_errors.load());
+}
+
+#endif
@@ -0,0 +1,148 @@
+/*
+File: arena.h
+Description: per-connection bump allocator for request scratch memory.
+    Everything a request needs only while it is being answered (error
+    page bodies, a CGI program's environment) is carved out of the
+    connection's arena by moving a pointer, and the whole lot is given
+    back at once with arena_reset() when the response has gone out.
+    Nothing is freed piece by piece.
+    An arena is a chain of fixed size blocks. Blocks come from a pool kept
+    by each thread, so a thread serving keep-alive connections reuses the
+    same few blocks over and over: after warm-up the arena makes no
+    malloc() calls. (The strings a request needs outside the arena, cache
+    keys and the status page, are per-thread buffers that keep their
+    capacity, so static files, cache hits, errors and status pages don't
+    allocate at all; running a CGI program or plugin, or gzipping on the
+    fly, still does.) The event loop takes its connections' read buffers
+    from the same pool. A connection answered on another thread (CGI job
+    threads) just hands its blocks to that thread's pool.
+    A single allocation bigger than a block gets a block of its own, which
+    is freed on reset instead of pooled.
+*/
+
+#ifndef ARENA_H
+#define ARENA_H
+
+// stdlib
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h> // offsetof()
+
+// concurrency control
+#include <atomic>
+
+#define ARENA_BLOCK_SIZE (16 * 1024) // bytes per block, including its header
+#define ARENA_POOL_MAX 64 // free blocks a thread keeps, more are given back to malloc()
+#define ARENA_ALIGN 16
+
+struct arena_block {
+    struct arena_block* next;
+    size_t size; // usable bytes in data
+    alignas(ARENA_ALIGN) char data[];
+};
+
+#define ARENA_BLOCK_DATA (ARENA_BLOCK_SIZE - offsetof(struct arena_block, data))
+
+struct arena {
+    struct arena_block* head; // the block being carved up, the ones filled before it follow
+    size_t used; // bytes of head handed out
+};
+
+// a thread's free blocks
+struct arena_pool {
+    struct arena_block* free;
+    int count;
+};
+thread_local struct arena_pool arena_thread_pool = {NULL, 0};
+
+// for the stats thread, only bumped on the malloc() path so pool hits touch nothing shared
+struct arena_counters {
+    std::atomic<unsigned long> malloced; // blocks that had to come from malloc(), flat once the pools are warm
+    std::atomic<unsigned long> oversized; // allocations too big for a block
+};
+struct arena_counters arena_stats_counters;
+
+// a block of at least size usable bytes
+struct arena_block* arena_block_get(size_t size) {
+    struct arena_pool* pool = &arena_thread_pool;
+    if (size <= ARENA_BLOCK_DATA && pool->free != NULL) {
+        struct arena_block* b = pool->free;
+        pool->free = b->next;
+        pool->count--;
+        return b;
+    }
+    size_t bytes = ARENA_BLOCK_SIZE;
+    if (size > ARENA_BLOCK_DATA) {
+        bytes = offsetof(struct arena_block, data) + size;
+        arena_stats_counters.oversized.fetch_add(1, std::memory_order_relaxed);
+    }
+    struct arena_block* b = (struct arena_block*) aligned_alloc(ARENA_ALIGN, (bytes + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1));
+    if (b == NULL) {
+        perror("arena: aligned_alloc");
+        exit(1);
+    }
+    b->size = bytes - offsetof(struct arena_block, data);
+    arena_stats_counters.malloced.fetch_add(1, std::memory_order_relaxed);
+    return b;
+}
+
+void arena_block_put(struct arena_block* b) {
+    struct arena_pool* pool = &arena_thread_pool;
+    if (b->size != ARENA_BLOCK_DATA || pool->count == ARENA_POOL_MAX) {
+        free(b);
+        return;
+    }
+    b->next = pool->free;
+    pool->free = b;
+    pool->count++;
+}
+
+void arena_init(struct arena* a) {
+    a->head = NULL;
+    a->used = 0;
+}
+
+// size bytes aligned to ARENA_ALIGN, valid until the next arena_reset() or arena_release()
+void* arena_alloc(struct arena* a, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+    if (a->head == NULL || a->used + size > a->head->size) {
+        struct arena_block* b = arena_block_get(size);
+        b->next = a->head;
+        a->head = b;
+        a->used = 0;
+    }
+    void* p = a->head->data + a->used;
+    a->used += size;
+    return p;
+}
+
+/*
+Forget everything allocated, keeping one block for the next request. For a request that fit in one block
+(nearly all of them) this is just used = 0.
+*/
+void arena_reset(struct arena* a) {
+    while (a->head != NULL && (a->head->next != NULL || a->head->size != ARENA_BLOCK_DATA)) {
+        struct arena_block* b = a->head;
+        a->head = b->next;
+        arena_block_put(b);
+    }
+    a->used = 0;
+}
+
+// give every block back to this thread's pool, when the connection closes
+void arena_release(struct arena* a) {
+    while (a->head != NULL) {
+        struct arena_block* b = a->head;
+        a->head = b->next;
+        arena_block_put(b);
+    }
+    a->used = 0;
+}
+
+void arena_stats(char* buf, size_t cap) {
+    snprintf(buf, cap, "arenas: blocks malloced %lu oversized %lu\n",
+        arena_stats_counters.malloced.load(), arena_stats_counters.oversized.load());
+}
+
+#endif
@@ -0,0 +1,94 @@
+/*
+File: bench/bench_fib.c
+Description: per-request cost of fib.cgi's Fibonacci computation across the
+    range of n: the old doubly recursive fib() (small n only, it is
+    exponential), fib_mod() and fib_exact() from fib_engine.h.
+    Before timing it checks that fib_exact(n) mod 1,000,000,007 agrees
+    with fib_mod(n), so a broken kernel doesn't produce nice numbers.
+Usage: bench_fib [-t seconds per measurement]
+*/
+
+// std io functions
+#include <stdio.h>
+
+// std lib
+#include <stdlib.h>
+
+// string
+#include <string.h>
+
+// timing
+#include <time.h>
+
+#include "../fib_engine.h"
+
+double budget = 0.2; // seconds spent on each measurement
+
+int fib_recursive(int n) { // what fib.cpp used to do
+    if (n <= 1)
+        return n;
+    return fib_recursive(n - 1) + fib_recursive(n - 2);
+}
+
+double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+volatile uint64_t sink; // keeps the compiler from dropping the work
+
+// runs f(n) until the budget is spent, returns microseconds per call
+template <typename F>
+double time_per_call(F f, uint64_t n) {
+    long calls = 0;
+    double start = now_sec(), elapsed;
+    do {
+        for (int i = 0; i < 16; i++) { // don't let the clock reads dominate the tiny cases
+            f(n);
+        }
+        calls += 16;
+        elapsed = now_sec() - start;
+    } while (elapsed < budget);
+    return elapsed / calls * 1e6;
+}
+
+// decimal string mod FIB_MOD
+uint64_t string_mod(const std::string& s) {
+    uint64_t r = 0;
+    for (size_t i = 0; i < s.size(); i++) {
+        r = (r * 10 + (s[i] - '0')) % FIB_MOD;
+    }
+    return r;
+}
+
+int main(int argc, char* argv[]) {
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "-t") == 0) budget = atof(argv[i + 1]);
+    }
+
+    uint64_t checks[] = {0, 1, 2, 45, 93, 94, 95, 100, 1000, 4097, 10000, 65535, 100000};
+    for (size_t i = 0; i < sizeof checks / sizeof checks[0]; i++) {
+        if (string_mod(fib_exact(checks[i])) != fib_mod(checks[i])) {
+            printf("MISMATCH at n=%lu\n", (unsigned long) checks[i]);
+            return 1;
+        }
+    }
+    printf("fib_exact and fib_mod agree on %lu values of n\n\n", (unsigned long) (sizeof checks / sizeof checks[0]));
+
+    printf("%-22s %12s %14s %14s\n", "n", "recursive us", "fib_mod us", "fib_exact us");
+    uint64_t ns[] = {10, 30, 35, 90, 1000, 10000, 100000, 1000000000ULL, 18446744073709551615ULL};
+    for (size_t i = 0; i < sizeof ns / sizeof ns[0]; i++) {
+        uint64_t n = ns[i];
+        char recursive[32] = "-", exact[32] = "-";
+        if (n <= 35) {
+            snprintf(recursive, sizeof recursive, "%.3f", time_per_call([](uint64_t k) { sink = fib_recursive((int) k); }, n));
+        }
+        double mod = time_per_call([](uint64_t k) { sink = fib_mod(k); }, n);
+        if (n <= FIB_EXACT_MAX) {
+            snprintf(exact, sizeof exact, "%.3f", time_per_call([](uint64_t k) { sink = fib_exact(k).size(); }, n));
+        }
+        printf("%-22lu %12s %14.3f %14s\n", (unsigned long) n, recursive, mod, exact);
+    }
+    return 0;
+}
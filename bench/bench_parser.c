@@ -0,0 +1,231 @@
+/*
+File: bench/bench_parser.c
+Description: request parsing throughput, http_parser.h with each of its
+    line scanners (libc memchr(), SSE2, AVX2) against the strstr() + strtok() +
+    strcasestr() parsing wserver used before it.
+    Before timing anything it checks that every scanner gives the same
+    answer, for whole requests and for requests fed one byte at a time the
+    way a slow client would send them, and that malformed requests are
+    refused. It exits with status 1 if any check fails.
+    Three request shapes: a minimal one, a browser-like one with a dozen
+    headers, and one with a 4 KB cookie (where the wide scans pay off).
+Usage: bench_parser [-n requests per measurement]
+*/
+
+// std io functions
+#include <stdio.h>
+
+// std lib
+#include <stdlib.h>
+
+// string
+#include <string.h>
+
+// timing
+#include <time.h>
+
+// stl
+#include <string>
+
+#include "../http_parser.h"
+
+double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+const char* scan_names[] = {"memchr", "sse2", "avx2"};
+
+std::string small_request() {
+    return "GET /index.html HTTP/1.1\r\nHost: localhost\r\n\r\n";
+}
+
+std::string browser_request() {
+    return "GET /fib.cgi?user=me&n=30 HTTP/1.1\r\n"
+        "Host: www.example.com:10500\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0\r\n"
+        "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+        "Accept-Language: en-US,en;q=0.5\r\n"
+        "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+        "Referer: http://www.example.com:10500/index.html\r\n"
+        "Connection: keep-alive\r\n"
+        "Upgrade-Insecure-Requests: 1\r\n"
+        "Sec-Fetch-Dest: document\r\n"
+        "Sec-Fetch-Mode: navigate\r\n"
+        "Sec-Fetch-Site: same-origin\r\n"
+        "Priority: u=0, i\r\n"
+        "\r\n";
+}
+
+std::string cookie_request() {
+    std::string cookie;
+    while (cookie.size() < 4096) {
+        char pair[64];
+        snprintf(pair, sizeof pair, "session_%lu=%016lx; ", (unsigned long) cookie.size(), (unsigned long) cookie.size() * 2654435761UL);
+        cookie += pair;
+    }
+    return "GET /index.html HTTP/1.1\r\nHost: localhost\r\nCookie: " + cookie + "\r\nConnection: close\r\n\r\n";
+}
+
+// everything the parser found, as one string, so two parses can be compared
+std::string describe(int rv, const struct http_request* req) {
+    if (rv != HTTP_PARSE_DONE) {
+        return "rv " + std::to_string(rv);
+    }
+    std::string d = std::string(req->method.p, req->method.len) + "|" + std::string(req->path.p, req->path.len) + "|"
+        + std::string(req->query.p, req->query.len) + "|" + std::string(req->version.p, req->version.len) + "|"
+        + std::to_string(req->length) + "|" + std::to_string(http_keep_alive(req));
+    for (int i = 0; i < req->header_count; i++) {
+        d += "|" + std::string(req->headers[i].name.p, req->headers[i].name.len) + "="
+            + std::string(req->headers[i].value.p, req->headers[i].value.len);
+    }
+    return d;
+}
+
+std::string parse_whole(const std::string& text) {
+    struct http_parser parser;
+    struct http_request req;
+    http_parser_init(&parser);
+    int rv = http_parse(&parser, text.data(), text.size(), &req);
+    return describe(rv, &req);
+}
+
+// the same request arriving one byte per read
+std::string parse_bytewise(const std::string& text) {
+    struct http_parser parser;
+    struct http_request req;
+    http_parser_init(&parser);
+    int rv = HTTP_PARSE_INCOMPLETE;
+    for (size_t len = 1; len <= text.size() && rv == HTTP_PARSE_INCOMPLETE; len++) {
+        rv = http_parse(&parser, text.data(), len, &req);
+    }
+    return describe(rv, &req);
+}
+
+int failures = 0;
+int checking = HTTP_SCAN_MEMCHR; // scanner under test, for the failure message
+
+void expect(const char* what, const std::string& got, const std::string& want) {
+    if (got != want) {
+        printf("FAIL %s (%s scanner):\n  got  %s\n  want %s\n", what, scan_names[checking], got.c_str(), want.c_str());
+        failures++;
+    }
+}
+
+// every scanner this cpu has must agree with memchr(), whole and byte by byte
+void self_check(int top) {
+    std::string many_headers = "GET / HTTP/1.1\r\n";
+    for (int i = 0; i <= HTTP_MAX_HEADERS; i++) {
+        many_headers += "X-H" + std::to_string(i) + ": v\r\n";
+    }
+    many_headers += "\r\n";
+    std::string cases[] = {
+        small_request(), browser_request(), cookie_request(),
+        "GET /a?b=c HTTP/1.1\r\nConnection:  Upgrade , CLOSE \r\n\r\nGET /next HTTP/1.1\r\n\r\n", // pipelined
+        "GET / HTTP/1.1\r\nHost: x\r\n", // incomplete
+        "GET / HTTP/1.1\nHost: x\n\n", // bare LF
+        "GET / HTTP/1.1\r\nHost : x\r\n\r\n", // space before the colon
+        "GET / HTTP/1.1\r\nHost: x\r\n folded\r\n\r\n", // obs-fold
+        "GET /HTTP/1.1\r\n\r\n", // no version
+        "\r\n\r\n",
+        many_headers,
+    };
+    size_t count = sizeof cases / sizeof cases[0];
+
+    http_parser_use(HTTP_SCAN_MEMCHR);
+    std::string want[sizeof cases / sizeof cases[0]];
+    for (size_t i = 0; i < count; i++) {
+        want[i] = parse_whole(cases[i]);
+        expect("byte by byte", parse_bytewise(cases[i]), want[i]);
+    }
+    // spot checks of what the memchr() parse itself says
+    expect("minimal", want[0], "GET|/index.html||HTTP/1.1|45|1|Host=localhost");
+    expect("keep-alive token", want[3].substr(0, want[3].find("|Connection")), "GET|/a|b=c|HTTP/1.1|54|0");
+    expect("incomplete", want[4], "rv 0");
+    for (size_t i = 5; i < 10; i++) {
+        expect("malformed", want[i], "rv -1");
+    }
+    expect("too many headers", want[10], "rv -2");
+
+    for (int kind = HTTP_SCAN_SSE2; kind <= top; kind++) {
+        checking = http_parser_use((enum http_scan_kind) kind);
+        for (size_t i = 0; i < count; i++) {
+            expect("whole", parse_whole(cases[i]), want[i]);
+            expect("byte by byte", parse_bytewise(cases[i]), want[i]);
+        }
+    }
+}
+
+// mean nanoseconds per request for the old parsing: strstr() for the end, strtok() for the request line, strcasestr() for Connection
+double measure_strtok(const std::string& text, int n) {
+    char* buffer = (char*) malloc(text.size() + 1);
+    size_t sink = 0;
+    double start = now_sec();
+    for (int i = 0; i < n; i++) {
+        memcpy(buffer, text.c_str(), text.size() + 1); // strtok() writes into it
+        char* end = strstr(buffer, "\r\n\r\n");
+        int keep_alive = strcasestr(buffer, "\r\nConnection:") == NULL || strcasestr(buffer, "close") == NULL;
+        char* method = strtok(buffer, " ");
+        char* path = strtok(NULL, " ");
+        char* protocol = strtok(NULL, "\r\n");
+        sink += (end - buffer) + keep_alive + (method != NULL) + (path != NULL) + (protocol != NULL);
+    }
+    double ns = (now_sec() - start) / n * 1e9;
+    free(buffer);
+    if (sink == 1) printf(" "); // keep the loop from being optimized away
+    return ns;
+}
+
+// the same with http_parse(), including the copy so both pay for it
+double measure_parser(const std::string& text, int n) {
+    char* buffer = (char*) malloc(text.size() + 1);
+    size_t sink = 0;
+    double start = now_sec();
+    for (int i = 0; i < n; i++) {
+        memcpy(buffer, text.c_str(), text.size() + 1);
+        struct http_parser parser;
+        struct http_request req;
+        http_parser_init(&parser);
+        sink += http_parse(&parser, buffer, text.size(), &req) + req.header_count + http_keep_alive(&req);
+    }
+    double ns = (now_sec() - start) / n * 1e9;
+    free(buffer);
+    if (sink == 1) printf(" ");
+    return ns;
+}
+
+int main(int argc, char* argv[]) {
+    int n = 1000000;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            n = atoi(argv[++i]);
+        }
+    }
+
+    int top = http_parser_use(HTTP_SCAN_AVX2);
+    self_check(top);
+    if (failures > 0) {
+        printf("%d self checks failed\n", failures);
+        return 1;
+    }
+    printf("self check passed (scanners up to %s)\n\n", scan_names[top]);
+
+    std::string names[] = {"small", "browser", "cookie"};
+    std::string requests[] = {small_request(), browser_request(), cookie_request()};
+    printf("%-10s %7s %14s", "request", "bytes", "strtok ns");
+    for (int kind = HTTP_SCAN_MEMCHR; kind <= top; kind++) {
+        printf(" %10s ns", scan_names[kind]);
+    }
+    printf("\n");
+    for (int r = 0; r < 3; r++) {
+        int reps = requests[r].size() > 1000 ? n / 10 : n;
+        printf("%-10s %7lu %14.1f", names[r].c_str(), (unsigned long) requests[r].size(), measure_strtok(requests[r], reps));
+        for (int kind = HTTP_SCAN_MEMCHR; kind <= top; kind++) {
+            http_parser_use((enum http_scan_kind) kind);
+            printf(" %13.1f", measure_parser(requests[r], reps));
+        }
+        printf("\n");
+    }
+    return 0;
+}
@@ -0,0 +1,124 @@
+/*
+File: bench/bench_queue.c
+Description: microbenchmark of the producer -> worker handoff.
+    Compares the original buffer (std::queue under a mutex, guarded by
+    full/empty semaphores) with conn_queue.h (lock-free ring, futex parking).
+    One producer pushes items as fast as it can, each consumer pops and
+    records how long the item sat between push and pop.
+    Prints throughput and handoff latency percentiles for each.
+Usage: bench_queue [-c consumers] [-b buffer] [-n items]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include <queue>
+#include <vector>
+#include <algorithm>
+
+#include "../conn_queue.h"
+
+int consumers = 4;
+int buffer = 64;
+int items = 1000000;
+
+std::vector<long> push_time; // ns timestamp of each item's push, indexed by item
+std::vector<long> handoff_ns; // push -> pop latency of each item
+
+long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// ---- the original buffer from wserver.c ----
+sem_t full, empty;
+pthread_mutex_t queue_mutex;
+std::queue<int> old_q;
+
+void* old_consume(void* arg) {
+    (void) arg;
+    while (1) {
+        sem_wait(&full);
+        pthread_mutex_lock(&queue_mutex);
+        int item = old_q.front();
+        old_q.pop();
+        pthread_mutex_unlock(&queue_mutex);
+        sem_post(&empty);
+        if (item < 0) return NULL; // end marker
+        handoff_ns[item] = now_ns() - push_time[item];
+    }
+}
+
+void old_push(int item) {
+    sem_wait(&empty);
+    pthread_mutex_lock(&queue_mutex);
+    old_q.push(item);
+    pthread_mutex_unlock(&queue_mutex);
+    sem_post(&full);
+}
+
+// ---- conn_queue.h ----
+struct conn_queue new_q;
+
+void* new_consume(void* arg) {
+    (void) arg;
+    while (1) {
+        int item = conn_queue_pop(&new_q);
+        if (item < 0) return NULL;
+        handoff_ns[item] = now_ns() - push_time[item];
+    }
+}
+
+void new_push(int item) {
+    conn_queue_push(&new_q, item);
+}
+
+void run(const char* name, void* (*consume)(void*), void (*push)(int)) {
+    std::vector<pthread_t> threads(consumers);
+    for (int i = 0; i < consumers; i++) {
+        pthread_create(&threads[i], NULL, consume, NULL);
+    }
+
+    long start = now_ns();
+    for (int i = 0; i < items; i++) {
+        push_time[i] = now_ns();
+        push(i);
+    }
+    for (int i = 0; i < consumers; i++) {
+        push(-1);
+    }
+    for (int i = 0; i < consumers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double secs = (now_ns() - start) / 1e9;
+
+    std::vector<long> sorted(handoff_ns);
+    std::sort(sorted.begin(), sorted.end());
+    printf("%-28s %10.0f items/sec  handoff p50 %6ldns  p99 %8ldns  p99.9 %8ldns\n", name, items / secs,
+        sorted[items * 50 / 100], sorted[items * 99 / 100], sorted[(long) items * 999 / 1000]);
+}
+
+int main(int argc, char* argv[]) {
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "-c") == 0) consumers = atoi(argv[i+1]);
+        else if (strcmp(argv[i], "-b") == 0) buffer = atoi(argv[i+1]);
+        else if (strcmp(argv[i], "-n") == 0) items = atoi(argv[i+1]);
+    }
+    push_time.resize(items);
+    handoff_ns.resize(items);
+    printf("1 producer, %d consumers, buffer %d, %d items\n", consumers, buffer, items);
+
+    sem_init(&full, 0, 0);
+    sem_init(&empty, 0, buffer);
+    pthread_mutex_init(&queue_mutex, NULL);
+    run("std::queue + mutex + sems", old_consume, old_push);
+
+    conn_queue_init(&new_q, buffer);
+    run("conn_queue (lock-free ring)", new_consume, new_push);
+    return 0;
+}
@@ -0,0 +1,118 @@
+/*
+File: bench/bench_spawn.c
+Description: how long launching a CGI program takes as the launching
+    process grows, with fork() + execve() (how wserver -g 0 used to start
+    fib.cgi) and with posix_spawn() (cgi_spawn.h).
+    For each size the process first allocates and touches that many MB, as
+    a server's file and dynamic caches would, then times spawning the
+    program and waiting for it to exit. fork() has to copy page tables for
+    all of it, posix_spawn() borrows the parent's memory until the exec.
+Usage: bench_spawn [-n spawns per measurement] [-p program] [MB ...]
+    e.g. bench/bench_spawn -n 200 0 256 1024
+*/
+
+// std io functions
+#include <stdio.h>
+
+// std lib
+#include <stdlib.h>
+
+// string
+#include <string.h>
+
+// timing
+#include <time.h>
+
+// stl
+#include <vector>
+
+// processes
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "../cgi_spawn.h"
+
+double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+const char* program = "/bin/true";
+
+void fork_exec() {
+    char* args[] = {(char*) program, NULL};
+    char* env[] = {(char*) "QUERY_STRING=n=10", NULL};
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        execve(program, args, env);
+        _exit(127);
+    }
+    waitpid(pid, NULL, 0);
+}
+
+struct arena scratch;
+
+void spawn() {
+    char* args[] = {(char*) program, NULL};
+    pid_t pid = cgi_spawn(program, args, cgi_environment(&scratch, "fib.cgi", "n=10"), -1, STDOUT_FILENO);
+    arena_reset(&scratch);
+    if (pid == -1) {
+        perror("posix_spawn");
+        exit(1);
+    }
+    waitpid(pid, NULL, 0);
+}
+
+// mean microseconds per launch
+double measure(void (*launch)(), int n) {
+    launch(); // warm up
+    double start = now_sec();
+    for (int i = 0; i < n; i++) {
+        launch();
+    }
+    return (now_sec() - start) / n * 1e6;
+}
+
+int main(int argc, char* argv[]) {
+    int n = 200;
+    std::vector<long> sizes;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            n = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            program = argv[++i];
+        } else {
+            sizes.push_back(atol(argv[i]));
+        }
+    }
+    arena_init(&scratch);
+    if (sizes.empty()) {
+        long defaults[] = {0, 64, 256, 1024};
+        sizes.assign(defaults, defaults + 4);
+    }
+
+    printf("%8s %18s %18s\n", "RSS MB", "fork+execve us", "posix_spawn us");
+    char* held = NULL;
+    long held_mb = 0;
+    for (size_t i = 0; i < sizes.size(); i++) {
+        if (sizes[i] > held_mb) { // grow to the requested size, touching every page so it is really resident
+            held = (char*) realloc(held, sizes[i] << 20);
+            if (held == NULL) {
+                perror("realloc");
+                return 1;
+            }
+            memset(held + (held_mb << 20), 1, (sizes[i] - held_mb) << 20);
+            held_mb = sizes[i];
+        }
+        double f = measure(fork_exec, n);
+        double s = measure(spawn, n);
+        printf("%8ld %18.1f %18.1f\n", held_mb, f, s);
+    }
+    free(held);
+    return 0;
+}
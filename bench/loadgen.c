@@ -0,0 +1,193 @@
+/*
+File: bench/loadgen.c
+Description: loadgen is a closed-loop load generator for wserver.
+    Each thread keeps one request in flight: connect, send a GET,
+    read the response until the server closes, repeat. When the
+    duration is over it prints requests/sec and latency percentiles.
+    With -x a mixed workload is sent: -f percent of the requests go to the
+    -x path (say an expensive fib.cgi) and the rest to -u, and the latency
+    of each kind is printed on its own line.
+    Used by bench/scaling.sh and bench/mixed.sh.
+Usage: loadgen [-s server] [-p port] [-c connections] [-d seconds] [-u path] [-x path] [-f percent]
+*/
+
+// std io functions
+#include <stdio.h>
+
+// std lib
+#include <stdlib.h>
+
+// string
+#include <string.h>
+
+// unix socket
+#include <unistd.h>
+
+// network
+#include <netdb.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+// threads and timing
+#include <pthread.h>
+#include <time.h>
+
+// stl
+#include <vector>
+#include <algorithm>
+
+const char* server = "127.0.0.1";
+const char* port = "10401";
+const char* path = "index.html";
+const char* mix_path = NULL; // -x
+int mix_percent = 10; // -f
+int connections = 8;
+int duration = 5;
+
+struct addrinfo* servinfo;
+volatile int running = 1;
+
+struct worker_result {
+    long requests;
+    long errors;
+    std::vector<double> latencies_us;
+    std::vector<double> mix_latencies_us; // requests for the -x path
+};
+
+double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// one full request/response on a fresh connection, returns 0 on success
+int do_request(const char* request, size_t request_len) {
+    int fd = socket(servinfo->ai_family, servinfo->ai_socktype, servinfo->ai_protocol);
+    if (fd == -1) {
+        return -1;
+    }
+    if (connect(fd, servinfo->ai_addr, servinfo->ai_addrlen) == -1) {
+        close(fd);
+        return -1;
+    }
+    if (write(fd, request, request_len) != (ssize_t) request_len) {
+        close(fd);
+        return -1;
+    }
+    char buf[16384];
+    ssize_t n;
+    ssize_t total = 0;
+    while ((n = read(fd, buf, sizeof buf)) > 0) {
+        total += n;
+    }
+    close(fd);
+    return (n == 0 && total > 0) ? 0 : -1;
+}
+
+void* run_worker(void* arg) {
+    worker_result* result = (worker_result*) arg;
+    char request[1024];
+    int len = snprintf(request, sizeof request, "GET /%s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n", path, server);
+    char mix_request[1024];
+    int mix_len = 0;
+    if (mix_path != NULL) {
+        mix_len = snprintf(mix_request, sizeof mix_request, "GET /%s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n", mix_path, server);
+    }
+    unsigned seed = (unsigned) (size_t) result; // differs per thread
+
+    while (running) {
+        int mixed = mix_path != NULL && (int) (rand_r(&seed) % 100) < mix_percent;
+        double start = now_us();
+        if (do_request(mixed ? mix_request : request, mixed ? mix_len : len) == 0) {
+            result->requests++;
+            (mixed ? result->mix_latencies_us : result->latencies_us).push_back(now_us() - start);
+        } else {
+            result->errors++;
+        }
+    }
+    return NULL;
+}
+
+void print_percentiles(const char* label, std::vector<double>& latencies) {
+    std::sort(latencies.begin(), latencies.end());
+    double p50 = latencies.empty() ? 0 : latencies[latencies.size() * 50 / 100];
+    double p99 = latencies.empty() ? 0 : latencies[latencies.size() * 99 / 100];
+    double p999 = latencies.empty() ? 0 : latencies[latencies.size() * 999 / 1000];
+    if (label[0] != '\0') {
+        printf("%s %lu requests", label, (unsigned long) latencies.size());
+    }
+    printf("  p50: %.0fus  p99: %.0fus  p99.9: %.0fus", p50, p99, p999);
+}
+
+void parse_argv(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i+=2) {
+        if ((i+1) >= argc) {
+            fprintf(stderr, "specifier does not have corresponding value.\n");
+            exit(1);
+        }
+        if (strcmp("-s", argv[i]) == 0) server = argv[i+1];
+        else if (strcmp("-p", argv[i]) == 0) port = argv[i+1];
+        else if (strcmp("-c", argv[i]) == 0) connections = atoi(argv[i+1]);
+        else if (strcmp("-d", argv[i]) == 0) duration = atoi(argv[i+1]);
+        else if (strcmp("-u", argv[i]) == 0) path = argv[i+1];
+        else if (strcmp("-x", argv[i]) == 0) mix_path = argv[i+1];
+        else if (strcmp("-f", argv[i]) == 0) mix_percent = atoi(argv[i+1]);
+        else {
+            fprintf(stderr, "setup improperly formatted.\n");
+            exit(1);
+        }
+    }
+    if (connections < 1 || duration < 1 || mix_percent < 0 || mix_percent > 100) {
+        fprintf(stderr, "connections and duration must be positive integers, percent between 0 and 100.\n");
+        exit(1);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    parse_argv(argc, argv);
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    int rv;
+    if ((rv = getaddrinfo(server, port, &hints, &servinfo)) != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+        exit(1);
+    }
+
+    std::vector<pthread_t> threads(connections);
+    std::vector<worker_result> results(connections);
+    for (int i = 0; i < connections; i++) {
+        results[i].requests = 0;
+        results[i].errors = 0;
+        pthread_create(&threads[i], NULL, run_worker, &results[i]);
+    }
+    sleep(duration);
+    running = 0;
+
+    long requests = 0, errors = 0;
+    std::vector<double> all, mix;
+    for (int i = 0; i < connections; i++) {
+        pthread_join(threads[i], NULL);
+        requests += results[i].requests;
+        errors += results[i].errors;
+        all.insert(all.end(), results[i].latencies_us.begin(), results[i].latencies_us.end());
+        mix.insert(mix.end(), results[i].mix_latencies_us.begin(), results[i].mix_latencies_us.end());
+    }
+
+    printf("requests/sec: %.1f  errors: %ld", (double) requests / duration, errors);
+    if (mix_path == NULL) {
+        print_percentiles("", all);
+        printf("\n");
+    } else {
+        printf("\n");
+        print_percentiles("  -u", all);
+        printf("\n");
+        print_percentiles("  -x", mix);
+        printf("\n");
+    }
+
+    freeaddrinfo(servinfo);
+    return 0;
+}
@@ -0,0 +1,25 @@
+#!/bin/sh
+# mixed.sh: tail latency of cheap static requests mixed with expensive fib.cgi requests,
+# with the shared FIFO (-q shared) and with work stealing (-q steal).
+#
+# Usage: bench/mixed.sh [wserver binary] [threads] [connections] [seconds] [cgi percent] [n]
+#   run from the repo root after "make bench" (the server serves files from its working directory).
+#   e.g. bench/mixed.sh ./wserver 8 32 10 5 30
+
+SERVER=${1:-./wserver}
+THREADS=${2:-8}
+CONNS=${3:-32}
+SECS=${4:-10}
+PERCENT=${5:-5}
+N=${6:-30}
+PORT=10498
+
+for q in shared steal; do
+    $SERVER -p $PORT -t $THREADS -b 64 -q $q &
+    pid=$!
+    sleep 0.5
+    echo "-q $q -t $THREADS, $PERCENT% fib.cgi n=$N"
+    ./bench/loadgen -p $PORT -c $CONNS -d $SECS -u index.html -x "fib.cgi?user=me&n=$N" -f $PERCENT
+    kill $pid
+    wait $pid 2>/dev/null
+done
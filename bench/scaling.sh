@@ -0,0 +1,24 @@
+#!/bin/sh
+# scaling.sh: requests/sec of wserver against the number of worker threads (-t).
+#
+# Usage: bench/scaling.sh [wserver binary] [path] [connections] [seconds]
+#   run from the repo root after "make bench" (the server serves files from its working directory).
+#   To compare before/after a change, build the old wserver somewhere else and pass its path.
+#   e.g. bench/scaling.sh ./wserver index.html 32 5
+#        bench/scaling.sh ./wserver "fib.cgi?user=me&n=20" 32 5
+
+SERVER=${1:-./wserver}
+URLPATH=${2:-index.html}
+CONNS=${3:-32}
+SECS=${4:-5}
+PORT=10499
+
+for t in 1 2 4 8 16 32; do
+    $SERVER -p $PORT -t $t -b 64 &
+    pid=$!
+    sleep 0.5
+    printf "%-6s -t %-3s " "$(basename $SERVER)" "$t"
+    ./bench/loadgen -p $PORT -c $CONNS -d $SECS -u "$URLPATH"
+    kill $pid
+    wait $pid 2>/dev/null
+done
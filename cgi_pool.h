@@ -0,0 +1,178 @@
+/*
+File: cgi_pool.h
+Description: pool of long-lived fib.cgi worker processes (FastCGI style).
+    Forking the multi-threaded server and execve()ing a fresh fib.cgi costs
+    far more than computing most answers, so with -g <size> the server
+    starts <size> "fib.cgi --loop" processes once and keeps them.
+    Each worker is connected to the server by a UNIX socketpair (its stdin
+    and stdout), a request is one frame with the query string and the
+    answer is one frame with the HTTP response (see read_frame()/
+    write_frame() in http_messaging.h).
+    A thread borrows an idle worker, exchanges one request with it and
+    gives it back, so a worker only ever has one request in flight.
+    A worker that dies (crash, kill) is replaced by a new one the next
+    time it is borrowed.
+*/
+
+#ifndef CGI_POOL_H
+#define CGI_POOL_H
+
+// stdlib
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <signal.h>
+
+// processes and sockets
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+// concurrency control
+#include <pthread.h>
+#include <atomic>
+
+// stl
+#include <vector>
+
+#include "http_messaging.h"
+#include "cgi_spawn.h"
+
+struct cgi_worker {
+    pid_t pid;
+    int fd; // server's end of the socketpair, -1 if the worker has to be (re)started
+};
+
+struct cgi_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t idle_cond; // signalled when a worker is given back
+    std::vector<struct cgi_worker> idle;
+    int size;
+    const char* program;
+
+    // for the stats thread
+    std::atomic<unsigned long> requests;
+    std::atomic<unsigned long> restarts;
+};
+
+/*
+Start one worker: spawn "program --loop" with its stdin/stdout on its end of a socketpair (cgi_spawn.h).
+The server's end is close-on-exec, so workers started later don't hold each other's sockets.
+Returns 0, or -1 if the socketpair or spawn failed.
+*/
+int cgi_worker_start(struct cgi_pool* pool, struct cgi_worker* worker) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == -1) {
+        perror("socketpair");
+        return -1;
+    }
+    char* args[] = {(char*) pool->program, (char*) "--loop", NULL};
+    char* env[] = {NULL}; // workers get their queries in frames, not in the environment
+    pid_t pid = cgi_spawn(pool->program, args, env, fds[1], fds[1]);
+    close(fds[1]);
+    if (pid == -1) {
+        perror("server: posix_spawn");
+        close(fds[0]);
+        return -1;
+    }
+    worker->pid = pid;
+    worker->fd = fds[0];
+    return 0;
+}
+
+// the worker is gone or out of step with us, kill it, reap it and forget its socket
+void cgi_worker_stop(struct cgi_worker* worker) {
+    if (worker->fd != -1) {
+        close(worker->fd);
+        worker->fd = -1;
+    }
+    if (worker->pid > 0) {
+        kill(worker->pid, SIGKILL);
+        waitpid(worker->pid, NULL, 0); // quick, it is dead or dying, and only this thread waits for this pid
+        worker->pid = -1;
+    }
+}
+
+void cgi_pool_init(struct cgi_pool* pool, int size, const char* program) {
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->idle_cond, NULL);
+    pool->size = size;
+    pool->program = program;
+    pool->requests = 0;
+    pool->restarts = 0;
+    for (int i = 0; i < size; i++) {
+        struct cgi_worker worker;
+        worker.pid = -1;
+        worker.fd = -1;
+        cgi_worker_start(pool, &worker); // a worker that failed to start is retried when it's borrowed
+        pool->idle.push_back(worker);
+    }
+}
+
+// blocks until a worker is idle
+struct cgi_worker cgi_pool_acquire(struct cgi_pool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->idle.empty()) {
+        pthread_cond_wait(&pool->idle_cond, &pool->lock);
+    }
+    struct cgi_worker worker = pool->idle.back();
+    pool->idle.pop_back();
+    pthread_mutex_unlock(&pool->lock);
+    return worker;
+}
+
+void cgi_pool_release(struct cgi_pool* pool, struct cgi_worker worker) {
+    pthread_mutex_lock(&pool->lock);
+    pool->idle.push_back(worker);
+    pthread_cond_signal(&pool->idle_cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+Send query to a worker and wait for its response.
+Returns the response length (the bytes are in *response, which the caller frees), or -1 if the worker died
+answering it. A worker found dead before the query was sent (write fails) is restarted and the query tried
+once more; one that dies while answering is restarted too, but the query isn't retried, it may be what
+killed it.
+*/
+ssize_t cgi_pool_exchange(struct cgi_pool* pool, const char* query, char** response) {
+    pool->requests.fetch_add(1, std::memory_order_relaxed);
+    struct cgi_worker worker = cgi_pool_acquire(pool);
+    ssize_t length = -1;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (worker.fd == -1) {
+            pool->restarts.fetch_add(1, std::memory_order_relaxed);
+            if (cgi_worker_start(pool, &worker) == -1) {
+                break;
+            }
+        }
+        if (write_frame(worker.fd, query, strlen(query)) == -1) {
+            cgi_worker_stop(&worker);
+            continue;
+        }
+        length = read_frame(worker.fd, response);
+        if (length == -1) {
+            cgi_worker_stop(&worker);
+        }
+        break;
+    }
+    cgi_pool_release(pool, worker);
+    return length;
+}
+
+// workers answering a request right now
+int cgi_pool_busy(struct cgi_pool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    int busy = pool->size - (int) pool->idle.size();
+    pthread_mutex_unlock(&pool->lock);
+    return busy;
+}
+
+void cgi_pool_stats(struct cgi_pool* pool, char* buf, size_t cap) {
+    snprintf(buf, cap, "cgi pool: workers %d requests %lu restarts %lu\n",
+        pool->size, pool->requests.load(), pool->restarts.load());
+}
+
+#endif
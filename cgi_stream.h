@@ -0,0 +1,694 @@
+/*
+File: cgi_stream.h
+Description: relays a forked CGI program's output to the client (wserver -g 0).
+    The child's stdout is a pipe to the server instead of the client's
+    socket, so the server sees the response before the client does.
+    The program prints CGI headers ("Status: 404 Not Found",
+    "Content-Type: ...", a full "HTTP/1.1 200 OK" status line is accepted
+    too), a blank line and the body. The server builds the real response
+    head with the response builder (Date, Connection, Server are its own),
+    then moves the body from the pipe to the socket with splice(), so body
+    bytes never pass through the server's memory.
+    Unless the owner wants the body of a 200 kept (the dynamic cache, -e):
+    then it is read from the pipe and sent from memory, with a copy kept
+    up to capture_max bytes and handed to captured() once the response
+    has gone out whole. A longer body stops being kept and goes back to
+    splice().
+    Without a Content-Length from the program the body is sent with
+    Transfer-Encoding: chunked, one chunk per batch of bytes sitting in the
+    pipe, so output of any size streams in bounded memory and the client
+    still knows where the response ends. Either way the connection can
+    carry further requests afterwards.
+    With -o a compressible 200 for a client that accepts gzip is read from
+    the pipe instead, compressed (compress.h) and sent chunked, since its
+    compressed length is only known at the end.
+    A 204 or 304 goes out with no body and no framing at all.
+    Output past CGI_MAX_OUTPUT is cut off: the pipe is closed (the program
+    dies of SIGPIPE on its next write) and so is the connection. A
+    Content-Length past it is refused with a 502 before anything is sent.
+    The relay doesn't hold a thread: the pipe and the socket are
+    non-blocking and the child watch's poller (child_watch.h) moves the
+    response along whenever one of them is ready, so the thread that
+    spawned the program goes straight back to serving. Once the response
+    is over the connection is handed back to its owner through done().
+*/
+
+#ifndef CGI_STREAM_H
+#define CGI_STREAM_H
+
+// stdlib
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+
+// pipes, splice() and poll()
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h> // TCP_NODELAY
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+
+// concurrency control
+#include <atomic>
+
+// stl
+#include <string>
+
+#include "http_messaging.h"
+#include "compress.h"
+#include "child_watch.h"
+
+#define CGI_HEADER_MAX 8192 // the program's whole header section must fit
+#define CGI_MAX_OUTPUT (64L * 1024 * 1024) // body bytes relayed before the response is cut off
+#define CGI_GZIP_BATCH 32768 // bytes read from the pipe and compressed (or kept) at a time
+
+struct cgi_head {
+    int code;
+    std::string reason;
+    std::string headers; // "Name: value\r\n" lines, without Connection, Content-Length, Date, Server and Transfer-Encoding
+    int has_content_type;
+    long content_length; // -1 if the program didn't give one
+};
+
+// for the stats thread
+struct cgi_stream_counters {
+    std::atomic<unsigned long> responses;
+    std::atomic<unsigned long> chunked;
+    std::atomic<unsigned long> bytes; // body bytes relayed
+    std::atomic<unsigned long> bad_gateway; // no (valid) header section
+    std::atomic<unsigned long> cut_off; // short, too long, or the client went away
+};
+struct cgi_stream_counters cgi_streams;
+
+/*
+Parse a header section (everything before the blank line, lines ending in "\r\n" or just "\n").
+The first line may be an HTTP status line, otherwise the status comes from a "Status:" header and
+defaults to 200 OK. Returns 0, or -1 if a line isn't a header.
+*/
+int cgi_parse_head(const char* data, size_t len, struct cgi_head* head) {
+    head->code = 200;
+    head->reason = "OK";
+    head->headers.clear();
+    head->has_content_type = 0;
+    head->content_length = -1;
+    size_t pos = 0;
+    int first = 1;
+    while (pos < len) {
+        const char* nl = (const char*) memchr(data + pos, '\n', len - pos);
+        size_t end = nl != NULL ? (size_t) (nl - data) : len;
+        std::string line(data + pos, end - pos);
+        pos = end + 1;
+        if (!line.empty() && line[line.size() - 1] == '\r') {
+            line.erase(line.size() - 1);
+        }
+        if (line.empty()) {
+            continue;
+        }
+        int status_line = first && line.compare(0, 7, "HTTP/1.") == 0 && line.size() >= 12;
+        first = 0;
+        if (status_line) {
+            head->code = atoi(line.c_str() + 9);
+            head->reason = line.size() > 13 ? line.substr(13) : "";
+            continue;
+        }
+        size_t colon = line.find(':');
+        if (colon == std::string::npos || colon == 0) {
+            return -1;
+        }
+        std::string name = line.substr(0, colon);
+        const char* value = line.c_str() + colon + 1;
+        while (*value == ' ' || *value == '\t') value++;
+        if (strcasecmp(name.c_str(), "Status") == 0) {
+            head->code = atoi(value);
+            const char* reason = strchr(value, ' ');
+            head->reason = reason != NULL ? reason + 1 : "";
+        } else if (strcasecmp(name.c_str(), "Content-Length") == 0) {
+            head->content_length = atol(value);
+        } else if (strcasecmp(name.c_str(), "Connection") != 0 && strcasecmp(name.c_str(), "Date") != 0
+                && strcasecmp(name.c_str(), "Server") != 0 && strcasecmp(name.c_str(), "Transfer-Encoding") != 0) {
+            if (strcasecmp(name.c_str(), "Content-Type") == 0) {
+                head->has_content_type = 1;
+            }
+            head->headers += line + "\r\n";
+        }
+    }
+    if (head->code < 100 || head->code > 999) {
+        return -1;
+    }
+    return 0;
+}
+
+// length of the header section including its blank line, 0 if it isn't all in buf yet
+size_t cgi_head_length(const char* buf, size_t len) {
+    for (size_t i = 0; i + 1 < len; i++) {
+        if (buf[i] == '\n' && buf[i + 1] == '\n') {
+            return i + 2;
+        }
+        if (buf[i] == '\n' && buf[i + 1] == '\r' && i + 2 < len && buf[i + 2] == '\n') {
+            return i + 3;
+        }
+    }
+    return 0;
+}
+
+// what cgi_relay_step() is waiting for
+enum relay_wait {
+    RELAY_WAIT_PIPE, // the program's output
+    RELAY_WAIT_SOCKET, // room in the client's socket
+    RELAY_DONE
+};
+
+struct cgi_relay;
+
+// one of a relay's descriptors in the poller's epoll set
+struct relay_end {
+    struct watch_item item;
+    struct cgi_relay* relay;
+};
+
+/*
+One CGI response on its way from a program's stdout to the client. Both descriptors are non-blocking, the
+relay does whatever it can each time the poller (child_watch.h) wakes it and then waits on one of them, so
+a slow program or a slow client costs this struct, not a thread.
+*/
+struct cgi_relay {
+    struct relay_end pipe_end; // the pipe's entry in the poller's epoll set
+    struct relay_end socket_end; // the socket's, only added once the socket first fills up
+    int fd; // the client's socket
+    int pipe_fd; // the program's stdout
+    pid_t pid; // the program, reaped by the relay when the child watch couldn't take it, 0 otherwise
+    unsigned long watch_id; // the program's child watch entry, released with the connection, 0 for none
+    int keep_alive;
+    int gzip_level; // -o, 0 for off
+    int accepted; // the ENCODING_ bits of the request's Accept-Encoding
+    int socket_added;
+
+    // the program's header section, then the response head (and whatever body came along with it)
+    char head_buf[CGI_HEADER_MAX];
+    size_t got;
+    int head_done;
+    struct cgi_head head;
+    struct response_builder rb;
+    char* error_body; // the 502's body, MAXBUF bytes, only allocated for one
+
+    // the body
+    int chunked;
+    int gzip;
+    struct gzip_stream gz;
+    long length; // Content-Length, -1 while chunked
+    size_t body_read; // taken from the pipe
+    std::string out; // chunk framing, compressed output, bytes that came with the head: sent before any splice()
+    size_t out_pos;
+    size_t splice_left; // bytes to move from the pipe to the socket next
+    int finished; // the whole body is in out (or spliced), out holds the end of the response
+    int failed; // the connection has to be closed after whatever went out
+
+    // a 200's body kept for the owner, set up by the caller before cgi_relay_start()
+    size_t capture_max; // longest body worth keeping, 0 for none
+    int capturing; // still keeping, a body past capture_max or anything but a 200 isn't
+    std::string capture;
+    std::string capture_path; // the request's, for captured()
+    void (*captured)(struct cgi_relay* relay); // on the poller's thread, once the whole body is in capture
+
+    struct response_summary sent;
+
+    // called by the poller once the relay is over, with the pipe closed and the socket out of the poller's set
+    int (*done)(struct cgi_relay* relay, int reusable); // returns -1 to be called again shortly, 0 when it took the relay
+    void* owner;
+};
+
+// bytes sitting in the pipe, *eof is set when there are none and the program has closed its end
+ssize_t pipe_avail(int pipe_fd, int* eof) {
+    int avail = 0;
+    *eof = 0;
+    if (ioctl(pipe_fd, FIONREAD, &avail) == -1) {
+        return -1;
+    }
+    if (avail == 0) {
+        struct pollfd p = {pipe_fd, POLLIN, 0};
+        *eof = poll(&p, 1, 0) == 1 && (p.revents & POLLHUP) != 0;
+    }
+    return avail;
+}
+
+// keep len more bytes of the body, or stop keeping it once it grows past capture_max
+void relay_capture(struct cgi_relay* r, const char* data, size_t len) {
+    if (!r->capturing) {
+        return;
+    }
+    if (r->capture.size() + len > r->capture_max) {
+        r->capturing = 0;
+        std::string().swap(r->capture);
+        return;
+    }
+    r->capture.append(data, len);
+}
+
+void relay_append_chunk(struct cgi_relay* r, const char* data, size_t len) {
+    char size_line[32];
+    int size_len = snprintf(size_line, sizeof size_line, "%lx\r\n", (unsigned long) len);
+    r->out.append(size_line, size_len);
+    r->out.append(data, len);
+    r->out.append("\r\n", 2);
+}
+
+// the head's gone wrong: a 502 (with why) instead of the response, the program's output is dropped
+void relay_bad_gateway(struct cgi_relay* r, const char* why) {
+    cgi_streams.bad_gateway.fetch_add(1, std::memory_order_relaxed);
+    r->error_body = new char[MAXBUF];
+    char error[128];
+    snprintf(error, sizeof error, "%s", why);
+    char errnum[] = "502";
+    char reason[] = "Bad Gateway";
+    char msg[] = "Server could not complete this request.";
+    build_error_response(&r->rb, r->error_body, error, errnum, reason, msg, r->keep_alive);
+    r->finished = 1;
+}
+
+/*
+The program's header section is in (head_len bytes of head_buf, 0 if it never ended): build the response
+head in rb and decide how the body goes out.
+*/
+void relay_start_body(struct cgi_relay* r, size_t head_len) {
+    if (head_len == 0 || cgi_parse_head(r->head_buf, head_len, &r->head) == -1) {
+        relay_bad_gateway(r, "The CGI program did not send a valid header section");
+        return;
+    }
+    struct cgi_head* head = &r->head;
+    if (head->content_length > CGI_MAX_OUTPUT) {
+        relay_bad_gateway(r, "The CGI program's Content-Length is larger than the server relays");
+        return;
+    }
+    cgi_streams.responses.fetch_add(1, std::memory_order_relaxed);
+    const char* extra = r->head_buf + head_len;
+    size_t extra_len = r->got - head_len;
+
+    // 204 and 304 never have a body, whatever the program wrote after its headers is dropped with the pipe
+    int bodyless = head->code == 204 || head->code == 304;
+    int compressible = !bodyless && r->gzip_level > 0 && head->code == 200
+        && (head->content_length < 0 || head->content_length >= COMPRESS_MIN_SIZE)
+        && headers_compressible(head->headers, head->has_content_type);
+    r->gzip = compressible && (r->accepted & ENCODING_GZIP) != 0;
+    r->chunked = !bodyless && (head->content_length < 0 || r->gzip);
+    r->length = bodyless ? 0 : head->content_length;
+
+    rb_start(&r->rb, head->code, head->reason.c_str());
+    if (r->chunked) {
+        rb_addf(&r->rb, "Transfer-Encoding: chunked\r\n");
+    } else if (!bodyless) {
+        rb_content_length(&r->rb, head->content_length);
+    }
+    if (!head->has_content_type && !bodyless) {
+        rb_add(&r->rb, CONTENT_TYPE_HTML, strlen(CONTENT_TYPE_HTML));
+    }
+    rb_add(&r->rb, head->headers.data(), head->headers.size());
+    if (r->gzip) {
+        rb_add(&r->rb, encoding_field(ENCODING_GZIP), strlen(encoding_field(ENCODING_GZIP)));
+    }
+    if (compressible) {
+        rb_add(&r->rb, VARY_ACCEPT_ENCODING, strlen(VARY_ACCEPT_ENCODING));
+    }
+    rb_end_headers(&r->rb, r->keep_alive);
+    if (bodyless) {
+        r->finished = 1;
+        return;
+    }
+    r->capturing = r->capture_max > 0 && head->code == 200 && head->content_length <= (long) r->capture_max;
+
+    if (r->gzip) {
+        if (gzip_stream_init(&r->gz, r->gzip_level) == -1) {
+            r->gzip = 0;
+            r->failed = 1;
+            r->finished = 1;
+            return;
+        }
+        cgi_streams.chunked.fetch_add(1, std::memory_order_relaxed);
+        compress_counters.responses.fetch_add(1, std::memory_order_relaxed);
+        compress_counters.streamed.fetch_add(1, std::memory_order_relaxed);
+    } else if (r->chunked) {
+        cgi_streams.chunked.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // the body that came along with the head
+    if (r->length >= 0 && (long) extra_len > r->length) {
+        extra_len = r->length; // output past Content-Length is dropped with the pipe
+    }
+    r->body_read = extra_len;
+    relay_capture(r, extra, extra_len);
+    if (r->gzip) {
+        std::string compressed;
+        if (extra_len > 0 && gzip_stream_write(&r->gz, extra, extra_len, 0, &compressed) == -1) {
+            r->failed = 1;
+            r->finished = 1;
+        } else if (!compressed.empty()) {
+            relay_append_chunk(r, compressed.data(), compressed.size());
+        }
+    } else if (r->chunked) {
+        if (extra_len > 0) {
+            relay_append_chunk(r, extra, extra_len);
+        }
+    } else {
+        r->out.append(extra, extra_len);
+        r->splice_left = r->length - extra_len;
+    }
+}
+
+/*
+The next piece of a chunked or gzipped body: whatever is in the pipe now, framed as a chunk (spliced, or
+read and compressed), or the last chunk once the program has closed its stdout.
+Returns RELAY_WAIT_PIPE if there is nothing yet, otherwise RELAY_DONE to mean "go on".
+*/
+int relay_next_chunk(struct cgi_relay* r) {
+    int eof;
+    ssize_t avail = pipe_avail(r->pipe_fd, &eof);
+    if (r->length >= 0 && r->body_read >= (size_t) r->length) {
+        eof = 1; // a gzipped body with a Content-Length ends there, what the program writes past it is dropped with the pipe
+    } else if (avail == -1 || (eof && r->length >= 0)) { // or the program ended short of it
+        r->failed = 1;
+        r->finished = 1;
+        return RELAY_DONE;
+    }
+    if (avail == 0 && !eof) {
+        return RELAY_WAIT_PIPE;
+    }
+    if (!eof && r->body_read + avail > CGI_MAX_OUTPUT) {
+        r->failed = 1; // cut off: no last chunk, so the client can tell the body is incomplete
+        r->finished = 1;
+        return RELAY_DONE;
+    }
+    if (!r->gzip) {
+        if (eof) {
+            r->out.append("0\r\n\r\n", 5);
+            r->finished = 1;
+            return RELAY_DONE;
+        }
+        char size_line[32];
+        int size_len = snprintf(size_line, sizeof size_line, "%lx\r\n", (unsigned long) avail);
+        r->out.append(size_line, size_len);
+        r->splice_left = avail;
+        r->body_read += avail;
+        return RELAY_DONE;
+    }
+
+    char buf[CGI_GZIP_BATCH];
+    ssize_t n = 0;
+    if (!eof) {
+        size_t want = (size_t) avail < sizeof buf ? (size_t) avail : sizeof buf;
+        if (r->length >= 0 && want > (size_t) r->length - r->body_read) {
+            want = r->length - r->body_read;
+        }
+        while ((n = read(r->pipe_fd, buf, want)) == -1 && errno == EINTR) {
+        }
+        if (n <= 0) {
+            r->failed = 1;
+            r->finished = 1;
+            return RELAY_DONE;
+        }
+        r->body_read += n;
+        relay_capture(r, buf, n);
+    }
+    std::string compressed;
+    if (gzip_stream_write(&r->gz, buf, n, eof, &compressed) == -1) {
+        r->failed = 1;
+        r->finished = 1;
+        return RELAY_DONE;
+    }
+    if (!compressed.empty()) {
+        relay_append_chunk(r, compressed.data(), compressed.size());
+    }
+    if (eof) {
+        r->out.append("0\r\n\r\n", 5);
+        r->finished = 1;
+    }
+    return RELAY_DONE;
+}
+
+/*
+Move the response along as far as it goes without blocking: the program's header section, the response head,
+then the body. Returns what to wait for next, RELAY_DONE once the response is over (r->failed says whether
+it went out whole).
+*/
+int cgi_relay_step(struct cgi_relay* r) {
+    while (!r->head_done) {
+        size_t head_len = cgi_head_length(r->head_buf, r->got);
+        if (head_len == 0 && r->got < sizeof r->head_buf) {
+            ssize_t n = read(r->pipe_fd, r->head_buf + r->got, sizeof r->head_buf - r->got);
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n == -1 && errno == EAGAIN) {
+                return RELAY_WAIT_PIPE;
+            }
+            if (n > 0) {
+                r->got += n;
+                continue;
+            }
+        }
+        r->head_done = 1; // complete, too long, or the program closed its stdout before ending it
+        relay_start_body(r, head_len);
+        r->sent.code = r->rb.code;
+    }
+
+    while (1) {
+        if (!rb_done(&r->rb)) {
+            ssize_t n = rb_send(r->fd, &r->rb, MSG_MORE);
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n == -1 && errno == EAGAIN) {
+                return RELAY_WAIT_SOCKET;
+            }
+            if (n == -1) {
+                r->failed = 1;
+                return RELAY_DONE;
+            }
+            r->sent.bytes += n;
+            if (rb_done(&r->rb) && r->rb.overflow == RB_REPLACED) { // a bodyless 500 went out instead, nothing may follow it
+                r->sent.code = r->rb.code;
+                r->out.clear();
+                r->splice_left = 0;
+                r->finished = 1;
+                r->capturing = 0;
+            }
+            continue;
+        }
+        if (r->out_pos < r->out.size()) {
+            int more = !r->finished || r->splice_left > 0;
+            ssize_t n = send(r->fd, r->out.data() + r->out_pos, r->out.size() - r->out_pos,
+                MSG_NOSIGNAL | MSG_DONTWAIT | (more ? MSG_MORE : 0));
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n == -1 && errno == EAGAIN) {
+                return RELAY_WAIT_SOCKET;
+            }
+            if (n <= 0) {
+                r->failed = 1;
+                return RELAY_DONE;
+            }
+            r->out_pos += n;
+            r->sent.bytes += n;
+            if (r->out_pos == r->out.size()) {
+                r->out.clear();
+                r->out_pos = 0;
+            }
+            continue;
+        }
+        if (r->splice_left > 0) {
+            int eof;
+            ssize_t avail = pipe_avail(r->pipe_fd, &eof);
+            if (avail == 0 && !eof) {
+                return RELAY_WAIT_PIPE;
+            }
+            if (avail <= 0) { // the program ended short of its Content-Length
+                r->failed = 1;
+                return RELAY_DONE;
+            }
+            size_t want = (size_t) avail < r->splice_left ? (size_t) avail : r->splice_left;
+            int spliced = !r->capturing;
+            ssize_t n;
+            if (spliced) {
+                n = splice(r->pipe_fd, NULL, r->fd, NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE | SPLICE_F_NONBLOCK);
+            } else { // read through memory, so the bytes can be kept, and sent from out
+                char buf[CGI_GZIP_BATCH];
+                n = read(r->pipe_fd, buf, want < sizeof buf ? want : sizeof buf);
+                if (n > 0) {
+                    relay_capture(r, buf, n);
+                    r->out.append(buf, n);
+                }
+            }
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n == -1 && errno == EAGAIN) {
+                return RELAY_WAIT_SOCKET; // the pipe has the bytes, so it's the socket that's full
+            }
+            if (n <= 0) {
+                r->failed = 1;
+                return RELAY_DONE;
+            }
+            r->splice_left -= n;
+            if (spliced) {
+                r->sent.bytes += n; // bytes read into out are counted as they are sent
+            }
+            if (r->splice_left == 0 && r->chunked) {
+                r->out.append("\r\n", 2);
+            }
+            continue;
+        }
+        if (r->finished) {
+            return RELAY_DONE;
+        }
+        if (!r->chunked) {
+            r->finished = 1; // the Content-Length is out, whatever the program writes past it is dropped with the pipe
+            continue;
+        }
+        if (relay_next_chunk(r) == RELAY_WAIT_PIPE) {
+            return RELAY_WAIT_PIPE;
+        }
+    }
+}
+
+// the relay is over: count it, let go of the pipe and the socket's registration, and hand it to done()
+int relay_finish(struct child_watch* watch, struct cgi_relay* r) {
+    if (r->pipe_fd != -1) {
+        cgi_streams.bytes.fetch_add(r->body_read, std::memory_order_relaxed);
+        if (r->failed) {
+            cgi_streams.cut_off.fetch_add(1, std::memory_order_relaxed);
+        }
+        if (r->gzip) {
+            gzip_stream_end(&r->gz);
+        }
+        if (r->socket_added) {
+            epoll_ctl(watch->epfd, EPOLL_CTL_DEL, r->fd, NULL);
+        }
+        close(r->pipe_fd); // leaves the epoll set with it, a program still writing dies of SIGPIPE
+        r->pipe_fd = -1;
+        if (r->pid > 0) {
+            child_watch_reap(watch, r->pid);
+        }
+        if (r->watch_id != 0) {
+            child_watch_release(watch, r->watch_id); // before done() hands the connection on
+        }
+    }
+    if (r->capturing && !r->failed && r->captured != NULL) {
+        r->captured(r);
+        r->capturing = 0; // not again if done() has to be retried
+    }
+    if (r->done != NULL && r->done(r, !r->failed && r->keep_alive) == -1) {
+        return -1; // called again shortly
+    }
+    delete[] r->error_body;
+    delete r;
+    return 0;
+}
+
+/*
+Wait for what cgi_relay_step() asked for. Both descriptors are EPOLLONESHOT and only the one waited on is
+armed, so a relay is never woken by two events at once, and a hung up descriptor it isn't waiting on doesn't
+keep waking the poller. Returns -1 if the poller's set couldn't take it.
+*/
+int relay_wait(struct child_watch* watch, struct cgi_relay* r, int wait) {
+    if (wait == RELAY_WAIT_PIPE) {
+        return child_watch_poll(watch, EPOLL_CTL_MOD, r->pipe_fd, &r->pipe_end.item, EPOLLIN | EPOLLONESHOT);
+    }
+    int op = r->socket_added ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (child_watch_poll(watch, op, r->fd, &r->socket_end.item, EPOLLOUT | EPOLLONESHOT) == -1) {
+        return -1;
+    }
+    r->socket_added = 1;
+    return 0;
+}
+
+// the poller's callback for both of the relay's descriptors, and for another try at handing it over
+int relay_ready(struct child_watch* watch, struct watch_item* item, uint32_t events) {
+    (void) events;
+    struct cgi_relay* r = ((struct relay_end*) item)->relay;
+    if (r->pipe_fd == -1) {
+        return relay_finish(watch, r); // done() asked to be called again
+    }
+    int wait = cgi_relay_step(r);
+    if (wait != RELAY_DONE && relay_wait(watch, r, wait) == -1) {
+        r->failed = 1;
+        wait = RELAY_DONE;
+    }
+    return wait == RELAY_DONE ? relay_finish(watch, r) : 0;
+}
+
+/*
+A relay of the response pipe_fd (the program's stdout) carries to the client on fd. gzip_level (-o, 0 for off)
+and accepted (the ENCODING_ bits of the request's Accept-Encoding) decide whether the body is compressed on the
+way. The caller sets done and owner, and the relay's watch_id (or its pid if the child watch couldn't take
+the program).
+A relay that never started is thrown away with relay_finish() and done NULL.
+*/
+struct cgi_relay* cgi_relay_new(int fd, int pipe_fd, int keep_alive, int gzip_level, int accepted) {
+    struct cgi_relay* r = new struct cgi_relay;
+    r->pipe_end.item.ready = relay_ready;
+    r->pipe_end.relay = r;
+    r->socket_end.item.ready = relay_ready;
+    r->socket_end.relay = r;
+    r->fd = fd;
+    r->pipe_fd = pipe_fd;
+    r->pid = 0;
+    r->watch_id = 0;
+    r->keep_alive = keep_alive;
+    r->gzip_level = gzip_level;
+    r->accepted = accepted;
+    r->socket_added = 0;
+    r->got = 0;
+    r->head_done = 0;
+    r->error_body = NULL;
+    r->chunked = 0;
+    r->gzip = 0;
+    r->length = -1;
+    r->body_read = 0;
+    r->out_pos = 0;
+    r->splice_left = 0;
+    r->finished = 0;
+    r->failed = 0;
+    r->capture_max = 0;
+    r->capturing = 0;
+    r->captured = NULL;
+    r->sent.code = 0;
+    r->sent.bytes = 0;
+    r->done = NULL;
+    r->owner = NULL;
+    return r;
+}
+
+/*
+Hand the relay to the poller, the caller must not touch it (or its descriptors) afterwards: done() gets the
+socket back, left non-blocking, once the response is over. Returns -1 (and the relay is still the caller's)
+if the poller couldn't take it.
+*/
+int cgi_relay_start(struct child_watch* watch, struct cgi_relay* r) {
+    /*
+    The response leaves in several sends, MSG_MORE already holds back the pieces that should share a packet.
+    Without this Nagle's algorithm also holds back the small last chunk until the client ACKs the previous
+    segment, which a client delaying its ACKs does 40 ms later, on every keep-alive request after the first.
+    */
+    int one = 1;
+    setsockopt(r->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    int flags = fcntl(r->fd, F_GETFL);
+    fcntl(r->fd, F_SETFL, flags | O_NONBLOCK);
+    fcntl(r->pipe_fd, F_SETFL, fcntl(r->pipe_fd, F_GETFL) | O_NONBLOCK);
+    // the last thing done with r in this thread, the poller may run it before this returns
+    if (child_watch_poll(watch, EPOLL_CTL_ADD, r->pipe_fd, &r->pipe_end.item, EPOLLIN | EPOLLONESHOT) == -1) {
+        fcntl(r->fd, F_SETFL, flags);
+        return -1;
+    }
+    return 0;
+}
+
+void cgi_stream_stats(char* buf, size_t cap) {
+    snprintf(buf, cap, "cgi output: responses %lu chunked %lu bytes %lu bad gateway %lu cut off %lu\n",
+        cgi_streams.responses.load(), cgi_streams.chunked.load(), cgi_streams.bytes.load(),
+        cgi_streams.bad_gateway.load(), cgi_streams.cut_off.load());
+}
+
+#endif
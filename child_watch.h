@@ -0,0 +1,296 @@
+/*
+File: child_watch.h
+Description: waits for forked CGI children (wserver -g 0) without
+    blocking the thread that started them.
+    The thread that forked a child hands it over with child_watch_add(),
+    and the relay of its output to cgi_stream.h, which the same poller
+    drives, then goes back to serving. Each child gets a pidfd (pidfd_open(), Linux
+    5.3+), which turns readable when the child exits. One poller thread
+    keeps all the pidfds in an epoll set. When one is readable the poller
+    reaps that exact child with waitid(P_PIDFD), counts how it ended and
+    closes the server's copy of its connection.
+    Nothing calls waitpid(-1), so no other code path can reap a child
+    (and lose its status) before its owner does.
+    A child still running -w seconds after it started is killed with
+    pidfd_send_signal(). This is safe against pid reuse, since the pidfd
+    names the process, not the number. Its connection is shut down so
+    the client isn't left waiting (and isn't sent the truncated output
+    as if it were complete), unless the relay of its output is already
+    over and has released it (child_watch_release()): by then the
+    connection may be serving other requests.
+    Anything else the poller should wake up for (a relay's pipe and
+    socket) is registered in the same epoll set as a watch_item with its
+    own ready() function. An item whose ready() can't finish yet (a relay
+    whose connection has nowhere to go) is called again every
+    CHILD_WATCH_RETRY_MS until it can.
+*/
+
+#ifndef CHILD_WATCH_H
+#define CHILD_WATCH_H
+
+// stdlib
+#include <stdlib.h>
+#include <stdio.h>
+#include <signal.h>
+#include <time.h>
+
+// processes and descriptors
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+// concurrency control
+#include <pthread.h>
+#include <atomic>
+
+// stl
+#include <vector>
+
+#define CHILD_WATCH_RETRY_MS 10
+
+struct child_watch;
+
+/*
+The first member of everything in the poller's epoll set. ready() gets the epoll events (0 when it is
+called again after asking to be), returns 0 when it is done with them, -1 to be called again shortly.
+*/
+struct watch_item {
+    int (*ready)(struct child_watch* watch, struct watch_item* item, uint32_t events);
+};
+
+struct watched_child {
+    struct watch_item item;
+    pid_t pid;
+    int pidfd;
+    unsigned long id; // never reused, unlike pid, so a late child_watch_release() can't hit another child
+    int conn_fd; // the server's copy of the child's connection, shut down on timeout and closed once it exits or is released (-1 for none)
+    time_t deadline; // 0 for no timeout
+    int timed_out;
+};
+
+struct child_watch {
+    int epfd;
+    int timeout_secs; // 0 lets children run as long as they like
+    pthread_mutex_t lock;
+    std::vector<struct watched_child*> children; // every child not reaped yet, for the deadline scan
+    std::vector<struct watch_item*> retry; // items whose ready() asked to be called again, only the poller touches it
+    unsigned long next_id; // under lock
+
+    // for the stats thread
+    std::atomic<unsigned long> started;
+    std::atomic<unsigned long> exited; // exit status 0
+    std::atomic<unsigned long> failed; // non-zero exit status
+    std::atomic<unsigned long> signaled; // killed by a signal, timeouts included
+    std::atomic<unsigned long> timed_out;
+};
+
+int pidfd_open(pid_t pid) {
+    return syscall(SYS_pidfd_open, pid, 0);
+}
+
+int pidfd_send_signal(int pidfd, int sig) {
+    return syscall(SYS_pidfd_send_signal, pidfd, sig, NULL, 0);
+}
+
+void child_watch_init(struct child_watch* watch, int timeout_secs) {
+    watch->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (watch->epfd == -1) {
+        perror("epoll_create1");
+        exit(1);
+    }
+    watch->timeout_secs = timeout_secs;
+    pthread_mutex_init(&watch->lock, NULL);
+    watch->next_id = 1;
+    watch->started = 0;
+    watch->exited = 0;
+    watch->failed = 0;
+    watch->signaled = 0;
+    watch->timed_out = 0;
+}
+
+void child_watch_count(struct child_watch* watch, const siginfo_t* info) {
+    if (info->si_code == CLD_EXITED) {
+        (info->si_status == 0 ? watch->exited : watch->failed).fetch_add(1, std::memory_order_relaxed);
+    } else {
+        watch->signaled.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+// blocking wait for a child the poller couldn't take
+void child_watch_reap(struct child_watch* watch, pid_t pid) {
+    siginfo_t info;
+    if (waitid(P_PID, pid, &info, WEXITED) == 0) {
+        child_watch_count(watch, &info);
+    }
+}
+
+/*
+Hand a forked child (and the server's copy of its connection, which the watch now owns) to the poller.
+Returns 0 with the child's id in *id, for child_watch_release(), or -1 on a kernel without pidfd_open():
+conn_fd is closed and the caller has to child_watch_reap() the child itself, once it is done with its output.
+*/
+int child_watch_ready(struct child_watch* watch, struct watch_item* item, uint32_t events);
+
+int child_watch_add(struct child_watch* watch, pid_t pid, int conn_fd, unsigned long* id) {
+    watch->started.fetch_add(1, std::memory_order_relaxed);
+    int pidfd = pidfd_open(pid);
+    if (pidfd == -1) {
+        if (conn_fd != -1) {
+            close(conn_fd);
+        }
+        return -1;
+    }
+
+    struct watched_child* child = new struct watched_child;
+    child->item.ready = child_watch_ready;
+    child->pid = pid;
+    child->pidfd = pidfd;
+    child->conn_fd = conn_fd;
+    child->deadline = watch->timeout_secs > 0 ? time(NULL) + watch->timeout_secs : 0;
+    child->timed_out = 0;
+
+    pthread_mutex_lock(&watch->lock);
+    child->id = watch->next_id++;
+    watch->children.push_back(child);
+    pthread_mutex_unlock(&watch->lock);
+    *id = child->id;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN; // a pidfd polls readable once its process has exited
+    ev.data.ptr = &child->item;
+    epoll_ctl(watch->epfd, EPOLL_CTL_ADD, pidfd, &ev);
+    return 0;
+}
+
+/*
+Add fd to (op EPOLL_CTL_ADD) or change it in (EPOLL_CTL_MOD) the poller's epoll set, item->ready() is
+called when one of events happens. Returns like epoll_ctl().
+*/
+int child_watch_poll(struct child_watch* watch, int op, int fd, struct watch_item* item, uint32_t events) {
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = item;
+    return epoll_ctl(watch->epfd, op, fd, &ev);
+}
+
+// reap a child whose pidfd turned readable and release everything it held
+void child_watch_finish(struct child_watch* watch, struct watched_child* child) {
+    siginfo_t info;
+    if (waitid((idtype_t) P_PIDFD, child->pidfd, &info, WEXITED) == 0) {
+        child_watch_count(watch, &info);
+    }
+    epoll_ctl(watch->epfd, EPOLL_CTL_DEL, child->pidfd, NULL);
+    close(child->pidfd);
+    if (child->conn_fd != -1) {
+        close(child->conn_fd);
+    }
+
+    pthread_mutex_lock(&watch->lock);
+    for (size_t i = 0; i < watch->children.size(); i++) {
+        if (watch->children[i] == child) {
+            watch->children[i] = watch->children.back();
+            watch->children.pop_back();
+            break;
+        }
+    }
+    pthread_mutex_unlock(&watch->lock);
+    delete child;
+}
+
+// a child's pidfd is readable, it has exited
+int child_watch_ready(struct child_watch* watch, struct watch_item* item, uint32_t events) {
+    (void) events;
+    child_watch_finish(watch, (struct watched_child*) item);
+    return 0;
+}
+
+/*
+The connection the child with id was answering is done with it (the relay of its output is over), the watch
+lets go of its copy so a timeout can't shut the connection down under whatever it serves next.
+Nothing to do once the child has been reaped, its copy went with it.
+*/
+void child_watch_release(struct child_watch* watch, unsigned long id) {
+    pthread_mutex_lock(&watch->lock);
+    for (size_t i = 0; i < watch->children.size(); i++) {
+        struct watched_child* child = watch->children[i];
+        if (child->id == id) {
+            if (child->conn_fd != -1) {
+                close(child->conn_fd);
+                child->conn_fd = -1;
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&watch->lock);
+}
+
+// kill children past their deadline, their exit then shows up on their pidfd like any other
+void child_watch_expire(struct child_watch* watch) {
+    time_t now = time(NULL);
+    pthread_mutex_lock(&watch->lock);
+    for (size_t i = 0; i < watch->children.size(); i++) {
+        struct watched_child* child = watch->children[i];
+        if (child->deadline == 0 || now < child->deadline || child->timed_out) {
+            continue;
+        }
+        // one that exited in time but isn't reaped yet may be done with a connection now serving other requests
+        siginfo_t info;
+        info.si_pid = 0;
+        waitid((idtype_t) P_PIDFD, child->pidfd, &info, WEXITED | WNOHANG | WNOWAIT);
+        if (info.si_pid != 0) {
+            continue;
+        }
+        child->timed_out = 1;
+        watch->timed_out.fetch_add(1, std::memory_order_relaxed);
+        if (child->conn_fd != -1) { // still bound to this child, a released connection may be serving another request
+            // first, so whoever relays the child's output fails instead of taking its death for a normal end
+            shutdown(child->conn_fd, SHUT_RDWR);
+        }
+        pidfd_send_signal(child->pidfd, SIGKILL);
+    }
+    pthread_mutex_unlock(&watch->lock);
+}
+
+// the poller thread, wakes up at least once a second to check deadlines (more often while something waits for a retry)
+void* child_watch_thread(void* arg) {
+    struct child_watch* watch = (struct child_watch*) arg;
+    struct epoll_event events[64];
+    while (1) {
+        int n = epoll_wait(watch->epfd, events, 64, watch->retry.empty() ? 1000 : CHILD_WATCH_RETRY_MS);
+        for (int i = 0; i < n; i++) {
+            struct watch_item* item = (struct watch_item*) events[i].data.ptr;
+            if (item->ready(watch, item, events[i].events) == -1) {
+                watch->retry.push_back(item);
+            }
+        }
+        std::vector<struct watch_item*> again;
+        again.swap(watch->retry);
+        for (size_t i = 0; i < again.size(); i++) {
+            if (again[i]->ready(watch, again[i], 0) == -1) {
+                watch->retry.push_back(again[i]);
+            }
+        }
+        child_watch_expire(watch);
+    }
+    return NULL;
+}
+
+// children not reaped yet
+size_t child_watch_running(struct child_watch* watch) {
+    pthread_mutex_lock(&watch->lock);
+    size_t running = watch->children.size();
+    pthread_mutex_unlock(&watch->lock);
+    return running;
+}
+
+void child_watch_stats(struct child_watch* watch, char* buf, size_t cap) {
+    size_t running = child_watch_running(watch);
+    snprintf(buf, cap, "cgi children: running %lu started %lu exited %lu failed %lu signaled %lu timed out %lu\n",
+        (unsigned long) running, watch->started.load(), watch->exited.load(), watch->failed.load(),
+        watch->signaled.load(), watch->timed_out.load());
+}
+
+#endif
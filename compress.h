@@ -0,0 +1,168 @@
+/*
+File: compress.h
+Description: gzip compression of responses on the fly (wserver -o).
+    For files and dynamic output nobody precompressed: a response of a
+    compressible type (content_types.h) and at least COMPRESS_MIN_SIZE
+    bytes is sent gzipped to a client that accepts gzip.
+    Whole bodies the server has in memory are compressed in one deflate()
+    call and keep their Content-Length. Static files are compressed once
+    per version, the result is kept in a file cache of its own (-i MB) and
+    revalidated against the file like any cached file. Dynamic cache
+    entries keep a gzipped copy of their body. A spawned CGI program's
+    output, whose length isn't known until it ends, is compressed as it
+    streams and sent chunked, flushed after every batch read from the pipe
+    so the client gets data as soon as the program writes it.
+    Responses that could have been compressed carry Vary: Accept-Encoding
+    whether or not they were.
+*/
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+// stdlib
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+// concurrency control
+#include <atomic>
+
+// stl
+#include <string>
+
+// compressor
+#include <zlib.h>
+
+#include "content_types.h"
+
+#define COMPRESS_MIN_SIZE 1024 // bytes, smaller bodies gain too little to be worth the CPU
+#define GZIP_WINDOW_BITS (15 + 16) // largest window, + 16 asks for a gzip header and trailer instead of zlib's
+#define GZIP_MEM_LEVEL 8 // zlib's default
+#define GZIP_OVERHEAD 18 // gzip header and trailer, compressBound() only allows for zlib's 6 bytes
+#define GZIP_STREAM_OUT 16384 // bytes of output space added at a time while streaming
+
+// for the stats thread
+struct compress_counters {
+    std::atomic<unsigned long> responses; // sent gzipped, from memory or streamed
+    std::atomic<unsigned long> streamed; // of those, compressed while relaying a CGI program's output
+    std::atomic<unsigned long> bytes_in; // before compression, counted once per compression
+    std::atomic<unsigned long> bytes_out; // after
+    std::atomic<unsigned long> incompressible; // compressed but no smaller, sent as they were
+};
+struct compress_counters compress_counters;
+
+// room for the gzipped copy of len bytes, always enough
+size_t gzip_bound(size_t len) {
+    return compressBound(len) + GZIP_OVERHEAD;
+}
+
+/*
+gzip len bytes of in into out (cap bytes, gzip_bound(len) is enough) at level (1 fastest .. 9 smallest).
+Returns the compressed size, 0 if it failed or didn't fit.
+*/
+size_t gzip_buffer(const char* in, size_t len, int level, char* out, size_t cap) {
+    z_stream zs;
+    memset(&zs, 0, sizeof zs);
+    if (deflateInit2(&zs, level, Z_DEFLATED, GZIP_WINDOW_BITS, GZIP_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return 0;
+    }
+    zs.next_in = (Bytef*) in;
+    zs.avail_in = len;
+    zs.next_out = (Bytef*) out;
+    zs.avail_out = cap;
+    int rv = deflate(&zs, Z_FINISH);
+    size_t size = zs.total_out;
+    deflateEnd(&zs);
+    if (rv != Z_STREAM_END) {
+        return 0;
+    }
+    compress_counters.bytes_in.fetch_add(len, std::memory_order_relaxed);
+    compress_counters.bytes_out.fetch_add(size, std::memory_order_relaxed);
+    return size;
+}
+
+// a response body compressed piece by piece as it arrives
+struct gzip_stream {
+    z_stream zs;
+};
+
+int gzip_stream_init(struct gzip_stream* gz, int level) {
+    memset(&gz->zs, 0, sizeof gz->zs);
+    return deflateInit2(&gz->zs, level, Z_DEFLATED, GZIP_WINDOW_BITS, GZIP_MEM_LEVEL, Z_DEFAULT_STRATEGY) == Z_OK ? 0 : -1;
+}
+
+/*
+Compress len bytes of in and append everything deflate() has for the client to out: with finish the rest
+of the stream and its trailer, otherwise a sync flush, so the output so far decompresses on its own.
+Returns 0, or -1 if zlib failed.
+*/
+int gzip_stream_write(struct gzip_stream* gz, const char* in, size_t len, int finish, std::string* out) {
+    gz->zs.next_in = (Bytef*) in;
+    gz->zs.avail_in = len;
+    int flush = finish ? Z_FINISH : Z_SYNC_FLUSH;
+    while (1) {
+        size_t used = out->size();
+        out->resize(used + GZIP_STREAM_OUT);
+        gz->zs.next_out = (Bytef*) &(*out)[used];
+        gz->zs.avail_out = GZIP_STREAM_OUT;
+        int rv = deflate(&gz->zs, flush);
+        out->resize(used + GZIP_STREAM_OUT - gz->zs.avail_out);
+        if (rv == Z_STREAM_ERROR) {
+            return -1;
+        }
+        if (finish ? rv == Z_STREAM_END : gz->zs.avail_out > 0) { // space left over means the flush is complete
+            break;
+        }
+    }
+    compress_counters.bytes_in.fetch_add(len, std::memory_order_relaxed);
+    return 0;
+}
+
+// totals the stream's output, returns the compressed size
+size_t gzip_stream_end(struct gzip_stream* gz) {
+    size_t size = gz->zs.total_out;
+    deflateEnd(&gz->zs);
+    compress_counters.bytes_out.fetch_add(size, std::memory_order_relaxed);
+    return size;
+}
+
+/*
+Should a dynamic body go out compressed, judging by its headers ("Name: value\r\n" lines without the ones
+the server adds)? Only if its Content-Type is compressible (text/html, which the server adds when there is
+none, is) and the program didn't encode it already.
+*/
+int headers_compressible(const std::string& headers, int has_content_type) {
+    int compressible = !has_content_type;
+    size_t pos = 0;
+    while (pos < headers.size()) {
+        size_t end = headers.find("\r\n", pos);
+        if (end == std::string::npos) {
+            end = headers.size();
+        }
+        const char* line = headers.c_str() + pos;
+        if (strncasecmp(line, "Content-Encoding:", 17) == 0) {
+            return 0;
+        }
+        if (strncasecmp(line, "Content-Type:", 13) == 0) {
+            struct str_view value = sv_trim(line + 13, end - pos - 13);
+            const char* semi = (const char*) memchr(value.p, ';', value.len); // "text/html; charset=utf-8"
+            struct str_view type = sv_trim(value.p, semi != NULL ? (size_t) (semi - value.p) : value.len);
+            std::string name(type.p, type.len);
+            for (size_t i = 0; i < name.size(); i++) {
+                name[i] = tolower((unsigned char) name[i]);
+            }
+            compressible = type_compressible(name);
+        }
+        pos = end + 2;
+    }
+    return compressible;
+}
+
+void compress_stats(char* buf, size_t cap) {
+    unsigned long in = compress_counters.bytes_in.load(), out = compress_counters.bytes_out.load();
+    snprintf(buf, cap, "gzip: responses %lu streamed %lu incompressible %lu bytes %lu -> %lu (%.1f%%)\n",
+        compress_counters.responses.load(), compress_counters.streamed.load(), compress_counters.incompressible.load(),
+        in, out, in > 0 ? 100.0 * out / in : 0.0);
+}
+
+#endif
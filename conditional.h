@@ -0,0 +1,179 @@
+/*
+File: conditional.h
+Description: conditional GET and caching headers for static files.
+    Every static response carries two validators: an ETag made from the
+    file's inode, size and modification time (plus the encoding, since a
+    gzipped body is a different representation of the file), and
+    Last-Modified. A client or CDN that has the file already sends them
+    back in If-None-Match / If-Modified-Since, and while the file hasn't
+    changed it gets a 304 Not Modified without a body.
+    Cache-Control: max-age is set per path prefix (-u prefix=seconds,
+    repeatable, the longest matching prefix wins), so clients needn't
+    even ask again for a while. A prefix matches whole path segments:
+    img covers img and img/logo.png but not images/logo.png. Paths no rule matches get no
+    Cache-Control, as before.
+    Cached files build their validators and pick their Cache-Control once,
+    when they are loaded, so a hit formats nothing.
+*/
+
+#ifndef CONDITIONAL_H
+#define CONDITIONAL_H
+
+// stdlib
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// stl
+#include <string>
+#include <vector>
+
+#include "http_parser.h"
+#include "content_types.h" // encoding_name()
+
+#define ETAG_MAX 80 // "\"ino-size-mtime.nsec-encoding\"" in hex
+#define VALIDATORS_MAX 160 // the ETag and Last-Modified lines
+
+/*
+The file's ETag, quoted, e.g. "\"2a1b3-111-65f0a1b2.1c9c380-gzip\"". Strong: any change to the file
+changes its mtime (or its inode, if it is replaced). Returns its length.
+*/
+size_t build_etag(char* buf, size_t cap, ino_t ino, size_t size, const struct timespec* mtime, int encoding) {
+    int len = snprintf(buf, cap, "\"%lx-%lx-%lx.%lx%s%s\"", (unsigned long) ino, (unsigned long) size,
+        (unsigned long) mtime->tv_sec, (unsigned long) mtime->tv_nsec,
+        encoding != ENCODING_IDENTITY ? "-" : "", encoding != ENCODING_IDENTITY ? encoding_name(encoding) : "");
+    return len < (int) cap ? len : cap - 1;
+}
+
+// "ETag: ...\r\nLast-Modified: ...\r\n" for a file with etag, modified at mtime, returns the bytes used
+size_t build_validators(char* buf, size_t cap, const char* etag, size_t etag_len, time_t mtime) {
+    struct tm tm;
+    gmtime_r(&mtime, &tm);
+    char date[40];
+    strftime(date, sizeof date, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    int len = snprintf(buf, cap, "ETag: %.*s\r\nLast-Modified: %s\r\n", (int) etag_len, etag, date);
+    return len < (int) cap ? len : cap - 1;
+}
+
+/*
+Does an If-None-Match value ("*", or a list of entity tags) name etag? Weak comparison, as RFC 9110 asks
+for If-None-Match: a W/ prefix on the client's tag doesn't matter.
+*/
+int etag_matches(struct str_view list, const char* etag, size_t etag_len) {
+    size_t pos = 0;
+    while (pos < list.len) {
+        char c = list.p[pos];
+        if (c == ' ' || c == '\t' || c == ',') {
+            pos++;
+            continue;
+        }
+        if (c == '*') {
+            return 1;
+        }
+        if (c == 'W' && pos + 1 < list.len && list.p[pos + 1] == '/') {
+            pos += 2;
+        }
+        if (pos >= list.len || list.p[pos] != '"') {
+            return 0; // not an entity tag, nothing after it can be trusted either
+        }
+        const char* close = (const char*) memchr(list.p + pos + 1, '"', list.len - pos - 1);
+        if (close == NULL) {
+            return 0;
+        }
+        size_t tag_len = close + 1 - (list.p + pos);
+        if (tag_len == etag_len && memcmp(list.p + pos, etag, etag_len) == 0) {
+            return 1;
+        }
+        pos += tag_len;
+    }
+    return 0;
+}
+
+// an HTTP date ("Sun, 06 Nov 1994 08:49:37 GMT") as a time, -1 if it isn't one
+time_t parse_http_date(struct str_view v) {
+    char date[64];
+    if (v.len >= sizeof date) {
+        return -1;
+    }
+    memcpy(date, v.p, v.len);
+    date[v.len] = '\0';
+    struct tm tm;
+    memset(&tm, 0, sizeof tm);
+    const char* end = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (end == NULL || *end != '\0') {
+        return -1;
+    }
+    return timegm(&tm);
+}
+
+/*
+Is the client's copy of the file (etag, modified at mtime) current, so a 304 will do?
+If-None-Match wins: If-Modified-Since is only looked at when there is no If-None-Match (RFC 9110 13.2.2),
+and only to the second, the resolution of an HTTP date.
+*/
+int not_modified(const struct http_request* req, const char* etag, size_t etag_len, time_t mtime) {
+    const struct str_view* none_match = http_header_get(req, "If-None-Match");
+    if (none_match != NULL) {
+        return etag_matches(*none_match, etag, etag_len);
+    }
+    const struct str_view* modified_since = http_header_get(req, "If-Modified-Since");
+    if (modified_since != NULL) {
+        time_t since = parse_http_date(*modified_since);
+        return since != -1 && mtime <= since;
+    }
+    return 0;
+}
+
+struct cache_rule {
+    std::string prefix; // request path without its leading '/', "" matches every path
+    std::string field; // "Cache-Control: max-age=3600\r\n"
+};
+
+// from -u, only read once the server is running
+std::vector<struct cache_rule> cache_rules;
+
+// add a "prefix=seconds" rule, returns -1 if spec isn't one
+int cache_rule_add(const char* spec) {
+    const char* eq = strrchr(spec, '=');
+    if (eq == NULL || eq[1] == '\0') {
+        return -1;
+    }
+    char* end;
+    long seconds = strtol(eq + 1, &end, 10);
+    if (*end != '\0' || seconds < 0) {
+        return -1;
+    }
+    struct cache_rule rule;
+    rule.prefix.assign(spec, eq - spec);
+    if (!rule.prefix.empty() && rule.prefix[0] == '/') { // paths are matched the way route_request() leaves them
+        rule.prefix.erase(0, 1);
+    }
+    rule.field = "Cache-Control: max-age=" + std::to_string(seconds) + "\r\n";
+    cache_rules.push_back(rule);
+    return 0;
+}
+
+// does prefix cover path? Only up to a segment boundary: the match has to end at a '/' or at the end of path
+int cache_rule_covers(const std::string& prefix, const char* path) {
+    size_t len = prefix.size();
+    if (strncmp(path, prefix.c_str(), len) != 0) {
+        return 0;
+    }
+    return len == 0 || prefix[len - 1] == '/' || path[len] == '\0' || path[len] == '/';
+}
+
+// the Cache-Control line for path (without its leading '/'), NULL if no rule covers it
+const std::string* cache_control_for(const char* path) {
+    const struct cache_rule* best = NULL;
+    for (size_t i = 0; i < cache_rules.size(); i++) {
+        const struct cache_rule* rule = &cache_rules[i];
+        if (cache_rule_covers(rule->prefix, path)
+                && (best == NULL || rule->prefix.size() > best->prefix.size())) {
+            best = rule;
+        }
+    }
+    return best != NULL ? &best->field : NULL;
+}
+
+#endif
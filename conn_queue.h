@@ -0,0 +1,220 @@
+/*
+File: conn_queue.h
+Description: lock-free bounded queue of accepted socket descriptors,
+    the buffer between the producer (accept) thread and the worker threads.
+    It is Dmitry Vyukov's bounded MPMC ring: every cell carries a sequence
+    number that says whether it is ready to be written or read, so a push or
+    pop is one compare-and-swap on the shared position plus a store to the
+    cell, no mutex and no semaphores.
+    A worker that finds the queue empty spins for a little while (connections
+    usually arrive in bursts, spinning is skipped on a single cpu) and then
+    sleeps on a futex. Pushes and pops only read the sleeper counts, the
+    futex word is written (and the syscall made) only when someone is
+    actually asleep. The producer waits for a free slot the same way.
+*/
+
+#ifndef CONN_QUEUE_H
+#define CONN_QUEUE_H
+
+#include <stdlib.h>
+#include <atomic>
+
+// futex
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define QUEUE_SPINS 200 // failed attempts before a thread goes to sleep (multi-core only)
+
+struct conn_cell {
+    std::atomic<size_t> seq;
+    int fd;
+};
+
+struct conn_queue {
+    struct conn_cell* cells;
+    size_t mask; // capacity - 1, capacity is a power of 2
+    size_t capacity;
+    int spins; // QUEUE_SPINS, or 1 on a single cpu where spinning only delays the thread we wait for
+
+    // each position on its own cache line so producer and consumers don't fight over one line
+    alignas(64) std::atomic<size_t> enqueue_pos;
+    alignas(64) std::atomic<size_t> dequeue_pos;
+
+    // futex words: bumped by a push / pop that finds someone asleep, sleepers wait for them to change
+    alignas(64) std::atomic<int> pushes;
+    std::atomic<int> pop_sleepers;
+    alignas(64) std::atomic<int> pops;
+    std::atomic<int> push_sleepers;
+};
+
+void futex_wait(std::atomic<int>* word, int seen) {
+    syscall(SYS_futex, (int*) word, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+}
+
+void futex_wake(std::atomic<int>* word, int count) {
+    syscall(SYS_futex, (int*) word, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+// capacity is rounded up to a power of 2 (at least 2), so the queue may hold a little more than asked for
+void conn_queue_init(struct conn_queue* q, size_t capacity) {
+    size_t size = 2;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    q->cells = new struct conn_cell[size];
+    for (size_t i = 0; i < size; i++) {
+        q->cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+    q->mask = size - 1;
+    q->capacity = size;
+    q->spins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? QUEUE_SPINS : 1;
+    q->enqueue_pos.store(0, std::memory_order_relaxed);
+    q->dequeue_pos.store(0, std::memory_order_relaxed);
+    q->pushes.store(0);
+    q->pop_sleepers.store(0);
+    q->pops.store(0);
+    q->push_sleepers.store(0);
+}
+
+void conn_queue_destroy(struct conn_queue* q) {
+    delete[] q->cells;
+}
+
+// returns 0 if the queue was full
+int conn_queue_try_push(struct conn_queue* q, int fd) {
+    size_t pos = q->enqueue_pos.load(std::memory_order_relaxed);
+    while (1) {
+        struct conn_cell* cell = &q->cells[pos & q->mask];
+        size_t seq = cell->seq.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+        if (diff == 0) { // cell is free for this position, claim it
+            if (q->enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                cell->fd = fd;
+                cell->seq.store(pos + 1, std::memory_order_release); // now readable
+                return 1;
+            }
+        } else if (diff < 0) { // cell still holds an item from one lap ago
+            return 0;
+        } else { // another producer got this position, try the next one
+            pos = q->enqueue_pos.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+// returns 0 if the queue was empty
+int conn_queue_try_pop(struct conn_queue* q, int* fd) {
+    size_t pos = q->dequeue_pos.load(std::memory_order_relaxed);
+    while (1) {
+        struct conn_cell* cell = &q->cells[pos & q->mask];
+        size_t seq = cell->seq.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+        if (diff == 0) { // cell holds the item for this position, claim it
+            if (q->dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                *fd = cell->fd;
+                cell->seq.store(pos + q->mask + 1, std::memory_order_release); // free for the next lap
+                return 1;
+            }
+        } else if (diff < 0) { // nothing written here yet
+            return 0;
+        } else { // another consumer got this position, try the next one
+            pos = q->dequeue_pos.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+/*
+A thread about to sleep on a futex word: counts itself in sleepers, then looks at the queue once more.
+The fence pairs with queue_signal()'s, either the signaller sees the count or the sleeper sees what it pushed or popped.
+*/
+void queue_sleep_announce(std::atomic<int>* sleepers) {
+    sleepers->fetch_add(1, std::memory_order_seq_cst);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+/*
+Let one sleeping thread know the queue changed. With nobody asleep this is a read of sleepers: the word isn't
+written, so a busy queue has no cache line that every push and pop bounces between cores.
+A sleeper read word before it counted itself, so the bump makes its futex_wait() return or the wake finds it.
+*/
+void queue_signal(std::atomic<int>* word, std::atomic<int>* sleepers) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleepers->load(std::memory_order_relaxed) > 0) {
+        word->fetch_add(1, std::memory_order_seq_cst);
+        futex_wake(word, 1);
+    }
+}
+
+// blocks (spin, then futex) until there is room for fd
+void conn_queue_push(struct conn_queue* q, int fd) {
+    while (1) {
+        for (int i = 0; i < q->spins; i++) {
+            if (conn_queue_try_push(q, fd)) {
+                queue_signal(&q->pushes, &q->pop_sleepers);
+                return;
+            }
+            cpu_relax();
+        }
+        // announce we're going to sleep, then look once more so a pop between the two isn't missed
+        int seen = q->pops.load(std::memory_order_seq_cst);
+        queue_sleep_announce(&q->push_sleepers);
+        if (conn_queue_try_push(q, fd)) {
+            q->push_sleepers.fetch_sub(1, std::memory_order_seq_cst);
+            queue_signal(&q->pushes, &q->pop_sleepers);
+            return;
+        }
+        futex_wait(&q->pops, seen); // returns right away if a pop already changed the word
+        q->push_sleepers.fetch_sub(1, std::memory_order_seq_cst);
+    }
+}
+
+// blocks (spin, then futex) until there is an fd to hand out
+int conn_queue_pop(struct conn_queue* q) {
+    int fd;
+    while (1) {
+        for (int i = 0; i < q->spins; i++) {
+            if (conn_queue_try_pop(q, &fd)) {
+                queue_signal(&q->pops, &q->push_sleepers);
+                return fd;
+            }
+            cpu_relax();
+        }
+        int seen = q->pushes.load(std::memory_order_seq_cst);
+        queue_sleep_announce(&q->pop_sleepers);
+        if (conn_queue_try_pop(q, &fd)) {
+            q->pop_sleepers.fetch_sub(1, std::memory_order_seq_cst);
+            queue_signal(&q->pops, &q->push_sleepers);
+            return fd;
+        }
+        futex_wait(&q->pushes, seen);
+        q->pop_sleepers.fetch_sub(1, std::memory_order_seq_cst);
+    }
+}
+
+// blocks until the queue has a free slot, so the producer only accept()s what the buffer can hold
+void conn_queue_wait_space(struct conn_queue* q) {
+    while (1) {
+        for (int i = 0; i < q->spins; i++) {
+            if (q->enqueue_pos.load(std::memory_order_relaxed) - q->dequeue_pos.load(std::memory_order_relaxed) < q->capacity) {
+                return;
+            }
+            cpu_relax();
+        }
+        int seen = q->pops.load(std::memory_order_seq_cst);
+        queue_sleep_announce(&q->push_sleepers);
+        if (q->enqueue_pos.load(std::memory_order_seq_cst) - q->dequeue_pos.load(std::memory_order_seq_cst) < q->capacity) {
+            q->push_sleepers.fetch_sub(1, std::memory_order_seq_cst);
+            return;
+        }
+        futex_wait(&q->pops, seen);
+        q->push_sleepers.fetch_sub(1, std::memory_order_seq_cst);
+    }
+}
+
+#endif
@@ -0,0 +1,213 @@
+/*
+File: content_types.h
+Description: Content-Type and Content-Encoding of static files.
+    The type comes from the file's extension, looked up in a table built
+    once at startup: a built-in list of the types a web site is made of,
+    then every other extension /etc/mime.types knows. Each type's whole
+    "Content-Type: ...\r\n" line is built then too, so a response only
+    points at it. Unknown extensions are application/octet-stream.
+    Compressible types (text, JavaScript, JSON, XML, SVG, fonts that
+    aren't compressed already) can be served precompressed: when the
+    client's Accept-Encoding allows it and foo.css.br or foo.css.gz sits
+    next to foo.css, the sibling is sent with Content-Encoding instead.
+    Responses for compressible types always carry Vary: Accept-Encoding,
+    so caches keep the encodings apart. tools/precompress (make
+    precompress) writes the siblings.
+*/
+
+#ifndef CONTENT_TYPES_H
+#define CONTENT_TYPES_H
+
+// stdlib
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+// stl
+#include <string>
+#include <unordered_map>
+
+#include "http_parser.h"
+
+#define MIME_TYPES_FILE "/etc/mime.types"
+#define EXTENSION_MAX 16 // longer extensions are unknown
+
+struct content_type {
+    std::string name; // "text/css"
+    std::string field; // "Content-Type: text/css\r\n"
+    int compressible;
+};
+
+// by lower case extension, filled in by content_types_init() and only read after that
+std::unordered_map<std::string, struct content_type*> content_types;
+struct content_type* default_content_type;
+
+/*
+Content encodings as bits, so a client's Accept-Encoding and a file's precompressed siblings are both
+just a set. Listed in the order the server prefers them.
+*/
+#define ENCODING_IDENTITY 0
+#define ENCODING_BR 1
+#define ENCODING_GZIP 2
+const int preferred_encodings[] = {ENCODING_BR, ENCODING_GZIP};
+
+const char VARY_ACCEPT_ENCODING[] = "Vary: Accept-Encoding\r\n";
+
+// file name suffix of a precompressed sibling
+const char* encoding_suffix(int encoding) {
+    return encoding == ENCODING_BR ? ".br" : encoding == ENCODING_GZIP ? ".gz" : "";
+}
+
+const char* encoding_name(int encoding) {
+    return encoding == ENCODING_BR ? "br" : encoding == ENCODING_GZIP ? "gzip" : "identity";
+}
+
+const char* encoding_field(int encoding) {
+    return encoding == ENCODING_BR ? "Content-Encoding: br\r\n" : encoding == ENCODING_GZIP ? "Content-Encoding: gzip\r\n" : "";
+}
+
+// worth compressing: text of any kind, and binary formats that aren't compressed already
+int type_compressible(const std::string& name) {
+    const char* compressible[] = {"application/javascript", "application/json", "application/xml", "application/wasm",
+        "application/manifest+json", "image/svg+xml", "image/x-icon", "image/bmp", "font/ttf", "font/otf"};
+    if (name.compare(0, 5, "text/") == 0) {
+        return 1;
+    }
+    if (name.size() > 5 && (name.compare(name.size() - 5, 5, "+json") == 0 || name.compare(name.size() - 4, 4, "+xml") == 0)) {
+        return 1;
+    }
+    for (size_t i = 0; i < sizeof compressible / sizeof compressible[0]; i++) {
+        if (name == compressible[i]) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+struct content_type* make_content_type(const std::string& name) {
+    struct content_type* type = new struct content_type;
+    type->name = name;
+    type->field = "Content-Type: " + name + "\r\n";
+    type->compressible = type_compressible(name);
+    return type;
+}
+
+void add_content_type(const char* ext, const char* name) {
+    if (content_types.count(ext) == 0) {
+        content_types[ext] = make_content_type(name);
+    }
+}
+
+/*
+Build the table, call once before serving. The built-in list wins over mime_file (which is optional),
+so the common types don't depend on what the system's file says.
+*/
+void content_types_init(const char* mime_file) {
+    const char* builtin[][2] = {
+        {"html", "text/html"}, {"htm", "text/html"}, {"css", "text/css"}, {"js", "application/javascript"},
+        {"mjs", "application/javascript"}, {"json", "application/json"}, {"map", "application/json"},
+        {"xml", "application/xml"}, {"txt", "text/plain"}, {"csv", "text/csv"}, {"md", "text/markdown"},
+        {"svg", "image/svg+xml"}, {"png", "image/png"}, {"jpg", "image/jpeg"}, {"jpeg", "image/jpeg"},
+        {"gif", "image/gif"}, {"webp", "image/webp"}, {"avif", "image/avif"}, {"ico", "image/x-icon"},
+        {"bmp", "image/bmp"}, {"woff", "font/woff"}, {"woff2", "font/woff2"}, {"ttf", "font/ttf"},
+        {"otf", "font/otf"}, {"wasm", "application/wasm"}, {"pdf", "application/pdf"}, {"zip", "application/zip"},
+        {"gz", "application/gzip"}, {"br", "application/octet-stream"}, {"mp4", "video/mp4"}, {"webm", "video/webm"},
+        {"mp3", "audio/mpeg"}, {"ogg", "audio/ogg"}, {"webmanifest", "application/manifest+json"},
+    };
+    for (size_t i = 0; i < sizeof builtin / sizeof builtin[0]; i++) {
+        add_content_type(builtin[i][0], builtin[i][1]);
+    }
+    default_content_type = make_content_type("application/octet-stream");
+
+    // "type ext ext ..." lines, '#' starts a comment
+    FILE* f = mime_file != NULL ? fopen(mime_file, "r") : NULL;
+    if (f == NULL) {
+        return;
+    }
+    char line[1024];
+    while (fgets(line, sizeof line, f) != NULL) {
+        char* save;
+        char* name = strtok_r(line, " \t\r\n", &save);
+        if (name == NULL || name[0] == '#') {
+            continue;
+        }
+        char* ext;
+        while ((ext = strtok_r(NULL, " \t\r\n", &save)) != NULL && strlen(ext) <= EXTENSION_MAX) {
+            for (char* c = ext; *c != '\0'; c++) {
+                *c = tolower((unsigned char) *c);
+            }
+            add_content_type(ext, name);
+        }
+    }
+    fclose(f);
+}
+
+// the type of the file at path, by its extension
+const struct content_type* content_type_for(const char* path) {
+    const char* dot = strrchr(path, '.');
+    if (dot == NULL || strchr(dot, '/') != NULL || strlen(dot + 1) > EXTENSION_MAX) {
+        return default_content_type;
+    }
+    char ext[EXTENSION_MAX + 1];
+    size_t len = 0;
+    for (const char* c = dot + 1; *c != '\0'; c++) {
+        ext[len++] = tolower((unsigned char) *c);
+    }
+    ext[len] = '\0';
+    auto it = content_types.find(ext);
+    return it != content_types.end() ? it->second : default_content_type;
+}
+
+/*
+The encodings an Accept-Encoding header allows, as a set of ENCODING_ bits: "gzip, br;q=0.8" gives both,
+"br;q=0" or a missing header gives none (identity is always acceptable). "*" stands for every encoding not
+listed. The server then picks by its own preference (preferred_encodings) among the allowed ones.
+*/
+int accepted_encodings(const struct http_request* req) {
+    const struct str_view* header = http_header_get(req, "Accept-Encoding");
+    if (header == NULL) {
+        return 0;
+    }
+    int allowed = 0, refused = 0, star = 0;
+    size_t pos = 0;
+    while (pos < header->len) {
+        const char* comma = (const char*) memchr(header->p + pos, ',', header->len - pos);
+        size_t end = comma != NULL ? (size_t) (comma - header->p) : header->len;
+        struct str_view item = sv_trim(header->p + pos, end - pos);
+        pos = end + 1;
+
+        const char* semi = (const char*) memchr(item.p, ';', item.len);
+        struct str_view coding = sv_trim(item.p, semi != NULL ? (size_t) (semi - item.p) : item.len);
+        int zero = 0; // q=0 means "not this one"
+        if (semi != NULL) {
+            struct str_view params = sv_trim(semi + 1, item.p + item.len - (semi + 1));
+            if (params.len >= 3 && strncasecmp(params.p, "q=", 2) == 0) {
+                zero = params.p[2] == '0';
+                for (size_t i = 3; i < params.len && zero; i++) {
+                    zero = params.p[i] == '.' || params.p[i] == '0';
+                }
+            }
+        }
+        int bit = sv_ieq(coding, "br") ? ENCODING_BR : sv_ieq(coding, "gzip") || sv_ieq(coding, "x-gzip") ? ENCODING_GZIP : 0;
+        if (sv_eq(coding, "*")) {
+            star = !zero;
+        } else if (zero) {
+            refused |= bit;
+        } else {
+            allowed |= bit;
+        }
+    }
+    if (star) {
+        allowed |= (ENCODING_BR | ENCODING_GZIP) & ~refused;
+    }
+    return allowed & ~refused;
+}
+
+// Content-Length, Content-Type and (for compressible types) Content-Encoding and Vary of a 200 carrying a file, returns the bytes used
+int build_file_fields(char* buf, size_t cap, size_t size, const struct content_type* type, int encoding) {
+    return snprintf(buf, cap, "Content-Length: %lu\r\n%s%s%s", (unsigned long) size, type->field.c_str(),
+        encoding_field(encoding), type->compressible ? VARY_ACCEPT_ENCODING : "");
+}
+
+#endif
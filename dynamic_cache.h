@@ -0,0 +1,273 @@
+/*
+File: dynamic_cache.h
+Description: opt-in cache of dynamic (fib.cgi) responses.
+    fib.cgi's answer only depends on its query, so a 200 response can be
+    kept and sent again without running the program. The key is the
+    handler plus the query with its parameters sorted
+    (dynamic_key()), so "n=5&user=me" and "user=me&n=5" are the same
+    entry. Entries live for -e seconds and the cache holds at most -f MB,
+    least recently used entries are evicted first.
+    A response is stored split into status, headers and body, so a hit
+    is sent by the response builder like a static file (Date refreshed,
+    keep-alive kept) instead of with the CGI program's own headers.
+    With -o the body is also kept gzipped, compressed once when stored.
+    Same layout as file_cache.h: sharded, LRU per shard, refcounted entries.
+*/
+
+#ifndef DYNAMIC_CACHE_H
+#define DYNAMIC_CACHE_H
+
+// stdlib
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+
+// concurrency control
+#include <pthread.h>
+#include <atomic>
+
+// stl
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+
+#include "file_cache.h" // CACHE_SHARDS, cache_now()
+#include "cgi_stream.h" // cgi_parse_head()
+
+struct dynamic_entry {
+    std::string key;
+    int code;
+    std::string reason;
+    std::string headers; // "Name: value\r\n" lines, as cgi_parse_head() leaves them
+    int has_content_type;
+    std::string body;
+    std::string gzip_body; // body gzipped once when it was stored (-o), empty if that didn't make it smaller
+    size_t size; // bytes charged against the cap
+    time_t expires;
+
+    std::atomic<int> refs; // the cache's reference plus one per response being sent
+
+    struct dynamic_entry* prev;
+    struct dynamic_entry* next;
+};
+
+struct dynamic_shard {
+    pthread_mutex_t lock;
+    std::unordered_map<std::string, struct dynamic_entry*> map;
+    struct dynamic_entry* head; // most recently used
+    struct dynamic_entry* tail; // least recently used
+    size_t bytes;
+};
+
+struct dynamic_cache {
+    struct dynamic_shard shards[CACHE_SHARDS];
+    size_t shard_cap;
+    int ttl;
+
+    std::atomic<unsigned long> hits;
+    std::atomic<unsigned long> misses;
+    std::atomic<unsigned long> expired;
+    std::atomic<unsigned long> evictions;
+};
+
+void dynamic_cache_init(struct dynamic_cache* cache, size_t cap_bytes, int ttl) {
+    cache->shard_cap = cap_bytes / CACHE_SHARDS;
+    cache->ttl = ttl;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        pthread_mutex_init(&cache->shards[i].lock, NULL);
+        cache->shards[i].head = cache->shards[i].tail = NULL;
+        cache->shards[i].bytes = 0;
+    }
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->expired = 0;
+    cache->evictions = 0;
+}
+
+void dynamic_release(struct dynamic_entry* entry) {
+    if (entry->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        delete entry;
+    }
+}
+
+struct dynamic_shard* dynamic_shard_for(struct dynamic_cache* cache, const std::string& key) {
+    return &cache->shards[std::hash<std::string>()(key) % CACHE_SHARDS];
+}
+
+// the following helpers expect the shard lock to be held
+
+void dynamic_unlink(struct dynamic_shard* shard, struct dynamic_entry* entry) {
+    if (entry->prev != NULL) entry->prev->next = entry->next; else shard->head = entry->next;
+    if (entry->next != NULL) entry->next->prev = entry->prev; else shard->tail = entry->prev;
+    entry->prev = entry->next = NULL;
+}
+
+void dynamic_push_front(struct dynamic_shard* shard, struct dynamic_entry* entry) {
+    entry->prev = NULL;
+    entry->next = shard->head;
+    if (shard->head != NULL) shard->head->prev = entry; else shard->tail = entry;
+    shard->head = entry;
+}
+
+void dynamic_remove_locked(struct dynamic_shard* shard, struct dynamic_entry* entry) {
+    dynamic_unlink(shard, entry);
+    shard->map.erase(entry->key);
+    shard->bytes -= entry->size;
+    dynamic_release(entry);
+}
+
+// each thread's pairs and key, reused so that once they have grown building a key doesn't allocate
+thread_local std::vector<struct str_view> dynamic_key_pairs;
+thread_local std::string dynamic_key_buf;
+
+/*
+"name=value" pairs are ordered by name only, repeated names keep their order (the first one wins): pairs point
+into the query in order, so their position breaks the tie and std::sort (which, unlike std::stable_sort,
+doesn't allocate) keeps them stable.
+*/
+bool dynamic_pair_less(const struct str_view& a, const struct str_view& b) {
+    const char* a_eq = (const char*) memchr(a.p, '=', a.len);
+    const char* b_eq = (const char*) memchr(b.p, '=', b.len);
+    size_t a_name = a_eq != NULL ? (size_t) (a_eq - a.p) : a.len;
+    size_t b_name = b_eq != NULL ? (size_t) (b_eq - b.p) : b.len;
+    int c = memcmp(a.p, b.p, a_name < b_name ? a_name : b_name);
+    if (c != 0 || a_name != b_name) {
+        return c < 0 || (c == 0 && a_name < b_name);
+    }
+    return a.p < b.p;
+}
+
+/*
+handler plus the query's parameters in sorted order. The raw (still encoded) pairs are sorted, so no
+decoding can make two keys collide. The key is the thread's, valid until its next call: copy it to keep it.
+*/
+const std::string& dynamic_key(const char* handler, size_t handler_len, const char* query) {
+    std::vector<struct str_view>& pairs = dynamic_key_pairs;
+    pairs.clear();
+    const char* p = query;
+    while (*p != '\0') {
+        const char* amp = strchr(p, '&');
+        size_t len = amp != NULL ? (size_t) (amp - p) : strlen(p);
+        if (len > 0) {
+            struct str_view pair = {p, len};
+            pairs.push_back(pair);
+        }
+        p += len;
+        if (*p == '&') p++;
+    }
+    std::sort(pairs.begin(), pairs.end(), dynamic_pair_less);
+    std::string& key = dynamic_key_buf;
+    key.assign(handler, handler_len);
+    key += '?';
+    for (size_t i = 0; i < pairs.size(); i++) {
+        if (i > 0) key += '&';
+        key.append(pairs[i].p, pairs[i].len);
+    }
+    return key;
+}
+
+// a live entry for key with a reference held for the caller (dynamic_release() it once sent), or NULL
+struct dynamic_entry* dynamic_cache_lookup(struct dynamic_cache* cache, const std::string& key) {
+    struct dynamic_shard* shard = dynamic_shard_for(cache, key);
+    pthread_mutex_lock(&shard->lock);
+    auto it = shard->map.find(key);
+    if (it == shard->map.end()) {
+        pthread_mutex_unlock(&shard->lock);
+        cache->misses.fetch_add(1, std::memory_order_relaxed);
+        return NULL;
+    }
+    struct dynamic_entry* entry = it->second;
+    if (cache_now() >= entry->expires) {
+        dynamic_remove_locked(shard, entry);
+        pthread_mutex_unlock(&shard->lock);
+        cache->expired.fetch_add(1, std::memory_order_relaxed);
+        cache->misses.fetch_add(1, std::memory_order_relaxed);
+        return NULL;
+    }
+    entry->refs.fetch_add(1, std::memory_order_relaxed);
+    dynamic_unlink(shard, entry);
+    dynamic_push_front(shard, entry);
+    pthread_mutex_unlock(&shard->lock);
+    cache->hits.fetch_add(1, std::memory_order_relaxed);
+    return entry;
+}
+
+/*
+Split a complete HTTP response ("HTTP/1.1 200 OK\r\nheaders\r\n\r\nbody", as fib.cgi prints it) into entry.
+The body is Content-Length bytes when the header is there, everything after the headers otherwise.
+Returns 0, or -1 if it isn't a well formed response.
+*/
+int parse_http_response(const char* data, size_t len, struct dynamic_entry* entry) {
+    const char* header_end = (const char*) memmem(data, len, "\r\n\r\n", 4);
+    struct cgi_head head;
+    if (len < 9 || memcmp(data, "HTTP/1.1 ", 9) != 0 || header_end == NULL
+            || cgi_parse_head(data, header_end - data, &head) == -1) {
+        return -1;
+    }
+    entry->code = head.code;
+    entry->reason = head.reason;
+    entry->headers = head.headers;
+    entry->has_content_type = head.has_content_type;
+    size_t body_start = header_end + 4 - data;
+    size_t body_len = len - body_start;
+    if (head.content_length >= 0) {
+        if ((size_t) head.content_length > body_len) {
+            return -1; // cut short
+        }
+        body_len = head.content_length;
+    }
+    entry->body.assign(data + body_start, body_len);
+    return 0;
+}
+
+/*
+Add a response to the cache under key (the newest copy wins).
+Returns the entry with a reference held for the caller, or NULL if it doesn't fit.
+*/
+struct dynamic_entry* dynamic_cache_insert(struct dynamic_cache* cache, const std::string& key, struct dynamic_entry* entry) {
+    entry->key = key;
+    entry->size = key.size() + entry->reason.size() + entry->headers.size() + entry->body.size()
+        + entry->gzip_body.size() + sizeof *entry;
+    if (entry->size > cache->shard_cap) {
+        delete entry;
+        return NULL;
+    }
+    entry->expires = cache_now() + cache->ttl;
+    entry->refs = 2; // one for the cache, one for the caller
+    entry->prev = entry->next = NULL;
+
+    struct dynamic_shard* shard = dynamic_shard_for(cache, key);
+    pthread_mutex_lock(&shard->lock);
+    auto it = shard->map.find(key);
+    if (it != shard->map.end()) {
+        dynamic_remove_locked(shard, it->second);
+    }
+    while (shard->bytes + entry->size > cache->shard_cap && shard->tail != NULL) {
+        dynamic_remove_locked(shard, shard->tail);
+        cache->evictions.fetch_add(1, std::memory_order_relaxed);
+    }
+    shard->map[key] = entry;
+    dynamic_push_front(shard, entry);
+    shard->bytes += entry->size;
+    pthread_mutex_unlock(&shard->lock);
+    return entry;
+}
+
+void dynamic_cache_stats(struct dynamic_cache* cache, char* buf, size_t cap) {
+    size_t entries = 0, bytes = 0;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        pthread_mutex_lock(&cache->shards[i].lock);
+        entries += cache->shards[i].map.size();
+        bytes += cache->shards[i].bytes;
+        pthread_mutex_unlock(&cache->shards[i].lock);
+    }
+    unsigned long hits = cache->hits.load(), misses = cache->misses.load();
+    snprintf(buf, cap, "dynamic cache: hits %lu misses %lu hit rate %.1f%% expired %lu evictions %lu entries %lu bytes %lu/%lu\n",
+        hits, misses, hits + misses > 0 ? 100.0 * hits / (hits + misses) : 0.0,
+        cache->expired.load(), cache->evictions.load(),
+        (unsigned long) entries, (unsigned long) bytes, (unsigned long) (cache->shard_cap * CACHE_SHARDS));
+}
+
+#endif
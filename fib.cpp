@@ -5,9 +5,13 @@ Date: April 29th, 2024
 File: fib.cpp
 Description: fib.cpp is compiled into a cgi program.
     It parses the QUERY_STRING environment variable for parameters,
-    calcultes the nth fibonacci number. Then, it constructs and prints
+    calcultes the nth fibonacci number (fib_engine.h). Then, it constructs and prints
     an HTTP response.
     In some cases, it prints an HTTP error response and exits.
+    Run as "fib.cgi --loop" it stays alive and answers many requests,
+    framed over stdin/stdout, for wserver's CGI worker pool.
+    Built with -DFIB_PLUGIN (make plugins) it is a handler plugin
+    instead, loaded into wserver and called without any process.
 */
 
 #include <iostream>
@@ -15,66 +19,137 @@ Description: fib.cpp is compiled into a cgi program.
 #include <string>
 #include <sstream>
 
-//strtok
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
 
 //my headers
 #include "http_messaging.h"
+#include "handler.h"
+#include "query.h"
+#include "fib_engine.h"
 
 extern char** environ;
 
-int fib(int n) {
-    if (n <= 1)
-        return n;
-    return fib(n - 1) + fib(n - 2);
-}
+/*
+Build the page for one query string into body.
+Returns the HTTP status code: 200, or 500 when n is not a valid index.
+Parameters may come in any order: user (a name to greet), n (the index) and exact=1 for the full
+value of F(n) instead of F(n) mod 1,000,000,007.
+*/
+int fib_page(char* params, std::string& body) {
+    struct query_param query[MAX_QUERY_PARAMS];
+    int count = parse_query(params, query, MAX_QUERY_PARAMS);
+    const char* uname = query_get(query, count, "user");
+    const char* n_str = query_get(query, count, "n");
+    const char* exact_str = query_get(query, count, "exact");
+    int exact = exact_str != NULL && strcmp(exact_str, "1") == 0;
 
-int main() {
-    char *params = getenv("QUERY_STRING"); //this was set by creating envp[] in server
-    if (params != nullptr) {
-        char* uname;
-        int n = 0;
-        char* var = strtok(params, "=");
-        if (strcmp(var, "user") == 0) {
-            uname = strtok(NULL, "&");
-            var = strtok(NULL, "=");
-            if (strcmp(var, "n") == 0) {
-                n = atoi(strtok(NULL, ""));
-            }
-        } else if (strcmp(var, "n") == 0) {
-            n = atoi(strtok(NULL, "&")); //atoi will silently fail if n is not an int
-            var = strtok(NULL, "=");
-            if (strcmp(var, "user") == 0) {
-                uname = strtok(NULL, "");
-            }
+    uint64_t n = 0;
+    int valid = 1;
+    if (n_str != NULL) {
+        char* end;
+        errno = 0;
+        n = strtoull(n_str, &end, 10);
+        valid = n_str[0] >= '0' && n_str[0] <= '9' && *end == '\0' && errno == 0;
+    }
+    if (!valid || (exact && n > FIB_EXACT_MAX)) {
+        char error[] = "The parameter 'n' for fib.cgi is not a non-negative integer below 2^64 (at most 100,000 with exact=1)";
+        char errnum[] = "500";
+        char reason[] = "Internal Server Error";
+        char msg[] = "Server could not complete this request.";
+        std::stringstream ss;
+        ss << "<!doctype html>\r\n<head>\r\n<title>OSTEP WebServer Error</title>\r\n</head>\r\n<body>\r\n<h2>" << errnum;
+        ss << ": " << reason << "</h2>\r\n<p>" << error << ": " << msg << "</p>\r\n</body>\r\n</html>\r\n";
+        body = ss.str();
+        return 500;
+    }
+
+    std::stringstream ss;
+    ss << (uname != NULL ? uname : "") << ", welcome to the CGI Program!\nThe " << n << "th Fibonnaci number is ";
+    if (exact) {
+        ss << fib_exact(n);
+    } else {
+        ss << fib_mod(n);
+        if (n >= FIB_TABLE_SIZE || FIB_SMALL.value[n] >= FIB_MOD) {
+            ss << " (mod " << FIB_MOD << ")";
         }
+    }
+    ss << ".\n";
+    body = ss.str();
+    return 200;
+}
+
+/*
+Build the whole HTTP response for one query string into out, as the CGI program prints it.
+Returns the exit status the one-shot program ends with (1 for the error response).
+*/
+int respond(char* params, std::string& out) {
+    std::string body;
+    int code = fib_page(params, body);
+    std::stringstream response;
+    response << "HTTP/1.1 " << (code == 200 ? "200 OK" : "500 Internal Server Error") << "\r\nConnection: close\r\n";
+    response << "Content-Length: " << body.length() << "\r\nContent-Type: text/html\r\nServer: cpsc4510 web server 1.0\r\n\r\n";
+    response << body; // exactly Content-Length bytes, the same body the plugin and the one-shot program send
+    out = response.str();
+    return code == 200 ? 0 : 1;
+}
 
-        if (n < 0 || n > 10000) {
-            char error[] = "The parameter 'n' for fib.cgi is not an integer, a negative integer, or a positive integer larger than 10,000.";
-            char errnum[] = "500";
-            char reason[] = "Internal Server Error";
-            char msg[] = "Server could not complete this request.";
-            std::stringstream body;
-            body << "\r\n<!doctype html>\r\n<head>\r\n<title>OSTEP WebServer Error</title>\r\n</head>\r\n<body>\r\n<h2>" << errnum;
-            body << ": " << reason << "</h2>\r\n<p>" << error << ": " << msg << "</p>\r\n</body>\r\n</html>\r\n";
-            std::string b = body.str();
-            std::stringstream header;
-            header << "HTTP/1.1 " << errnum << " " << reason << "\r\nConnection: close\r\nContent-Length: " << b.length() << "\r\nContent-Type: text/html\r\n";
-            header << "Server: cpsc4510 web server 1.0\r\n";
-            std::string h  = header.str();
-            std::cout << h << b << std::endl;
-            exit(1);
+#ifdef FIB_PLUGIN
+/*
+Plugin build (make plugins): wserver -d handlers dlopen()s this and calls handle() for fib.cgi requests
+inside its worker threads, see handler.h.
+*/
+HANDLER_EXPORT const char handler_prefix[] = "fib.cgi";
+
+HANDLER_EXPORT int handle(const struct handler_request* req, struct response_writer* out) {
+    std::string query(req->query); // fib_page() cuts its argument up
+    std::string body;
+    int code = fib_page(&query[0], body);
+    out->status(out, code, code == 200 ? "OK" : "Internal Server Error");
+    out->header(out, "Content-Type", "text/html");
+    out->write(out, body.data(), body.size());
+    return 0;
+}
+#else
+/*
+Loop mode (fib.cgi --loop), used by wserver's pre-forked worker pool.
+Instead of one QUERY_STRING per process, the worker reads query frames from stdin and answers each with
+a response frame on stdout (both are the same UNIX socket to the server) until the server closes it.
+*/
+int serve_loop() {
+    char* query;
+    while (read_frame(STDIN_FILENO, &query) != -1) {
+        std::string out;
+        respond(query, out);
+        free(query);
+        if (write_frame(STDOUT_FILENO, out.data(), out.size()) == -1) {
+            break;
         }
+    }
+    return 0;
+}
 
-        int result = fib(n) % 1000000007;
+int main(int argc, char* argv[]) {
+    if (argc > 1 && strcmp(argv[1], "--loop") == 0) {
+        return serve_loop();
+    }
 
-        std::cout << "HTTP/1.1 200 OK\r\nConnection: close\r\nContent-Type: text/html\r\nServer: cpsc4510 web server 1.0\r\n";
-        std::stringstream ss;
-        ss << uname << ", welcome to the CGI Program!\nThe " << n << "th Fibonnaci number is " << result << ".\n";
-        std::string body = ss.str();
-        std::cout << "Content-Length: " << body.length() << "\r\n\r\n";
-        std::cout << body << std::endl;
+    /*
+    One-shot CGI mode: the server relays stdout to the client and builds the real HTTP response itself,
+    so only CGI headers are printed. There is no Content-Length either, the server streams the body
+    with chunked encoding.
+    */
+    char *params = getenv("QUERY_STRING"); //this was set by creating envp[] in server
+    if (params != nullptr) {
+        std::string body;
+        int code = fib_page(params, body);
+        if (code != 200) {
+            std::cout << "Status: 500 Internal Server Error\r\n";
+        }
+        std::cout << "Content-Type: text/html\r\n\r\n" << body;
+        return code == 200 ? 0 : 1;
     }
     return 0;
-}
\ No newline at end of file
+}
+#endif
@@ -0,0 +1,233 @@
+/*
+File: fib_engine.h
+Description: Fibonacci numbers for fib.cgi (and the fib plugin).
+    fib_mod(n) is F(n) mod 1,000,000,007 by fast doubling:
+        F(2k)   = F(k) * (2 F(k+1) - F(k))
+        F(2k+1) = F(k)^2 + F(k+1)^2
+    which walks the bits of n, so it takes O(log n) multiplications of
+    numbers below 2^30 (the products fit in 64 bits) instead of the
+    exponential recursion, any n up to 2^64 - 1 is answered in well under
+    a microsecond. F(0) .. F(93) are exact in 64 bits and come from a table
+    computed at compile time.
+    fib_exact(n) is the full decimal value of F(n), by the same doubling
+    over a small unsigned big integer (32 bit limbs) whose multiplication
+    switches from schoolbook to Karatsuba for long operands.
+*/
+
+#ifndef FIB_ENGINE_H
+#define FIB_ENGINE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// stl
+#include <string>
+#include <vector>
+
+#define FIB_MOD 1000000007ULL
+#define FIB_TABLE_SIZE 94 // F(93) is the largest Fibonacci number that fits in 64 bits
+#define FIB_EXACT_MAX 100000 // F(100000) has 20,899 digits, converting much larger ones to decimal gets slow
+
+struct fib_table {
+    uint64_t value[FIB_TABLE_SIZE];
+    constexpr fib_table() : value() {
+        value[0] = 0;
+        value[1] = 1;
+        for (int i = 2; i < FIB_TABLE_SIZE; i++) {
+            value[i] = value[i - 1] + value[i - 2];
+        }
+    }
+};
+constexpr struct fib_table FIB_SMALL;
+
+// F(n) mod FIB_MOD
+uint64_t fib_mod(uint64_t n) {
+    if (n < FIB_TABLE_SIZE) {
+        return FIB_SMALL.value[n] % FIB_MOD;
+    }
+    uint64_t a = 0, b = 1; // F(k), F(k+1) for k = the bits of n seen so far
+    for (int bit = 63 - __builtin_clzll(n); bit >= 0; bit--) {
+        uint64_t c = a * ((2 * b + FIB_MOD - a) % FIB_MOD) % FIB_MOD; // F(2k)
+        uint64_t d = (a * a + b * b) % FIB_MOD; // F(2k+1)
+        if ((n >> bit) & 1) {
+            a = d;
+            b = (c + d) % FIB_MOD;
+        } else {
+            a = c;
+            b = d;
+        }
+    }
+    return a;
+}
+
+/*
+Unsigned big integers: little endian vectors of 32 bit limbs, no leading zero limbs (zero is empty).
+Only what the doubling steps need: add, subtract (a >= b), double and multiply.
+*/
+typedef std::vector<uint32_t> bignum;
+
+#define KARATSUBA_LIMBS 32 // below this schoolbook multiplication is faster
+
+void big_trim(bignum& a) {
+    while (!a.empty() && a.back() == 0) {
+        a.pop_back();
+    }
+}
+
+// a += b << (32 * shift)
+void big_add_at(bignum& a, const uint32_t* b, size_t blen, size_t shift) {
+    if (a.size() < blen + shift) {
+        a.resize(blen + shift, 0);
+    }
+    uint64_t carry = 0;
+    size_t i = 0;
+    for (; i < blen; i++) {
+        carry += (uint64_t) a[i + shift] + b[i];
+        a[i + shift] = (uint32_t) carry;
+        carry >>= 32;
+    }
+    for (i += shift; carry != 0; i++) {
+        if (i == a.size()) {
+            a.push_back(0);
+        }
+        carry += a[i];
+        a[i] = (uint32_t) carry;
+        carry >>= 32;
+    }
+}
+
+bignum big_add(const bignum& a, const bignum& b) {
+    bignum sum = a;
+    big_add_at(sum, b.data(), b.size(), 0);
+    return sum;
+}
+
+// a -= b, a must be >= b
+void big_sub_in(bignum& a, const uint32_t* b, size_t blen) {
+    int64_t borrow = 0;
+    for (size_t i = 0; i < a.size() && (i < blen || borrow != 0); i++) {
+        int64_t diff = (int64_t) a[i] - (i < blen ? b[i] : 0) - borrow;
+        borrow = diff < 0;
+        a[i] = (uint32_t) (diff + (borrow << 32));
+    }
+    big_trim(a);
+}
+
+bignum big_sub(const bignum& a, const bignum& b) {
+    bignum diff = a;
+    big_sub_in(diff, b.data(), b.size());
+    return diff;
+}
+
+bignum big_double(const bignum& a) {
+    bignum twice(a.size() + 1, 0);
+    uint32_t carry = 0;
+    for (size_t i = 0; i < a.size(); i++) {
+        twice[i] = (a[i] << 1) | carry;
+        carry = a[i] >> 31;
+    }
+    twice[a.size()] = carry;
+    big_trim(twice);
+    return twice;
+}
+
+// out[0 .. alen + blen) = a * b, out must start zeroed
+void big_mul_school(const uint32_t* a, size_t alen, const uint32_t* b, size_t blen, uint32_t* out) {
+    for (size_t i = 0; i < alen; i++) {
+        uint64_t carry = 0;
+        for (size_t j = 0; j < blen; j++) {
+            carry += (uint64_t) a[i] * b[j] + out[i + j];
+            out[i + j] = (uint32_t) carry;
+            carry >>= 32;
+        }
+        out[i + blen] = (uint32_t) carry;
+    }
+}
+
+/*
+Karatsuba: split both operands at m limbs, a = a1 B + a0, b = b1 B + b0, then
+a b = z2 B^2 + (z1 - z2 - z0) B + z0 with z0 = a0 b0, z2 = a1 b1, z1 = (a0 + a1)(b0 + b1),
+three half size products instead of four.
+*/
+bignum big_mul(const uint32_t* a, size_t alen, const uint32_t* b, size_t blen) {
+    if (alen == 0 || blen == 0) {
+        return bignum();
+    }
+    if (alen < KARATSUBA_LIMBS || blen < KARATSUBA_LIMBS) {
+        bignum out(alen + blen, 0);
+        big_mul_school(a, alen, b, blen, out.data());
+        big_trim(out);
+        return out;
+    }
+    size_t m = (alen > blen ? alen : blen) / 2;
+    size_t a0len = alen < m ? alen : m, b0len = blen < m ? blen : m;
+    bignum a0(a, a + a0len), b0(b, b + b0len);
+    bignum a1(a + a0len, a + alen), b1(b + b0len, b + blen);
+    big_trim(a0);
+    big_trim(b0);
+
+    bignum z0 = big_mul(a0.data(), a0.size(), b0.data(), b0.size());
+    bignum z2 = big_mul(a1.data(), a1.size(), b1.data(), b1.size());
+    bignum as = big_add(a0, a1), bs = big_add(b0, b1);
+    bignum z1 = big_mul(as.data(), as.size(), bs.data(), bs.size());
+    big_sub_in(z1, z0.data(), z0.size());
+    big_sub_in(z1, z2.data(), z2.size());
+
+    bignum out = z0;
+    big_add_at(out, z1.data(), z1.size(), m);
+    big_add_at(out, z2.data(), z2.size(), 2 * m);
+    big_trim(out);
+    return out;
+}
+
+bignum big_mul(const bignum& a, const bignum& b) {
+    return big_mul(a.data(), a.size(), b.data(), b.size());
+}
+
+// decimal digits, by repeatedly dividing by 10^9
+std::string big_to_string(bignum a) {
+    if (a.empty()) {
+        return "0";
+    }
+    std::vector<uint32_t> chunks; // base 10^9 digits, least significant first
+    while (!a.empty()) {
+        uint64_t rem = 0;
+        for (size_t i = a.size(); i-- > 0;) {
+            uint64_t cur = (rem << 32) | a[i];
+            a[i] = (uint32_t) (cur / 1000000000);
+            rem = cur % 1000000000;
+        }
+        big_trim(a);
+        chunks.push_back((uint32_t) rem);
+    }
+    std::string out = std::to_string(chunks.back());
+    char part[10];
+    for (size_t i = chunks.size() - 1; i-- > 0;) {
+        snprintf(part, sizeof part, "%09u", chunks[i]);
+        out += part;
+    }
+    return out;
+}
+
+// F(n) in decimal, n <= FIB_EXACT_MAX
+std::string fib_exact(uint64_t n) {
+    if (n < FIB_TABLE_SIZE) {
+        return std::to_string(FIB_SMALL.value[n]);
+    }
+    bignum a, b(1, 1); // F(k), F(k+1)
+    for (int bit = 63 - __builtin_clzll(n); bit >= 0; bit--) {
+        bignum c = big_mul(a, big_sub(big_double(b), a)); // F(2k)
+        bignum d = big_add(big_mul(a, a), big_mul(b, b)); // F(2k+1)
+        if ((n >> bit) & 1) {
+            b = big_add(c, d);
+            a = d;
+        } else {
+            a = c;
+            b = d;
+        }
+    }
+    return big_to_string(a);
+}
+
+#endif
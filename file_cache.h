@@ -0,0 +1,351 @@
+/*
+File: file_cache.h
+Description: shared in-memory cache of static files for wserver.
+    Each entry holds a file's bytes and its pre-built response header fields,
+    so a hot file is answered with a hash lookup and no access()/open()/
+    fstat()/mmap() per request.
+    The cache is split into shards, each with its own mutex, hash map and
+    LRU list, so workers looking up different files rarely wait on each other.
+    Memory is capped (-c <MB>), the least recently used entries are evicted
+    once a shard goes over its share of the cap.
+    An entry is re-checked with stat() at most once a second, if the file's
+    mtime, size or inode changed it is dropped and loaded again.
+    wserver -o keeps the copies it gzips itself in a second file_cache,
+    keyed like siblings, whose entries revalidate against the original file.
+    A precompressed sibling (foo.css.br, foo.css.gz) is an entry of its own,
+    keyed "foo.css br" / "foo.css gzip" (a request target has no spaces).
+    The entry for foo.css remembers which siblings exist, found with stat()
+    when it is loaded and re-checked, so a request that can't use one costs
+    no extra system call.
+*/
+
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+// stdlib
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// file I/O
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// concurrency control
+#include <pthread.h>
+#include <atomic>
+
+// stl
+#include <string>
+#include <unordered_map>
+
+#include "http_messaging.h"
+#include "content_types.h"
+#include "conditional.h"
+
+#define CACHE_SHARDS 8
+#define CACHE_REVALIDATE_SECS 1 // how stale an entry may get before stat() checks the file again
+
+struct cache_entry {
+    std::string path; // key in the shard's map
+    std::string file; // what was read, path plus the encoding's suffix
+    int encoding; // ENCODING_ the file is stored in
+    char* data; // file contents
+    size_t size;
+    char fields[256]; // Content-Length, Content-Type, Content-Encoding and Vary header lines
+    size_t fields_len;
+    std::atomic<int> variants; // ENCODING_ bits of the usable precompressed siblings, identity entries only
+    std::atomic<int> incompressible; // gzip didn't make it smaller (-o), don't try again
+    int vary; // the type is compressible, so answers depend on Accept-Encoding
+
+    // conditional GET (conditional.h), built with the entry
+    char etag[ETAG_MAX];
+    size_t etag_len;
+    char validators[VALIDATORS_MAX]; // ETag and Last-Modified header lines
+    size_t validators_len;
+    const std::string* cache_control; // the -u rule's header line for the path, NULL if none
+
+    // what the file looked like when it was loaded
+    size_t file_size; // size, unless data is a compressed copy of file
+    struct timespec mtime;
+    ino_t ino;
+    time_t checked; // last time the file was stat()ed
+
+    // the cache holds one reference while the entry is in the map, every response being sent holds another
+    std::atomic<int> refs;
+
+    // LRU list, most recently used at the front
+    struct cache_entry* prev;
+    struct cache_entry* next;
+};
+
+struct cache_shard {
+    pthread_mutex_t lock;
+    std::unordered_map<std::string, struct cache_entry*> map;
+    struct cache_entry* head; // most recently used
+    struct cache_entry* tail; // least recently used, evicted first
+    size_t bytes;
+};
+
+struct file_cache {
+    const char* name; // for file_cache_stats()
+    struct cache_shard shards[CACHE_SHARDS];
+    size_t shard_cap; // bytes each shard may hold
+
+    // counters for sizing the cache, read with file_cache_stats()
+    std::atomic<unsigned long> hits;
+    std::atomic<unsigned long> misses;
+    std::atomic<unsigned long> evictions;
+};
+
+time_t cache_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+void file_cache_init(struct file_cache* cache, const char* name, size_t cap_bytes) {
+    cache->name = name;
+    cache->shard_cap = cap_bytes / CACHE_SHARDS;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        pthread_mutex_init(&cache->shards[i].lock, NULL);
+        cache->shards[i].head = cache->shards[i].tail = NULL;
+        cache->shards[i].bytes = 0;
+    }
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->evictions = 0;
+}
+
+// drop a reference, the last one frees the entry
+void cache_release(struct cache_entry* entry) {
+    if (entry->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        free(entry->data);
+        delete entry;
+    }
+}
+
+struct cache_shard* cache_shard_for(struct file_cache* cache, const std::string& path) {
+    return &cache->shards[std::hash<std::string>()(path) % CACHE_SHARDS];
+}
+
+// the following helpers expect the shard lock to be held
+
+void lru_unlink(struct cache_shard* shard, struct cache_entry* entry) {
+    if (entry->prev != NULL) entry->prev->next = entry->next; else shard->head = entry->next;
+    if (entry->next != NULL) entry->next->prev = entry->prev; else shard->tail = entry->prev;
+    entry->prev = entry->next = NULL;
+}
+
+void lru_push_front(struct cache_shard* shard, struct cache_entry* entry) {
+    entry->prev = NULL;
+    entry->next = shard->head;
+    if (shard->head != NULL) shard->head->prev = entry; else shard->tail = entry;
+    shard->head = entry;
+}
+
+void cache_remove_locked(struct cache_shard* shard, struct cache_entry* entry) {
+    lru_unlink(shard, entry);
+    shard->map.erase(entry->path);
+    shard->bytes -= entry->size;
+    cache_release(entry); // responses still sending it keep it alive until they are done
+}
+
+// cache key of a file's variant in encoding, built in key (a string kept for reuse doesn't allocate again)
+void cache_key(std::string* key, const char* path, int encoding) {
+    key->assign(path);
+    if (encoding != ENCODING_IDENTITY) {
+        *key += ' ';
+        *key += encoding_name(encoding);
+    }
+}
+
+/*
+Each thread's lookup key and sibling file name, reused so that once they have grown to the longest path seen,
+a cache hit (or a stat() of the siblings) builds them without allocating.
+*/
+thread_local std::string cache_lookup_key;
+thread_local std::string sibling_path;
+
+/*
+Which precompressed siblings of a compressible file can stand in for it. A sibling older than the file
+was made from a previous version, so it doesn't count until it is made again.
+*/
+int find_variants(const char* path, struct stat* filestat) {
+    if (!content_type_for(path)->compressible) {
+        return 0;
+    }
+    int variants = 0;
+    std::string& sibling = sibling_path;
+    for (int encoding : preferred_encodings) {
+        sibling = path;
+        sibling += encoding_suffix(encoding);
+        struct stat s;
+        if (stat(sibling.c_str(), &s) == 0 && S_ISREG(s.st_mode) && (s.st_mtim.tv_sec > filestat->st_mtim.tv_sec
+                || (s.st_mtim.tv_sec == filestat->st_mtim.tv_sec && s.st_mtim.tv_nsec >= filestat->st_mtim.tv_nsec))) {
+            variants |= encoding;
+        }
+    }
+    return variants;
+}
+
+// does the entry still describe the file on disk?
+int cache_entry_current(struct cache_entry* entry, struct stat* filestat) {
+    return filestat->st_mtim.tv_sec == entry->mtime.tv_sec && filestat->st_mtim.tv_nsec == entry->mtime.tv_nsec
+        && (size_t) filestat->st_size == entry->file_size && filestat->st_ino == entry->ino;
+}
+
+/*
+Look path up in the cache, in encoding (ENCODING_IDENTITY for the file itself). Returns the entry with a
+reference held for the caller (release it with cache_release() once the response is sent), or NULL if the
+file isn't cached (or has changed since).
+*/
+struct cache_entry* file_cache_lookup(struct file_cache* cache, const char* path, int encoding) {
+    std::string& key = cache_lookup_key;
+    cache_key(&key, path, encoding);
+    struct cache_shard* shard = cache_shard_for(cache, key);
+    time_t now = cache_now();
+
+    pthread_mutex_lock(&shard->lock);
+    auto it = shard->map.find(key);
+    if (it == shard->map.end()) {
+        pthread_mutex_unlock(&shard->lock);
+        cache->misses.fetch_add(1, std::memory_order_relaxed);
+        return NULL;
+    }
+    struct cache_entry* entry = it->second;
+    entry->refs.fetch_add(1, std::memory_order_relaxed);
+    lru_unlink(shard, entry);
+    lru_push_front(shard, entry);
+    int stale = now - entry->checked >= CACHE_REVALIDATE_SECS;
+    if (stale) {
+        entry->checked = now; // only one request per second pays for the stat()
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    if (stale) {
+        struct stat filestat;
+        if (stat(entry->file.c_str(), &filestat) == -1 || !cache_entry_current(entry, &filestat)) {
+            // file changed or went away, drop it so the next miss loads (or 404s) the new version
+            pthread_mutex_lock(&shard->lock);
+            auto again = shard->map.find(key);
+            if (again != shard->map.end() && again->second == entry) {
+                cache_remove_locked(shard, entry);
+            }
+            pthread_mutex_unlock(&shard->lock);
+            cache_release(entry);
+            cache->misses.fetch_add(1, std::memory_order_relaxed);
+            return NULL;
+        }
+        if (encoding == ENCODING_IDENTITY) { // siblings may have been added or removed too
+            entry->variants.store(find_variants(path, &filestat), std::memory_order_relaxed);
+        }
+    }
+
+    cache->hits.fetch_add(1, std::memory_order_relaxed);
+    return entry;
+}
+
+/*
+Fill in the headers entry (data from the file at path, in entry->encoding) is sent with, its version
+(file_size, mtime, ino) must be set.
+*/
+void cache_entry_headers(struct cache_entry* entry, const char* path) {
+    const struct content_type* type = content_type_for(path);
+    // a sibling is sent as the file it stands for, labelled with that file's type
+    entry->fields_len = build_file_fields(entry->fields, sizeof entry->fields, entry->size, type, entry->encoding);
+    entry->vary = type->compressible;
+    entry->etag_len = build_etag(entry->etag, sizeof entry->etag, entry->ino, entry->file_size, &entry->mtime, entry->encoding);
+    entry->validators_len = build_validators(entry->validators, sizeof entry->validators, entry->etag, entry->etag_len,
+        entry->mtime.tv_sec);
+    entry->cache_control = cache_control_for(path);
+}
+
+/*
+Add a new entry (path, size and headers filled in) to the cache, evicting least recently used
+ones to make room. The entry gets one reference for the cache and one for the caller.
+*/
+void file_cache_insert(struct file_cache* cache, struct cache_entry* entry) {
+    entry->checked = cache_now();
+    entry->refs = 2; // one for the cache, one for the caller
+    entry->prev = entry->next = NULL;
+
+    struct cache_shard* shard = cache_shard_for(cache, entry->path);
+    pthread_mutex_lock(&shard->lock);
+    auto it = shard->map.find(entry->path);
+    if (it != shard->map.end()) { // another worker loaded it at the same time, newest copy wins
+        cache_remove_locked(shard, it->second);
+    }
+    while (shard->bytes + entry->size > cache->shard_cap && shard->tail != NULL) {
+        cache_remove_locked(shard, shard->tail);
+        cache->evictions.fetch_add(1, std::memory_order_relaxed);
+    }
+    shard->map[entry->path] = entry;
+    lru_push_front(shard, entry);
+    shard->bytes += entry->size;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/*
+Read the file at path (or its precompressed sibling for encoding) into a new entry and add it to the cache.
+Returns the entry with a reference held for the caller, or NULL if the file can't be read or is too big to cache
+(the caller then serves it straight from disk).
+*/
+struct cache_entry* file_cache_load(struct file_cache* cache, const char* path, int encoding) {
+    std::string file(path);
+    file += encoding_suffix(encoding);
+    int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct stat filestat;
+    if (fstat(fd, &filestat) == -1 || !S_ISREG(filestat.st_mode) || (size_t) filestat.st_size > cache->shard_cap) {
+        close(fd);
+        return NULL;
+    }
+
+    struct cache_entry* entry = new struct cache_entry;
+    cache_key(&entry->path, path, encoding);
+    entry->file = file;
+    entry->encoding = encoding;
+    entry->size = filestat.st_size;
+    entry->data = (char*) malloc(entry->size > 0 ? entry->size : 1);
+    size_t got = 0;
+    while (got < entry->size) {
+        ssize_t rv = read(fd, entry->data + got, entry->size - got);
+        if (rv == -1 && errno == EINTR) continue;
+        if (rv <= 0) break;
+        got += rv;
+    }
+    close(fd);
+    if (got != entry->size) { // file shrank while we read it, don't cache a torn copy
+        free(entry->data);
+        delete entry;
+        return NULL;
+    }
+
+    entry->variants = encoding == ENCODING_IDENTITY ? find_variants(path, &filestat) : 0;
+    entry->incompressible = 0;
+    entry->file_size = entry->size;
+    entry->mtime = filestat.st_mtim;
+    entry->ino = filestat.st_ino;
+    cache_entry_headers(entry, path);
+    file_cache_insert(cache, entry);
+    return entry;
+}
+
+void file_cache_stats(struct file_cache* cache, char* buf, size_t cap) {
+    size_t entries = 0, bytes = 0;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        pthread_mutex_lock(&cache->shards[i].lock);
+        entries += cache->shards[i].map.size();
+        bytes += cache->shards[i].bytes;
+        pthread_mutex_unlock(&cache->shards[i].lock);
+    }
+    snprintf(buf, cap, "%s: hits %lu misses %lu evictions %lu entries %lu bytes %lu/%lu\n",
+        cache->name, cache->hits.load(), cache->misses.load(), cache->evictions.load(),
+        (unsigned long) entries, (unsigned long) bytes, (unsigned long) (cache->shard_cap * CACHE_SHARDS));
+}
+
+#endif
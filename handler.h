@@ -0,0 +1,57 @@
+/*
+File: handler.h
+Description: the ABI between wserver and in-process handler plugins.
+    A plugin is a shared object in the handlers directory (wserver -d)
+    that exports
+        int handle(const struct handler_request* req, struct response_writer* out);
+    and, optionally, the URL prefix it answers:
+        const char handler_prefix[] = "fib.cgi";
+    (without it the prefix is the file name minus ".so").
+    handle() runs inside the worker thread (or event loop) that read the
+    request, so it must be thread safe and shouldn't block for long.
+    It sets the status and headers and writes the body through out, the
+    server adds Date, Content-Length, Connection and Server and sends it.
+    Returning non-zero makes the server answer 500 instead.
+    Only plain C types cross the boundary, so plugins can be built by any
+    compiler (see "make plugins" for fib.cpp).
+*/
+
+#ifndef HANDLER_H
+#define HANDLER_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct handler_request {
+    const char* method;
+    const char* path; // without the leading '/' and the query string
+    const char* query; // everything after '?', "" if there was none
+};
+
+struct response_writer {
+    void* ctx; // the server's, plugins don't touch it
+    // defaults to 200 OK when never called
+    void (*status)(struct response_writer* out, int code, const char* reason);
+    // one header line, Content-Type defaults to text/html
+    void (*header)(struct response_writer* out, const char* name, const char* value);
+    // append to the body, may be called any number of times
+    void (*write)(struct response_writer* out, const char* data, size_t length);
+};
+
+typedef int (*handler_fn)(const struct handler_request* req, struct response_writer* out);
+
+#ifdef __cplusplus
+}
+#endif
+
+// plugins are built with -fvisibility=hidden, this marks the symbols wserver looks up
+#ifdef __cplusplus
+#define HANDLER_EXPORT extern "C" __attribute__((visibility("default")))
+#else
+#define HANDLER_EXPORT __attribute__((visibility("default")))
+#endif
+
+#endif
@@ -5,14 +5,16 @@ Date: April 29th, 2024
 File: http_messaging.h
 Description: header to hold functions for response creation
     and sending. 
+    The response builder assembles status line, headers and body
+    into one sendmsg(), with constant fragments built at startup and
+    the Date header refreshed once a second.
 Goals: I would like fib.cpp to be able to create its responses 
-    with this file, and I would like to figure out how to add
-    successful responses for both static and dynamic requests, as
-    well as adding the Date to the response header.
-    Because I didn't have the time to figure this out, I have 
-    awkward code replication throughout this project.
+    with this file.
 */
 
+#ifndef HTTP_MESSAGING_H
+#define HTTP_MESSAGING_H
+
 // stdlib
 #include <stdlib.h> 
 
@@ -22,115 +24,369 @@ Goals: I would like fib.cpp to be able to create its responses
 
 // socket write()
 #include <unistd.h>
+#include <stdint.h> // uint32_t frame lengths
 
 // strlen()
 #include <string.h>
 
+// errno
+#include <errno.h>
+
 // struct stat
 #include <sys/stat.h>
 
+// response builder: sendmsg(), the Date ticker thread, va_list
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdarg.h>
+
 //adapted from Dr. Zhu's code
 
 #define MAXBUF 8192
 
-void write_or_die(int fd, char* buf, size_t length) {
-    int rv;
-    if ((rv = write(fd, buf, length)) == -1) {
-        perror("server: write");
-        exit(1);
+/*
+write_all() keeps writing until the whole buffer is out, a single write() on a socket can be partial.
+A failed write only affects this connection (client hung up, reset, ...), so report it to the caller
+instead of exiting, the rest of the server keeps going.
+*/
+int write_all(int fd, const char* buf, size_t length) {
+    size_t sent = 0;
+    while (sent < length) {
+        ssize_t rv = write(fd, buf + sent, length - sent);
+        if (rv == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        sent += rv;
     }
+    return 0;
 }
 
-void write_error_response(int fd, char* cause, char* errnum, char* shortmsg, char* longmsg) {
-    char buf[MAXBUF], body[MAXBUF];
-    // create body first, its length is needed for header
-    sprintf(body, "" // second \r\n substitute before data
-    "<!doctype html>\r\n"
-    "<head>\r\n"
-    "  <title>OSTEP WebServer Error</title>\r\n"
-    "</head>\r\n"
-    "<body>\r\n"
-    "  <h2>%s: %s</h2>\r\n"
-    "  <p>%s: %s</p>\r\n"
-    "</body>\r\n"
-    "</html>\r\n", errnum, shortmsg, longmsg, cause);
+// read exactly length bytes, returns 0, or -1 if the other end closed or the read failed
+int read_all(int fd, char* buf, size_t length) {
+    size_t got = 0;
+    while (got < length) {
+        ssize_t rv = read(fd, buf + got, length - got);
+        if (rv == -1 && errno == EINTR) {
+            continue;
+        }
+        if (rv <= 0) {
+            return -1;
+        }
+        got += rv;
+    }
+    return 0;
+}
 
-    // header
-    sprintf(buf, "HTTP/1.1 %s %s\r\n", errnum, shortmsg);
-    write_or_die(fd, buf, strlen(buf));
+/*
+Frames for talking to the pooled fib.cgi workers (wserver -g) over a UNIX socket.
+A frame is a 4 byte length (host byte order, both ends are on the same machine) followed by that many bytes.
+The server sends one frame with the query string, the worker answers with one frame holding the whole
+HTTP response it would have printed as a one-shot CGI program.
+*/
+#define MAX_FRAME (1024 * 1024)
 
-    sprintf(buf, "Connection: close\r\n");
-    write_or_die(fd, buf, strlen(buf));
+int write_frame(int fd, const char* data, size_t length) {
+    uint32_t header = length;
+    if (length > MAX_FRAME || write_all(fd, (const char*) &header, sizeof header) == -1) {
+        return -1;
+    }
+    return write_all(fd, data, length);
+}
+
+// returns the frame's length (its bytes are in *data, which the caller frees), or -1
+ssize_t read_frame(int fd, char** data) {
+    uint32_t length;
+    if (read_all(fd, (char*) &length, sizeof length) == -1 || length > MAX_FRAME) {
+        return -1;
+    }
+    *data = (char*) malloc(length + 1); // +1 so text frames can be null terminated
+    if (read_all(fd, *data, length) == -1) {
+        free(*data);
+        return -1;
+    }
+    (*data)[length] = '\0';
+    return length;
+}
 
-    /*
-    get_date_time_string(&buf);
-    write_or_die(fd, buf, strlen(buf));
-    */
+/*
+Response builder.
+A response is assembled as a list of iovecs (status line, headers, blank line, body) and sent with
+one sendmsg()/writev(), instead of several small write()s that each cost a syscall and can leave
+small packets stuck behind Nagle's algorithm.
+Pieces that never change (status lines, the Connection/Server tail, Content-Type) are built once
+by http_messaging_init() and only pointed at, the Date header is formatted once a second by
+date_ticker() and copied in (37 bytes), so building a response does no sprintf() for them.
+*/
 
-    sprintf(buf, "Content-Length: %lu\r\n", strlen(body)); // %lu = long unsigned integer
-    write_or_die(fd, buf, strlen(buf));
+#define HTTP_DATE_LEN 37 // strlen("Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n")
+#define RB_MAX_IOV 12
+#define RB_REASON_MAX 64 // longer reasons are cut short, so an uncommon status line always fits in the scratch space
+#define MAX_STATUS 600
 
-    sprintf(buf, "Content-Type: text/html\r\n");
-    write_or_die(fd, buf, strlen(buf));
+const char SERVER_NAME[] = "cpsc4510 web server 1.0";
+const char CONTENT_TYPE_HTML[] = "Content-Type: text/html\r\n";
 
-    sprintf(buf, "Server: cpsc4510 web server 1.0\r\n");
-    write_or_die(fd, buf, strlen(buf));
+// constant header fragments, filled in once by http_messaging_init()
+struct header_fragments {
+    char* status_line[MAX_STATUS]; // "HTTP/1.1 404 Not Found\r\n", NULL for codes we never send
+    char* status_reason[MAX_STATUS]; // "Not Found", the reason status_line[] was built with
+    char tail[2][128]; // "Connection: ...\r\nServer: ...\r\n\r\n", [0] close, [1] keep-alive
+    size_t tail_len[2];
+};
+struct header_fragments fragments;
 
-    write_or_die(fd, body, strlen(body));
-}
+/*
+Two Date slots, date_ticker() rewrites the one readers aren't pointed at and then flips date_slot,
+so a reader copying the current slot never sees a half written date.
+*/
+char date_slots[2][HTTP_DATE_LEN + 1];
+volatile int date_slot = 0;
 
+void format_http_date(char* out, time_t t) {
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    strftime(out, HTTP_DATE_LEN + 1, "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+}
 
-/* my attempt at something fancy.. I don't have the time to make it work right now
-void write_successful_static_response(int fd, struct stat filestat, void* mapped) {
-    char buf[MAXBUF];
+void* date_ticker(void* arg) {
+    (void) arg;
+    while (1) {
+        // wake up right after the next second starts
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        struct timespec nap = {0, 1000000000L - now.tv_nsec};
+        nanosleep(&nap, NULL);
+
+        int next = 1 - date_slot;
+        format_http_date(date_slots[next], time(NULL));
+        __atomic_store_n(&date_slot, next, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
 
-    //header
-    sprintf(buf, "HTTP/1.1 200 OK\r\n");
-    write_or_die(fd, buf, strlen(buf));
+void add_status_line(int code, const char* reason) {
+    char line[128];
+    snprintf(line, sizeof line, "HTTP/1.1 %d %s\r\n", code, reason);
+    fragments.status_line[code] = strdup(line);
+    fragments.status_reason[code] = strdup(reason);
+}
 
-    sprintf(buf, "Connection: close\r\n");
-    write_or_die(fd, buf, strlen(buf));
+// build the constant fragments and start the Date ticker, call once before serving
+void http_messaging_init() {
+    add_status_line(200, "OK");
+    add_status_line(304, "Not Modified");
+    add_status_line(400, "Bad Request");
+    add_status_line(403, "Forbidden");
+    add_status_line(404, "Not Found");
+    add_status_line(431, "Request Header Fields Too Large");
+    add_status_line(500, "Internal Server Error");
+    add_status_line(501, "Not Implemented");
+    add_status_line(502, "Not Supported");
+    for (int keep_alive = 0; keep_alive <= 1; keep_alive++) {
+        fragments.tail_len[keep_alive] = snprintf(fragments.tail[keep_alive], sizeof fragments.tail[keep_alive],
+            "Connection: %s\r\nServer: %s\r\n\r\n", keep_alive ? "keep-alive" : "close", SERVER_NAME);
+    }
 
-    
-    //get_date_time_string(&buf);
-    //printf("buffer outside datetime: %s", buf);
-    //write_or_die(fd, buf, strlen(buf));
-    
+    format_http_date(date_slots[0], time(NULL));
+    pthread_t ticker;
+    pthread_create(&ticker, NULL, date_ticker, NULL);
+    pthread_detach(ticker);
+}
 
-    sprintf(buf, "Content-Length: %ld\r\n", filestat.st_size);
-    write_or_die(fd, buf, strlen(buf));
+struct response_builder {
+    struct iovec iov[RB_MAX_IOV];
+    int iovcnt;
+    int iov_pos; // first iovec that hasn't been completely sent
+    char date[HTTP_DATE_LEN];
+    char scratch[128]; // status line for uncommon codes, Content-Length
+    size_t scratch_len;
+    int code; // status code, for the server's metrics
+    size_t length; // bytes added, for the server's metrics
+    int keep_alive; // as given to rb_end_headers()
+    int overflow; // RB_OVERFLOW once a piece didn't fit, RB_REPLACED once rb_send() has swapped in a 500
+};
+
+#define RB_OVERFLOW 1
+#define RB_REPLACED 2
+
+// what went out for a response sent outside the response builder's control (CGI), for the server's metrics
+struct response_summary {
+    int code;
+    size_t bytes; // status line, headers and body
+};
 
-    sprintf(buf, "Content-Type: text/html\r\n");
-    write_or_die(fd, buf, strlen(buf));
+/*
+Add a piece of the response, p must stay valid until the response is sent.
+Returns -1 if the builder is out of iovecs: the response is then incomplete, and rb_send() answers with a 500 instead.
+*/
+int rb_add(struct response_builder* rb, const void* p, size_t len) {
+    if (len == 0) {
+        return 0;
+    }
+    if (rb->iovcnt == RB_MAX_IOV) {
+        rb->overflow = RB_OVERFLOW;
+        return -1;
+    }
+    rb->iov[rb->iovcnt].iov_base = (void*) p;
+    rb->iov[rb->iovcnt].iov_len = len;
+    rb->iovcnt++;
+    rb->length += len;
+    return 0;
+}
 
-    sprintf(buf, "Server: cpsc4510 web server 1.0\r\n\r\n");
-    write_or_die(fd, buf, strlen(buf));
+// formatted piece, kept in the builder's own scratch space, returns -1 like rb_add() if it doesn't fit
+int rb_addf(struct response_builder* rb, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+int rb_addf(struct response_builder* rb, const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    size_t room = sizeof rb->scratch - rb->scratch_len;
+    int len = vsnprintf(rb->scratch + rb->scratch_len, room, fmt, args);
+    va_end(args);
+    if (len < 0 || (size_t) len >= room) {
+        rb->overflow = RB_OVERFLOW;
+        return -1;
+    }
+    if (rb_add(rb, rb->scratch + rb->scratch_len, len) == -1) {
+        return -1;
+    }
+    rb->scratch_len += len;
+    return 0;
+}
 
-    int rv;
-    if ((rv = write(fd, mapped, filestat.st_size)) == -1) {
-        perror("server: write");
-        exit(1);
+/*
+Status line and Date header. The prebuilt status line is used when reason is the one it was built with
+(or NULL), any other reason gets a line of its own: a 502 can be a Bad Gateway as well as the server's
+"Not Supported". A code with no prebuilt line and no reason says "Unknown".
+*/
+void rb_start(struct response_builder* rb, int code, const char* reason) {
+    rb->iovcnt = 0;
+    rb->iov_pos = 0;
+    rb->scratch_len = 0;
+    rb->code = code;
+    rb->length = 0;
+    rb->keep_alive = 0;
+    rb->overflow = 0;
+    if (code > 0 && code < MAX_STATUS && fragments.status_line[code] != NULL
+            && (reason == NULL || strcmp(reason, fragments.status_reason[code]) == 0)) {
+        rb_add(rb, fragments.status_line[code], strlen(fragments.status_line[code]));
+    } else {
+        rb_addf(rb, "HTTP/1.1 %d %.*s\r\n", code, RB_REASON_MAX, reason != NULL ? reason : "Unknown");
     }
+    memcpy(rb->date, date_slots[__atomic_load_n(&date_slot, __ATOMIC_ACQUIRE)], HTTP_DATE_LEN);
+    rb_add(rb, rb->date, HTTP_DATE_LEN);
 }
 
-void print_successful_dyn_response(char body[]) {
-    char buf[MAXBUF];
+void rb_content_length(struct response_builder* rb, size_t length) {
+    rb_addf(rb, "Content-Length: %lu\r\n", (unsigned long) length);
+}
+
+// Connection and Server headers and the blank line, after this only the body can be added
+void rb_end_headers(struct response_builder* rb, int keep_alive) {
+    keep_alive = keep_alive ? 1 : 0;
+    rb->keep_alive = keep_alive;
+    rb_add(rb, fragments.tail[keep_alive], fragments.tail_len[keep_alive]);
+}
 
-    //header
-    std::cout << "HTTP/1.1 200 OK\r\n";
+/*
+Throw away a response that didn't fit in the builder and put an empty 500 in its place, so the client gets
+an answer rather than a response with pieces missing.
+*/
+void rb_fail(struct response_builder* rb) {
+    int keep_alive = rb->keep_alive;
+    rb_start(rb, 500, "Internal Server Error");
+    rb_content_length(rb, 0);
+    rb_end_headers(rb, keep_alive);
+    rb->overflow = RB_REPLACED;
+}
 
-    std::cout << "Connection: close\r\n";
+int rb_done(struct response_builder* rb) {
+    return rb->iov_pos == rb->iovcnt;
+}
 
-    char* date_time;
-    get_date_time_string(&date_time);
-    std::cout << "Date: " << date_time << "\r\n";
+/*
+One sendmsg() of whatever hasn't been sent yet, then move past the bytes that went out.
+Returns the number of bytes sent, or -1 with errno set (EAGAIN on a full non-blocking socket).
+*/
+ssize_t rb_send(int fd, struct response_builder* rb, int flags) {
+    if (rb->overflow == RB_OVERFLOW) {
+        rb_fail(rb);
+    }
+    struct msghdr msg;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = rb->iov + rb->iov_pos;
+    msg.msg_iovlen = rb->iovcnt - rb->iov_pos;
+    ssize_t rv = sendmsg(fd, &msg, flags | MSG_NOSIGNAL);
+    if (rv <= 0) {
+        return rv;
+    }
+    size_t left = rv;
+    while (left > 0 && rb->iov_pos < rb->iovcnt) {
+        struct iovec* v = &rb->iov[rb->iov_pos];
+        if (left < v->iov_len) {
+            v->iov_base = (char*) v->iov_base + left;
+            v->iov_len -= left;
+            left = 0;
+        } else {
+            left -= v->iov_len;
+            rb->iov_pos++;
+        }
+    }
+    return rv;
+}
 
-    std::cout << "Content-Length: " << strlen(body) << "\r\n";
+/*
+Blocking send of the whole response, returns -1 if the client went away, or if a 500 went out in place of
+a response that didn't fit (a caller with more to send after it mustn't).
+*/
+int rb_send_all(int fd, struct response_builder* rb) {
+    while (!rb_done(rb)) {
+        if (rb_send(fd, rb, 0) == -1 && errno != EINTR) {
+            return -1;
+        }
+    }
+    return rb->overflow == RB_REPLACED ? -1 : 0;
+}
 
-    std::cout << "Content-Type: text/html\r\n";
+/*
+build_error_response() adds a whole error response (header, blank line and body) to rb,
+so it can be sent right away with write_error_response() or handed to the event loop to send later.
+The body is formatted into body_buf (MAXBUF bytes), which must stay valid until the response is sent.
+keep_alive picks the Connection header, the server keeps reading requests from the connection afterwards.
+*/
+void build_error_response(struct response_builder* rb, char* body_buf, char* cause, char* errnum, char* shortmsg, char* longmsg, int keep_alive) {
+    // create body first, its length is needed for header
+    int body_len = snprintf(body_buf, MAXBUF, ""
+    "<!doctype html>\r\n"
+    "<head>\r\n"
+    "  <title>OSTEP WebServer Error</title>\r\n"
+    "</head>\r\n"
+    "<body>\r\n"
+    "  <h2>%s: %s</h2>\r\n"
+    "  <p>%s: %s</p>\r\n"
+    "</body>\r\n"
+    "</html>\r\n", errnum, shortmsg, longmsg, cause);
+    if (body_len >= MAXBUF) {
+        body_len = MAXBUF - 1;
+    }
 
-    std::cout << "Server: cpsc4510 web server 1.0\r\n\r\n";
+    // header
+    rb_start(rb, atoi(errnum), shortmsg);
+    rb_content_length(rb, body_len);
+    rb_add(rb, CONTENT_TYPE_HTML, strlen(CONTENT_TYPE_HTML));
+    rb_end_headers(rb, keep_alive);
+    rb_add(rb, body_buf, body_len);
+}
 
-    std::cout << body;
+int write_error_response(int fd, char* cause, char* errnum, char* shortmsg, char* longmsg) {
+    struct response_builder rb;
+    char body[MAXBUF];
+    build_error_response(&rb, body, cause, errnum, shortmsg, longmsg, 0);
+    return rb_send_all(fd, &rb);
 }
-*/
\ No newline at end of file
+
+#endif
@@ -0,0 +1,296 @@
+/*
+File: http_parser.h
+Description: incremental, non-copying HTTP/1.1 request head parser.
+    The server reads a request into its buffer a piece at a time and calls
+    http_parse() after every read. The parser remembers how far it has
+    already searched for the blank line ending the head, so a request that
+    arrives in many small reads is still only scanned once. Once the head
+    is complete the request line and headers are split into str_views
+    pointing into the caller's buffer: nothing is copied, nothing is
+    written (unlike strtok()) and nothing needs a null terminator.
+    Finding the ends of lines is most of the work. It is done with libc's
+    memchr(), which glibc already runs 32 or 64 bytes at a time with
+    whatever vector instructions the cpu has. Hand-written SSE2 and AVX2
+    scanners (checked against the cpu at runtime) can be swapped in with
+    http_parser_use(), bench/bench_parser times all three and checks that
+    they agree. They measured no faster than glibc's memchr(), so the
+    server stays on it.
+*/
+
+#ifndef HTTP_PARSER_H
+#define HTTP_PARSER_H
+
+// stdlib
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HTTP_PARSER_SIMD 1
+#endif
+
+#define HTTP_MAX_REQUEST 8192 // a request head (request line and headers) must fit in this many bytes
+#define HTTP_MAX_HEADERS 64
+
+// a piece of the request buffer, not null terminated
+struct str_view {
+    const char* p;
+    size_t len;
+};
+
+struct http_header {
+    struct str_view name;
+    struct str_view value; // without surrounding spaces
+};
+
+struct http_request {
+    struct str_view method;
+    struct str_view target; // path and query as sent, e.g. "/fib.cgi?n=5"
+    struct str_view path; // target up to '?'
+    struct str_view query; // after '?', empty if there was none
+    struct str_view version;
+    struct http_header headers[HTTP_MAX_HEADERS];
+    int header_count;
+    size_t length; // bytes of the head including its blank line, where a pipelined request would start
+};
+
+enum http_parse_result {
+    HTTP_PARSE_INCOMPLETE = 0, // the blank line hasn't arrived yet, read more and call again
+    HTTP_PARSE_DONE = 1,
+    HTTP_PARSE_ERROR = -1, // not an HTTP request
+    HTTP_PARSE_TOO_LARGE = -2 // more than HTTP_MAX_HEADERS headers
+};
+
+struct http_parser {
+    size_t scanned; // bytes already searched for the end of the head
+};
+
+void http_parser_init(struct http_parser* parser) {
+    parser->scanned = 0;
+}
+
+/*
+Scanners: index of the first '\n' in buf[from, len), len if there is none.
+*/
+
+size_t http_find_lf_memchr(const char* buf, size_t from, size_t len) {
+    const char* lf = (const char*) memchr(buf + from, '\n', len - from);
+    return lf != NULL ? (size_t) (lf - buf) : len;
+}
+
+#ifdef HTTP_PARSER_SIMD
+// header lines are long (cookies, user agents), so both check 64 bytes per branch and only then look closer
+__attribute__((target("sse2")))
+size_t http_find_lf_sse2(const char* buf, size_t from, size_t len) {
+    const __m128i lf = _mm_set1_epi8('\n');
+    size_t i = from;
+    for (; i + 64 <= len; i += 64) {
+        __m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (buf + i)), lf);
+        __m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (buf + i + 16)), lf);
+        __m128i c = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (buf + i + 32)), lf);
+        __m128i d = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (buf + i + 48)), lf);
+        if (_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d))) != 0) {
+            break; // it's in these 64 bytes, the loop below finds where
+        }
+    }
+    for (; i + 16 <= len; i += 16) {
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (buf + i)), lf));
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    for (; i < len; i++) {
+        if (buf[i] == '\n') return i;
+    }
+    return len;
+}
+
+__attribute__((target("avx2")))
+size_t http_find_lf_avx2(const char* buf, size_t from, size_t len) {
+    const __m256i lf = _mm256_set1_epi8('\n');
+    size_t i = from;
+    for (; i + 64 <= len; i += 64) {
+        __m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (buf + i)), lf);
+        __m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (buf + i + 32)), lf);
+        if (_mm256_movemask_epi8(_mm256_or_si256(a, b)) != 0) {
+            unsigned mask = (unsigned) _mm256_movemask_epi8(a);
+            if (mask != 0) {
+                return i + __builtin_ctz(mask);
+            }
+            return i + 32 + __builtin_ctz((unsigned) _mm256_movemask_epi8(b));
+        }
+    }
+    for (; i + 32 <= len; i += 32) {
+        unsigned mask = (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (buf + i)), lf));
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return http_find_lf_memchr(buf, i, len); // the last few bytes (not the SSE2 version, mixing legacy SSE into AVX code stalls)
+}
+#endif
+
+enum http_scan_kind { HTTP_SCAN_MEMCHR, HTTP_SCAN_SSE2, HTTP_SCAN_AVX2 };
+
+size_t (*http_find_lf)(const char* buf, size_t from, size_t len) = http_find_lf_memchr;
+
+// use the scanner kind, or the widest one below it that this cpu has, returns the one picked
+enum http_scan_kind http_parser_use(enum http_scan_kind kind) {
+#ifdef HTTP_PARSER_SIMD
+    __builtin_cpu_init();
+    if (kind == HTTP_SCAN_AVX2 && __builtin_cpu_supports("avx2")) {
+        http_find_lf = http_find_lf_avx2;
+        return HTTP_SCAN_AVX2;
+    }
+    if (kind >= HTTP_SCAN_SSE2 && __builtin_cpu_supports("sse2")) {
+        http_find_lf = http_find_lf_sse2;
+        return HTTP_SCAN_SSE2;
+    }
+#endif
+    http_find_lf = http_find_lf_memchr;
+    return HTTP_SCAN_MEMCHR;
+}
+
+int sv_eq(struct str_view v, const char* s) {
+    return v.len == strlen(s) && memcmp(v.p, s, v.len) == 0;
+}
+
+int sv_ieq(struct str_view v, const char* s) {
+    return v.len == strlen(s) && strncasecmp(v.p, s, v.len) == 0;
+}
+
+struct str_view sv_trim(const char* p, size_t len) {
+    while (len > 0 && (*p == ' ' || *p == '\t')) {
+        p++;
+        len--;
+    }
+    while (len > 0 && (p[len - 1] == ' ' || p[len - 1] == '\t')) {
+        len--;
+    }
+    struct str_view v = {p, len};
+    return v;
+}
+
+// split the complete head buf[0, length) into req
+int http_parse_head(const char* buf, size_t length, struct http_request* req) {
+    // request line: method SP target SP version CRLF
+    size_t eol = http_find_lf(buf, 0, length);
+    if (eol == 0 || buf[eol - 1] != '\r') {
+        return HTTP_PARSE_ERROR;
+    }
+    const char* line = buf;
+    size_t line_len = eol - 1;
+    if (memchr(line, '\r', line_len) != NULL) {
+        return HTTP_PARSE_ERROR; // a CR without its LF, RFC 9112 lets a server refuse it rather than guess where the line ends
+    }
+    const char* sp1 = (const char*) memchr(line, ' ', line_len);
+    if (sp1 == NULL || sp1 == line) {
+        return HTTP_PARSE_ERROR;
+    }
+    const char* target = sp1 + 1;
+    const char* sp2 = (const char*) memchr(target, ' ', line + line_len - target);
+    if (sp2 == NULL || sp2 == target || sp2 + 1 == line + line_len) {
+        return HTTP_PARSE_ERROR;
+    }
+    req->method.p = line;
+    req->method.len = sp1 - line;
+    req->target.p = target;
+    req->target.len = sp2 - target;
+    req->version.p = sp2 + 1;
+    req->version.len = line + line_len - (sp2 + 1);
+    const char* question = (const char*) memchr(target, '?', req->target.len);
+    req->path.p = target;
+    req->path.len = question != NULL ? (size_t) (question - target) : req->target.len;
+    req->query.p = question != NULL ? question + 1 : target + req->target.len;
+    req->query.len = target + req->target.len - req->query.p;
+
+    // header lines until the empty one: name ":" OWS value OWS CRLF
+    req->header_count = 0;
+    size_t pos = eol + 1;
+    while (1) {
+        eol = http_find_lf(buf, pos, length);
+        if (eol == length || buf[eol - 1] != '\r') {
+            return HTTP_PARSE_ERROR;
+        }
+        if (eol == pos + 1) {
+            break; // the blank line
+        }
+        line = buf + pos;
+        line_len = eol - 1 - pos;
+        if (memchr(line, '\r', line_len) != NULL) {
+            return HTTP_PARSE_ERROR; // would smuggle "Host: x\rEvil: y" in as one value
+        }
+        const char* colon = (const char*) memchr(line, ':', line_len);
+        if (colon == NULL || colon == line || line[0] == ' ' || line[0] == '\t' || colon[-1] == ' ' || colon[-1] == '\t') {
+            return HTTP_PARSE_ERROR; // no name, or folded/badly spaced, which RFC 9112 says to reject
+        }
+        if (req->header_count == HTTP_MAX_HEADERS) {
+            return HTTP_PARSE_TOO_LARGE;
+        }
+        struct http_header* h = &req->headers[req->header_count++];
+        h->name.p = line;
+        h->name.len = colon - line;
+        h->value = sv_trim(colon + 1, line + line_len - (colon + 1));
+        pos = eol + 1;
+    }
+    return HTTP_PARSE_DONE;
+}
+
+/*
+Parse the request at the start of buf[0, len). Call again with the same parser and a longer len after
+every read, the bytes already in buf must not move (unless http_parser_init() starts over).
+Returns HTTP_PARSE_DONE with req filled in, HTTP_PARSE_INCOMPLETE, or a negative error.
+*/
+int http_parse(struct http_parser* parser, const char* buf, size_t len, struct http_request* req) {
+    size_t pos = parser->scanned;
+    while (pos < len) {
+        size_t lf = http_find_lf(buf, pos, len);
+        if (lf == len) {
+            break;
+        }
+        if (lf >= 3 && buf[lf - 1] == '\r' && buf[lf - 2] == '\n' && buf[lf - 3] == '\r') {
+            parser->scanned = lf + 1;
+            req->length = lf + 1;
+            return http_parse_head(buf, req->length, req);
+        }
+        if (lf >= 1 && buf[lf - 1] == '\n') {
+            return HTTP_PARSE_ERROR; // a blank line ended by a bare LF, refused right away instead of waiting for a CRLF one
+        }
+        pos = lf + 1;
+    }
+    parser->scanned = len;
+    return HTTP_PARSE_INCOMPLETE;
+}
+
+// the value of the first header called name (any case), NULL if there is none
+const struct str_view* http_header_get(const struct http_request* req, const char* name) {
+    for (int i = 0; i < req->header_count; i++) {
+        if (sv_ieq(req->headers[i].name, name)) {
+            return &req->headers[i].value;
+        }
+    }
+    return NULL;
+}
+
+// does a comma separated header value (like Connection's) contain token, in any case
+int sv_has_token(struct str_view v, const char* token) {
+    size_t pos = 0;
+    while (pos < v.len) {
+        const char* comma = (const char*) memchr(v.p + pos, ',', v.len - pos);
+        size_t end = comma != NULL ? (size_t) (comma - v.p) : v.len;
+        if (sv_ieq(sv_trim(v.p + pos, end - pos), token)) {
+            return 1;
+        }
+        pos = end + 1;
+    }
+    return 0;
+}
+
+// HTTP/1.1 connections are persistent unless the request says "Connection: close"
+int http_keep_alive(const struct http_request* req) {
+    const struct str_view* connection = http_header_get(req, "Connection");
+    return connection == NULL || !sv_has_token(*connection, "close");
+}
+
+#endif
@@ -0,0 +1,625 @@
+/*
+File: load_test.h
+Description: wclient's benchmark mode, a multi-threaded HTTP load generator.
+    -c connections are spread over -t threads, each thread drives its
+    share with one epoll loop (non-blocking connect, send, read), so a few
+    threads can hold many connections.
+    Closed loop (default): a connection sends its next request as soon as
+    the previous response is complete.
+    Open loop (-R rate): requests are due on a fixed schedule, rate per
+    second over all connections, whether or not the server keeps up.
+    Latency is measured from when a request was due, not from when it
+    could finally be sent. A stalled server then shows up as the stall it
+    caused every queued request, instead of as one slow request (the
+    "coordinated omission" a closed loop suffers from).
+    Responses are framed by Content-Length, chunked encoding, or the
+    server closing, so keep-alive connections (-k 1) carry one request
+    after another. -k 0 opens a connection per request.
+    Latencies go into an HDR-style histogram per thread (exact below
+    256 us, then 128 buckets per power of two, under 1% error), merged at
+    the end into a percentile table.
+*/
+
+#ifndef LOAD_TEST_H
+#define LOAD_TEST_H
+
+// stdlib
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+
+// network
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+// threads
+#include <pthread.h>
+
+// stl
+#include <string>
+#include <vector>
+
+#define LT_HIST_SUB_BITS 8 // values below 2^8 us are exact
+#define LT_HIST_HALF (1 << (LT_HIST_SUB_BITS - 1))
+#define LT_HIST_MAX_BITS 40 // up to about 12 days in us
+#define LT_HIST_BUCKETS ((1 << LT_HIST_SUB_BITS) + (LT_HIST_MAX_BITS - LT_HIST_SUB_BITS + 1) * LT_HIST_HALF)
+#define LT_HEAD_MAX 16384 // response header section
+#define LT_REQUEST_MAX 2048
+
+struct load_test_options {
+    const char* server;
+    const char* port;
+    int connections; // -c
+    int threads; // -t
+    int duration; // -d seconds
+    int keep_alive; // -k
+    double rate; // -R requests per second over all connections, 0 for closed loop
+    std::vector<std::string> paths; // -u path, or every line of the -l file, sent round-robin
+};
+
+struct lt_histogram {
+    uint64_t counts[LT_HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+};
+
+int lt_bucket(uint64_t v) {
+    if (v < (1u << LT_HIST_SUB_BITS)) {
+        return (int) v;
+    }
+    int magnitude = 63 - __builtin_clzll(v);
+    if (magnitude > LT_HIST_MAX_BITS) {
+        return LT_HIST_BUCKETS - 1;
+    }
+    int shift = magnitude - LT_HIST_SUB_BITS + 1;
+    int sub = (int) (v >> shift); // in [HALF, 2 * HALF)
+    return (1 << LT_HIST_SUB_BITS) + (shift - 1) * LT_HIST_HALF + (sub - LT_HIST_HALF);
+}
+
+// the largest value that lands in bucket b
+uint64_t lt_bucket_value(int b) {
+    if (b < (1 << LT_HIST_SUB_BITS)) {
+        return b;
+    }
+    int shift = (b - (1 << LT_HIST_SUB_BITS)) / LT_HIST_HALF + 1;
+    uint64_t sub = (b - (1 << LT_HIST_SUB_BITS)) % LT_HIST_HALF + LT_HIST_HALF;
+    return ((sub + 1) << shift) - 1;
+}
+
+void lt_record(struct lt_histogram* h, uint64_t us) {
+    h->counts[lt_bucket(us)]++;
+    h->total++;
+    if (us > h->max) {
+        h->max = us;
+    }
+}
+
+uint64_t lt_percentile(const struct lt_histogram* h, double percentile) {
+    if (h->total == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t) (percentile / 100.0 * h->total + 0.5);
+    if (rank < 1) rank = 1;
+    uint64_t seen = 0;
+    for (int b = 0; b < LT_HIST_BUCKETS; b++) {
+        seen += h->counts[b];
+        if (seen >= rank) {
+            uint64_t v = lt_bucket_value(b);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+// counters of one thread, added up at the end
+struct lt_stats {
+    long requests;
+    uint64_t bytes; // response bytes read, headers included
+    long connects;
+    long connect_errors;
+    long socket_errors; // reset, closed mid-response, unparsable response
+    long status_4xx;
+    long status_5xx;
+    long late; // open loop: requests sent more than 1 ms after they were due
+    long unfinished; // in flight at the deadline, plus (open loop) those due but never sent
+    struct lt_histogram latency;
+};
+
+enum lt_state { LT_IDLE, LT_CONNECTING, LT_SENDING, LT_READING };
+enum lt_phase { LT_HEAD, LT_BODY_LENGTH, LT_CHUNK_SIZE, LT_CHUNK_DATA, LT_CHUNK_TRAILER, LT_BODY_CLOSE };
+
+struct lt_conn {
+    int fd; // -1 when not connected
+    enum lt_state state;
+    double due_us; // when the next request should start
+    double start_us; // when the current one should have started, its latency counts from here
+    size_t next_path;
+    char request[LT_REQUEST_MAX];
+    size_t request_len;
+    size_t request_sent;
+
+    // response framing
+    enum lt_phase phase;
+    char head[LT_HEAD_MAX];
+    size_t head_len;
+    long remaining; // body (or chunk data plus its CRLF) bytes still to come
+    char line[64]; // chunk size or trailer line being collected
+    size_t line_len;
+    int status;
+    int server_closes; // "Connection: close" in the response
+};
+
+struct lt_thread {
+    const struct load_test_options* options;
+    struct addrinfo* servinfo;
+    std::vector<struct lt_conn*> conns;
+    double end_us;
+    double interval_us; // open loop: time between two requests on one connection
+    int epfd;
+    struct lt_stats stats;
+};
+
+double lt_now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+void lt_watch(struct lt_thread* t, struct lt_conn* c, uint32_t events) {
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = c;
+    epoll_ctl(t->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+void lt_close(struct lt_conn* c) {
+    if (c->fd != -1) {
+        close(c->fd);
+        c->fd = -1;
+    }
+}
+
+// the connection failed, try again on a fresh one a little later
+void lt_fail(struct lt_thread* t, struct lt_conn* c, long* counter) {
+    (*counter)++;
+    lt_close(c);
+    c->state = LT_IDLE;
+    double now = lt_now_us();
+    c->due_us = t->options->rate > 0 ? c->start_us + t->interval_us : now + 1000;
+}
+
+// "HTTP/1.1 200 OK" and the headers that frame the body
+int lt_parse_head(struct lt_conn* c) {
+    if (c->head_len < 12 || strncmp(c->head, "HTTP/1.", 7) != 0) {
+        return -1;
+    }
+    c->status = atoi(c->head + 9);
+    long length = -1;
+    int chunked = 0;
+    c->server_closes = 0;
+    const char* p = strstr(c->head, "\r\n");
+    while (p != NULL && p[2] != '\r') {
+        const char* name = p + 2;
+        const char* value = strchr(name, ':');
+        p = strstr(name, "\r\n");
+        if (value == NULL || p == NULL || value > p) {
+            continue;
+        }
+        value++;
+        while (*value == ' ') value++;
+        if (strncasecmp(name, "Content-Length:", 15) == 0) {
+            length = atol(value);
+        } else if (strncasecmp(name, "Transfer-Encoding:", 18) == 0 && strncasecmp(value, "chunked", 7) == 0) {
+            chunked = 1;
+        } else if (strncasecmp(name, "Connection:", 11) == 0 && strncasecmp(value, "close", 5) == 0) {
+            c->server_closes = 1;
+        }
+    }
+    if (c->status == 204 || c->status == 304 || (c->status >= 100 && c->status < 200)) {
+        c->remaining = 0;
+        c->phase = LT_BODY_LENGTH;
+    } else if (chunked) {
+        c->phase = LT_CHUNK_SIZE;
+        c->line_len = 0;
+    } else if (length >= 0) {
+        c->phase = LT_BODY_LENGTH;
+        c->remaining = length;
+    } else {
+        c->phase = LT_BODY_CLOSE;
+    }
+    return 0;
+}
+
+// collect a line for the chunk parser, returns 1 once it is complete (without its "\r\n")
+int lt_take_line(struct lt_conn* c, const char** data, size_t* n) {
+    while (*n > 0) {
+        char ch = **data;
+        (*data)++;
+        (*n)--;
+        if (ch == '\n') {
+            if (c->line_len > 0 && c->line[c->line_len - 1] == '\r') {
+                c->line_len--;
+            }
+            c->line[c->line_len] = '\0';
+            return 1;
+        }
+        if (c->line_len < sizeof c->line - 1) {
+            c->line[c->line_len++] = ch;
+        }
+    }
+    return 0;
+}
+
+// feed response bytes, returns 1 when the response is complete, 0 for more, -1 if it can't be parsed
+int lt_feed(struct lt_conn* c, const char* data, size_t n) {
+    while (1) {
+        switch (c->phase) {
+        case LT_HEAD: {
+            size_t old_len = c->head_len;
+            size_t take = n < LT_HEAD_MAX - 1 - old_len ? n : LT_HEAD_MAX - 1 - old_len;
+            memcpy(c->head + old_len, data, take);
+            c->head_len += take;
+            c->head[c->head_len] = '\0';
+            char* end = strstr(c->head + (old_len > 3 ? old_len - 3 : 0), "\r\n\r\n");
+            if (end == NULL) {
+                return c->head_len == LT_HEAD_MAX - 1 ? -1 : 0;
+            }
+            size_t used = end + 4 - c->head - old_len;
+            data += used;
+            n -= used;
+            end[2] = '\0'; // header lines still end in "\r\n" for lt_parse_head()
+            if (lt_parse_head(c) == -1) {
+                return -1;
+            }
+            break;
+        }
+        case LT_BODY_LENGTH: {
+            size_t take = n < (size_t) c->remaining ? n : c->remaining;
+            c->remaining -= take;
+            return c->remaining == 0 ? 1 : 0; // anything after the body is ignored, requests aren't pipelined
+        }
+        case LT_CHUNK_SIZE:
+            if (!lt_take_line(c, &data, &n)) {
+                return 0;
+            }
+            c->remaining = strtol(c->line, NULL, 16);
+            c->line_len = 0;
+            if (c->remaining < 0) {
+                return -1;
+            }
+            if (c->remaining == 0) {
+                c->phase = LT_CHUNK_TRAILER;
+            } else {
+                c->remaining += 2; // the CRLF after the data
+                c->phase = LT_CHUNK_DATA;
+            }
+            break;
+        case LT_CHUNK_DATA: {
+            size_t take = n < (size_t) c->remaining ? n : c->remaining;
+            c->remaining -= take;
+            data += take;
+            n -= take;
+            if (c->remaining > 0) {
+                return 0;
+            }
+            c->phase = LT_CHUNK_SIZE;
+            break;
+        }
+        case LT_CHUNK_TRAILER:
+            if (!lt_take_line(c, &data, &n)) {
+                return 0;
+            }
+            if (c->line_len == 0) {
+                return 1;
+            }
+            c->line_len = 0;
+            break;
+        case LT_BODY_CLOSE:
+            return 0; // complete when the server closes
+        }
+    }
+}
+
+void lt_finish(struct lt_thread* t, struct lt_conn* c) {
+    double now = lt_now_us();
+    struct lt_stats* s = &t->stats;
+    s->requests++;
+    lt_record(&s->latency, (uint64_t) (now - c->start_us));
+    if (c->status >= 500) {
+        s->status_5xx++;
+    } else if (c->status >= 400) {
+        s->status_4xx++;
+    }
+    if (c->server_closes || !t->options->keep_alive || c->phase == LT_BODY_CLOSE) {
+        lt_close(c);
+    } else {
+        lt_watch(t, c, EPOLLIN); // to notice the server closing it while idle
+    }
+    c->state = LT_IDLE;
+    c->due_us = t->options->rate > 0 ? c->start_us + t->interval_us : now;
+}
+
+void lt_send(struct lt_thread* t, struct lt_conn* c) {
+    while (c->request_sent < c->request_len) {
+        ssize_t n = send(c->fd, c->request + c->request_sent, c->request_len - c->request_sent, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            c->state = LT_SENDING;
+            lt_watch(t, c, EPOLLOUT);
+            return;
+        }
+        if (n <= 0) {
+            lt_fail(t, c, &t->stats.socket_errors);
+            return;
+        }
+        c->request_sent += n;
+    }
+    c->state = LT_READING;
+    c->phase = LT_HEAD;
+    c->head_len = 0;
+    lt_watch(t, c, EPOLLIN);
+}
+
+// start the next request on c, connecting first if needed
+void lt_start(struct lt_thread* t, struct lt_conn* c, double now) {
+    const struct load_test_options* o = t->options;
+    c->start_us = o->rate > 0 ? c->due_us : now;
+    if (o->rate > 0 && now - c->due_us > 1000) {
+        t->stats.late++;
+    }
+    const std::string& path = o->paths[c->next_path];
+    c->next_path = (c->next_path + 1) % o->paths.size();
+    int len = snprintf(c->request, sizeof c->request, "GET %s%s HTTP/1.1\r\nHost: %s\r\n%s\r\n",
+        path[0] == '/' ? "" : "/", path.c_str(), o->server, o->keep_alive ? "" : "Connection: close\r\n");
+    c->request_len = len < (int) sizeof c->request ? len : sizeof c->request - 1;
+    c->request_sent = 0;
+
+    if (c->fd != -1) {
+        lt_send(t, c);
+        return;
+    }
+    t->stats.connects++;
+    c->fd = socket(t->servinfo->ai_family, t->servinfo->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, t->servinfo->ai_protocol);
+    if (c->fd == -1) {
+        lt_fail(t, c, &t->stats.connect_errors);
+        return;
+    }
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    struct epoll_event ev;
+    ev.events = EPOLLOUT;
+    ev.data.ptr = c;
+    epoll_ctl(t->epfd, EPOLL_CTL_ADD, c->fd, &ev);
+    if (connect(c->fd, t->servinfo->ai_addr, t->servinfo->ai_addrlen) == 0) {
+        lt_send(t, c);
+    } else if (errno == EINPROGRESS) {
+        c->state = LT_CONNECTING;
+    } else {
+        lt_fail(t, c, &t->stats.connect_errors);
+    }
+}
+
+void lt_on_event(struct lt_thread* t, struct lt_conn* c, char* buf, size_t cap) {
+    if (c->state == LT_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof err;
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0) {
+            lt_fail(t, c, &t->stats.connect_errors);
+            return;
+        }
+        lt_send(t, c);
+        return;
+    }
+    if (c->state == LT_SENDING) {
+        lt_send(t, c);
+        return;
+    }
+    while (1) {
+        ssize_t n = read(c->fd, buf, cap);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (c->state == LT_IDLE) { // the server closed a kept-alive connection between requests, reconnect next time
+            lt_close(c);
+            return;
+        }
+        if (n == 0 && c->phase == LT_BODY_CLOSE) {
+            lt_finish(t, c);
+            return;
+        }
+        if (n <= 0) {
+            lt_fail(t, c, &t->stats.socket_errors);
+            return;
+        }
+        t->stats.bytes += n;
+        int done = lt_feed(c, buf, n);
+        if (done == -1) {
+            lt_fail(t, c, &t->stats.socket_errors);
+            return;
+        }
+        if (done == 1) {
+            lt_finish(t, c);
+            return;
+        }
+    }
+}
+
+void* lt_thread_main(void* arg) {
+    struct lt_thread* t = (struct lt_thread*) arg;
+    t->epfd = epoll_create1(EPOLL_CLOEXEC);
+    std::vector<char> buf(65536);
+    struct epoll_event events[256];
+    while (1) {
+        double now = lt_now_us();
+        if (now >= t->end_us) {
+            break;
+        }
+        double next_due = t->end_us;
+        for (size_t i = 0; i < t->conns.size(); i++) {
+            struct lt_conn* c = t->conns[i];
+            if (c->state != LT_IDLE) {
+                continue;
+            }
+            if (c->due_us <= now) {
+                lt_start(t, c, now);
+            }
+            if (c->state == LT_IDLE && c->due_us < next_due) {
+                next_due = c->due_us;
+            }
+        }
+        double wait_us = next_due - lt_now_us();
+        struct timespec timeout = {0, 0};
+        if (wait_us > 0) {
+            timeout.tv_sec = (time_t) (wait_us / 1e6);
+            timeout.tv_nsec = (long) ((wait_us - timeout.tv_sec * 1e6) * 1000);
+        }
+        int n = epoll_pwait2(t->epfd, events, 256, &timeout, NULL);
+        for (int i = 0; i < n; i++) {
+            lt_on_event(t, (struct lt_conn*) events[i].data.ptr, buf.data(), buf.size());
+        }
+    }
+    for (size_t i = 0; i < t->conns.size(); i++) {
+        // a server that stopped answering must not look better than a slow one, count what it never answered
+        struct lt_conn* c = t->conns[i];
+        if (t->options->rate > 0) {
+            double first = c->state == LT_IDLE ? c->due_us : c->start_us;
+            if (first < t->end_us) {
+                t->stats.unfinished += (long) ((t->end_us - first) / t->interval_us) + 1;
+            }
+        } else if (c->state != LT_IDLE) {
+            t->stats.unfinished++;
+        }
+        lt_close(c);
+        delete c;
+    }
+    close(t->epfd);
+    return NULL;
+}
+
+/*
+Read the -l file: one path (or http://host:port/path URL) per line, blank lines and '#' comments skipped.
+Returns the number of paths added, -1 if the file can't be read.
+*/
+int load_test_read_paths(const char* file, std::vector<std::string>* paths) {
+    FILE* f = fopen(file, "r");
+    if (f == NULL) {
+        return -1;
+    }
+    char line[LT_REQUEST_MAX];
+    int added = 0;
+    while (fgets(line, sizeof line, f) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        const char* path = line;
+        while (*path == ' ' || *path == '\t') path++;
+        if (*path == '\0' || *path == '#') {
+            continue;
+        }
+        if (strncmp(path, "http://", 7) == 0) {
+            path = strchr(path + 7, '/');
+            if (path == NULL) path = "/";
+        }
+        paths->push_back(path);
+        added++;
+    }
+    fclose(f);
+    return added;
+}
+
+void load_test_report(const struct load_test_options* o, const struct lt_stats* s, double seconds) {
+    printf("%ld requests in %.1fs over %d connections (%d threads, %s)\n", s->requests, seconds, o->connections, o->threads,
+        o->rate > 0 ? "open loop" : "closed loop");
+    printf("requests/sec: %.1f  transfer/sec: %.2f MB\n", s->requests / seconds, s->bytes / seconds / (1024 * 1024));
+    printf("connects: %ld  errors: connect %ld  socket %ld  4xx %ld  5xx %ld  unfinished %ld\n", s->connects, s->connect_errors,
+        s->socket_errors, s->status_4xx, s->status_5xx, s->unfinished);
+    if (o->rate > 0) {
+        printf("target rate: %.1f/s  sent more than 1 ms late: %ld\n", o->rate, s->late);
+    }
+    printf("latency (us, from when each request was %s):\n", o->rate > 0 ? "due" : "sent");
+    double percentiles[] = {50, 75, 90, 99, 99.9, 99.99};
+    for (size_t i = 0; i < sizeof percentiles / sizeof percentiles[0]; i++) {
+        printf("  p%-6g %10lu\n", percentiles[i], (unsigned long) lt_percentile(&s->latency, percentiles[i]));
+    }
+    printf("  max     %10lu\n", (unsigned long) s->latency.max);
+}
+
+// run the whole test and print the report, returns 0, or 1 if the server couldn't be resolved
+int load_test_run(const struct load_test_options* o) {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* servinfo;
+    int rv = getaddrinfo(o->server, o->port, &hints, &servinfo);
+    if (rv != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+        return 1;
+    }
+
+    std::vector<struct lt_thread*> threads;
+    double begin = lt_now_us() + 10000; // let every thread get going first
+    for (int i = 0; i < o->threads; i++) {
+        struct lt_thread* t = new struct lt_thread;
+        memset(&t->stats, 0, sizeof t->stats);
+        t->options = o;
+        t->servinfo = servinfo;
+        t->end_us = begin + o->duration * 1e6;
+        t->interval_us = o->rate > 0 ? o->connections * 1e6 / o->rate : 0;
+        threads.push_back(t);
+    }
+    for (int i = 0; i < o->connections; i++) {
+        struct lt_conn* c = new struct lt_conn;
+        c->fd = -1;
+        c->state = LT_IDLE;
+        // open loop: stagger the connections' schedules so requests are spread evenly over time
+        c->due_us = begin + (o->rate > 0 ? i * 1e6 / o->rate : 0);
+        c->next_path = i % o->paths.size();
+        threads[i % o->threads]->conns.push_back(c);
+    }
+
+    std::vector<pthread_t> ids(o->threads);
+    for (int i = 0; i < o->threads; i++) {
+        pthread_create(&ids[i], NULL, lt_thread_main, threads[i]);
+    }
+    struct lt_stats total;
+    memset(&total, 0, sizeof total);
+    for (int i = 0; i < o->threads; i++) {
+        pthread_join(ids[i], NULL);
+        struct lt_stats* s = &threads[i]->stats;
+        total.requests += s->requests;
+        total.bytes += s->bytes;
+        total.connects += s->connects;
+        total.connect_errors += s->connect_errors;
+        total.socket_errors += s->socket_errors;
+        total.status_4xx += s->status_4xx;
+        total.status_5xx += s->status_5xx;
+        total.late += s->late;
+        total.unfinished += s->unfinished;
+        for (int b = 0; b < LT_HIST_BUCKETS; b++) {
+            total.latency.counts[b] += s->latency.counts[b];
+        }
+        total.latency.total += s->latency.total;
+        if (s->latency.max > total.latency.max) {
+            total.latency.max = s->latency.max;
+        }
+        delete threads[i];
+    }
+    load_test_report(o, &total, o->duration);
+    freeaddrinfo(servinfo);
+    return 0;
+}
+
+#endif
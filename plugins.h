@@ -0,0 +1,151 @@
+/*
+File: plugins.h
+Description: loads handler plugins (handler.h) and routes requests to them.
+    At startup every *.so in the handlers directory (wserver -d) is
+    dlopen()ed and its handle() looked up, requests whose path starts with
+    a plugin's prefix are answered by calling it directly, no fork(),
+    execve() or pipe, the answer is buffered in a plugin_output and sent
+    with the response builder like any other response.
+    The table is built before any thread starts and never changes, so
+    lookups need no lock.
+*/
+
+#ifndef PLUGINS_H
+#define PLUGINS_H
+
+// stdlib
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+// directory listing and dynamic loading
+#include <dirent.h>
+#include <dlfcn.h>
+
+// stl
+#include <string>
+#include <vector>
+
+#include "handler.h"
+
+struct plugin {
+    std::string prefix;
+    handler_fn handle;
+    void* library;
+};
+
+std::vector<struct plugin> plugins;
+
+// load every *.so in dir, returns the number of plugins loaded (a missing directory just means none)
+int plugins_load(const char* dir) {
+    DIR* d = opendir(dir);
+    if (d == NULL) {
+        perror("handlers directory");
+        return 0;
+    }
+    struct dirent* ent;
+    while ((ent = readdir(d)) != NULL) {
+        size_t len = strlen(ent->d_name);
+        if (len <= 3 || strcmp(ent->d_name + len - 3, ".so") != 0) {
+            continue;
+        }
+        std::string file = std::string(dir) + "/" + ent->d_name;
+        void* library = dlopen(file.c_str(), RTLD_NOW | RTLD_LOCAL);
+        if (library == NULL) {
+            fprintf(stderr, "dlopen: %s\n", dlerror());
+            continue;
+        }
+        handler_fn handle = (handler_fn) dlsym(library, "handle");
+        if (handle == NULL) {
+            fprintf(stderr, "%s: no handle() entry point\n", file.c_str());
+            dlclose(library);
+            continue;
+        }
+        struct plugin p;
+        const char* prefix = (const char*) dlsym(library, "handler_prefix");
+        p.prefix = prefix != NULL ? std::string(prefix) : std::string(ent->d_name, len - 3);
+        p.handle = handle;
+        p.library = library;
+        plugins.push_back(p);
+    }
+    closedir(d);
+    return plugins.size();
+}
+
+/*
+The plugin answering path (no leading '/', query string still attached), or NULL.
+A prefix matches a whole path segment: "fib.cgi" answers "fib.cgi" and "fib.cgi?n=3", not "fib.cgiX".
+*/
+struct plugin* plugins_find(const char* path) {
+    for (size_t i = 0; i < plugins.size(); i++) {
+        const std::string& prefix = plugins[i].prefix;
+        if (strncmp(path, prefix.c_str(), prefix.size()) == 0) {
+            char next = path[prefix.size()];
+            if (next == '\0' || next == '?' || next == '/') {
+                return &plugins[i];
+            }
+        }
+    }
+    return NULL;
+}
+
+// what a plugin wrote, turned into a response by the server
+struct plugin_output {
+    int code;
+    std::string reason;
+    std::string headers; // "Name: value\r\n" lines
+    int has_content_type;
+    std::string body;
+};
+
+void plugin_status(struct response_writer* out, int code, const char* reason) {
+    struct plugin_output* po = (struct plugin_output*) out->ctx;
+    po->code = code;
+    po->reason = reason;
+}
+
+void plugin_header(struct response_writer* out, const char* name, const char* value) {
+    struct plugin_output* po = (struct plugin_output*) out->ctx;
+    if (strchr(name, '\n') != NULL || strchr(value, '\n') != NULL) { // no smuggling extra headers in
+        return;
+    }
+    if (strcasecmp(name, "Content-Type") == 0) {
+        po->has_content_type = 1;
+    }
+    po->headers.append(name).append(": ").append(value).append("\r\n");
+}
+
+void plugin_write(struct response_writer* out, const char* data, size_t length) {
+    struct plugin_output* po = (struct plugin_output*) out->ctx;
+    po->body.append(data, length);
+}
+
+/*
+Call the plugin for one request. Returns its return value (0 is success), po holds what it wrote.
+path is cut at '?' for the duration of the call.
+*/
+int plugin_call(struct plugin* p, const char* method, char* path, struct plugin_output* po) {
+    po->code = 200;
+    po->reason = "OK";
+    po->headers.clear();
+    po->has_content_type = 0;
+    po->body.clear();
+
+    struct response_writer out;
+    out.ctx = po;
+    out.status = plugin_status;
+    out.header = plugin_header;
+    out.write = plugin_write;
+
+    char* question = strchr(path, '?');
+    struct handler_request req;
+    req.method = method;
+    req.path = path;
+    req.query = question != NULL ? question + 1 : "";
+    if (question != NULL) *question = '\0';
+    int rv = p->handle(&req, &out);
+    if (question != NULL) *question = '?';
+    return rv;
+}
+
+#endif
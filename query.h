@@ -0,0 +1,74 @@
+/*
+File: query.h
+Description: query string parsing shared by the server and fib.cgi.
+    parse_query() splits "a=1&b=two%20words" in place into key/value
+    pairs (percent-decoding both, '+' is a space), in whatever order and
+    with whatever keys the client sent, query_get() looks one up.
+*/
+
+#ifndef QUERY_H
+#define QUERY_H
+
+#include <string.h>
+
+#define MAX_QUERY_PARAMS 16
+
+struct query_param {
+    char* key;
+    char* value; // "" for a bare key ("a&b=1")
+};
+
+int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// percent-decode s in place ("%41" -> "A", "+" -> " "), a malformed escape is kept as it is
+void url_decode(char* s) {
+    char* out = s;
+    for (char* in = s; *in != '\0'; in++) {
+        if (*in == '%' && hex_value(in[1]) != -1 && hex_value(in[2]) != -1) {
+            *out++ = (char) (hex_value(in[1]) * 16 + hex_value(in[2]));
+            in += 2;
+        } else if (*in == '+') {
+            *out++ = ' ';
+        } else {
+            *out++ = *in;
+        }
+    }
+    *out = '\0';
+}
+
+// split query (modified in place) into at most max params, returns how many were found
+int parse_query(char* query, struct query_param* params, int max) {
+    int count = 0;
+    char* rest;
+    for (char* pair = strtok_r(query, "&", &rest); pair != NULL && count < max; pair = strtok_r(NULL, "&", &rest)) {
+        char* eq = strchr(pair, '=');
+        if (eq != NULL) {
+            *eq = '\0';
+            params[count].value = eq + 1;
+        } else {
+            params[count].value = pair + strlen(pair); // ""
+        }
+        params[count].key = pair;
+        url_decode(params[count].key);
+        url_decode(params[count].value);
+        count++;
+    }
+    return count;
+}
+
+// value of the first param called key, NULL if there is none
+const char* query_get(struct query_param* params, int count, const char* key) {
+    for (int i = 0; i < count; i++) {
+        if (strcmp(params[i].key, key) == 0) {
+            return params[i].value;
+        }
+    }
+    return NULL;
+}
+
+#endif
@@ -0,0 +1,357 @@
+/*
+File: server_stats.h
+Description: request counters and latency histograms behind /server-status
+    and /metrics.
+    Every thread that answers requests (a worker, an event loop, a CGI job
+    thread) gets a shard of its own, padded out to whole cache lines, and
+    only ever writes to that shard. Counting a request is a few plain loads
+    and stores on lines no other thread writes: no lock, no atomic
+    read-modify-write and no cache line bouncing between cpus. The counters
+    are still std::atomic (relaxed) so a scrape reading them while they
+    change is well defined.
+    A scrape walks the list of shards and adds them up, that is the only
+    place the shards are ever read together. Gauges that already live
+    elsewhere (queue depth, running CGI children) are filled in by the
+    server at scrape time.
+    Latency is counted in fixed buckets (100 us to 5 s), the same buckets
+    Prometheus histograms use, so /metrics can report them as they are.
+*/
+
+#ifndef SERVER_STATS_H
+#define SERVER_STATS_H
+
+// stdlib
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+// concurrency control
+#include <atomic>
+
+// stl
+#include <string>
+
+// headers of the status pages, which must never be cached
+const char STATS_TEXT_FIELDS[] = "Content-Type: text/plain; charset=utf-8\r\nCache-Control: no-store\r\n";
+const char STATS_PROMETHEUS_FIELDS[] = "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\nCache-Control: no-store\r\n";
+
+// what kind of request a response answered
+enum stats_kind {
+    STATS_STATIC, // a file, from the file cache or disk
+    STATS_CGI, // fib.cgi, run, pooled or from the dynamic cache
+    STATS_PLUGIN, // a handler plugin
+    STATS_OTHER, // refused before routing (400, 431, 501, 502, 403 for ".."), and the status pages
+    STATS_KINDS
+};
+const char* stats_kind_names[STATS_KINDS] = {"static", "cgi", "plugin", "other"};
+
+// what a shard's thread does, busy and idle are reported per role
+enum stats_role {
+    STATS_WORKER, // thread pool worker (-m threads), busy while it holds a connection
+    STATS_EVENT_LOOP, // busy while handling events, idle inside epoll_wait()
+    STATS_CGI_JOB, // event loop mode's fib.cgi job threads
+    STATS_ROLES
+};
+const char* stats_role_names[STATS_ROLES] = {"worker", "event_loop", "cgi_job"};
+
+// status codes counted on their own, anything else is counted as "other"
+const int stats_codes[] = {200, 304, 400, 403, 404, 431, 500, 501, 502, 503, 504};
+#define STATS_CODES (int) (sizeof stats_codes / sizeof stats_codes[0])
+
+// latency bucket upper bounds in microseconds, the last bucket has none (+Inf)
+const long stats_bounds_us[] = {100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+    1000000, 2500000, 5000000};
+#define STATS_BUCKETS ((int) (sizeof stats_bounds_us / sizeof stats_bounds_us[0]) + 1)
+
+struct alignas(64) stats_shard {
+    // written only by the owning thread
+    std::atomic<unsigned long> requests[STATS_KINDS][STATS_CODES + 1]; // [kind][code slot], the last slot is "other"
+    std::atomic<unsigned long> bytes[STATS_KINDS]; // response bytes, headers included
+    std::atomic<unsigned long> latency[STATS_KINDS][STATS_BUCKETS];
+    std::atomic<unsigned long> latency_us[STATS_KINDS]; // sum, for the mean
+    std::atomic<int> busy;
+    int role;
+    struct stats_shard* next;
+};
+
+struct server_stats {
+    pthread_mutex_t lock; // only taken to add a shard and to scrape
+    struct stats_shard* shards;
+    time_t started;
+};
+struct server_stats server_stats = {PTHREAD_MUTEX_INITIALIZER, NULL, 0};
+
+thread_local struct stats_shard* stats_self = NULL;
+
+// code -> slot in requests[kind], filled in by stats_init()
+unsigned char stats_code_slot[1000];
+
+void stats_init() {
+    for (int code = 0; code < 1000; code++) {
+        stats_code_slot[code] = STATS_CODES;
+    }
+    for (int i = 0; i < STATS_CODES; i++) {
+        stats_code_slot[stats_codes[i]] = i;
+    }
+    server_stats.started = time(NULL);
+}
+
+// give the calling thread its shard, call once at the top of a thread that answers requests
+struct stats_shard* stats_register(int role) {
+    if (stats_self != NULL) {
+        return stats_self;
+    }
+    struct stats_shard* s = new struct stats_shard(); // zeroed, and aligned to its own cache lines
+    s->role = role;
+    pthread_mutex_lock(&server_stats.lock);
+    s->next = server_stats.shards;
+    server_stats.shards = s;
+    pthread_mutex_unlock(&server_stats.lock);
+    stats_self = s;
+    return s;
+}
+
+long stats_now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+// only the owning thread writes a counter, so a load and a store do what fetch_add() would without the locked instruction
+void stats_bump(std::atomic<unsigned long>* counter, unsigned long by) {
+    counter->store(counter->load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+}
+
+// count one response that went out, latency_us from when the request was complete to when the response was sent
+void stats_request(int kind, int code, size_t bytes, long latency_us) {
+    struct stats_shard* s = stats_self;
+    if (s == NULL) {
+        return; // not a registered thread
+    }
+    int bucket = 0;
+    while (bucket < STATS_BUCKETS - 1 && latency_us > stats_bounds_us[bucket]) {
+        bucket++;
+    }
+    stats_bump(&s->requests[kind][code >= 0 && code < 1000 ? stats_code_slot[code] : STATS_CODES], 1);
+    stats_bump(&s->bytes[kind], bytes);
+    stats_bump(&s->latency[kind][bucket], 1);
+    stats_bump(&s->latency_us[kind], latency_us > 0 ? latency_us : 0);
+}
+
+void stats_busy(int busy) {
+    if (stats_self != NULL) {
+        stats_self->busy.store(busy, std::memory_order_relaxed);
+    }
+}
+
+// filled in by the server at scrape time
+struct stats_gauges {
+    const char* mode;
+    long queued; // accepted connections waiting for a worker (-m threads)
+    long queue_slots;
+    long cgi_running; // fib.cgi children (-g 0) or pooled workers answering a request
+    long cgi_capacity; // pooled workers, 0 with -g 0
+    long cgi_waiting; // event loop mode: fib.cgi requests waiting for a job thread
+};
+
+// every shard added up
+struct stats_totals {
+    unsigned long requests[STATS_KINDS][STATS_CODES + 1];
+    unsigned long bytes[STATS_KINDS];
+    unsigned long latency[STATS_KINDS][STATS_BUCKETS];
+    unsigned long latency_us[STATS_KINDS];
+    int threads[STATS_ROLES];
+    int busy[STATS_ROLES];
+};
+
+void stats_collect(struct stats_totals* t) {
+    memset(t, 0, sizeof *t);
+    pthread_mutex_lock(&server_stats.lock);
+    for (struct stats_shard* s = server_stats.shards; s != NULL; s = s->next) {
+        for (int k = 0; k < STATS_KINDS; k++) {
+            for (int c = 0; c <= STATS_CODES; c++) {
+                t->requests[k][c] += s->requests[k][c].load(std::memory_order_relaxed);
+            }
+            for (int b = 0; b < STATS_BUCKETS; b++) {
+                t->latency[k][b] += s->latency[k][b].load(std::memory_order_relaxed);
+            }
+            t->bytes[k] += s->bytes[k].load(std::memory_order_relaxed);
+            t->latency_us[k] += s->latency_us[k].load(std::memory_order_relaxed);
+        }
+        t->threads[s->role]++;
+        t->busy[s->role] += s->busy.load(std::memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&server_stats.lock);
+}
+
+void stats_appendf(std::string* out, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+void stats_appendf(std::string* out, const char* fmt, ...) {
+    char line[256];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(line, sizeof line, fmt, args);
+    va_end(args);
+    if (len > 0) {
+        out->append(line, (size_t) len < sizeof line ? len : sizeof line - 1);
+    }
+}
+
+unsigned long stats_kind_requests(const struct stats_totals* t, int kind) {
+    unsigned long n = 0;
+    for (int c = 0; c <= STATS_CODES; c++) {
+        n += t->requests[kind][c];
+    }
+    return n;
+}
+
+// upper bound of the bucket holding the p-th fraction of a kind's requests, -1 for +Inf, 0 if there were none
+long stats_percentile_us(const struct stats_totals* t, int kind, double p) {
+    unsigned long total = stats_kind_requests(t, kind);
+    if (total == 0) {
+        return 0;
+    }
+    unsigned long seen = 0;
+    for (int b = 0; b < STATS_BUCKETS - 1; b++) {
+        seen += t->latency[kind][b];
+        if (seen >= p * total) {
+            return stats_bounds_us[b];
+        }
+    }
+    return -1;
+}
+
+// /server-status: plain text for people
+void stats_format_text(std::string* out, const struct stats_totals* t, const struct stats_gauges* g) {
+    stats_appendf(out, "wserver status\n\nmode: %s\nuptime: %ld s\n", g->mode, (long) (time(NULL) - server_stats.started));
+    for (int r = 0; r < STATS_ROLES; r++) {
+        if (t->threads[r] > 0) {
+            stats_appendf(out, "%s threads: %d busy, %d idle\n", stats_role_names[r], t->busy[r], t->threads[r] - t->busy[r]);
+        }
+    }
+    if (g->queue_slots > 0) {
+        stats_appendf(out, "queued connections: %ld of %ld slots\n", g->queued, g->queue_slots);
+    }
+    if (g->cgi_capacity > 0) {
+        stats_appendf(out, "cgi workers: %ld busy of %ld\n", g->cgi_running, g->cgi_capacity);
+    } else {
+        stats_appendf(out, "cgi children running: %ld\n", g->cgi_running);
+    }
+    if (strcmp(g->mode, "epoll") == 0) {
+        stats_appendf(out, "cgi jobs waiting: %ld\n", g->cgi_waiting);
+    }
+
+    stats_appendf(out, "\n%-8s %10s %14s %10s %10s %10s %10s\n", "type", "requests", "bytes", "mean us", "p50 us", "p99 us", "p99.9 us");
+    for (int k = 0; k < STATS_KINDS; k++) {
+        unsigned long n = stats_kind_requests(t, k);
+        char pct[3][24]; // "<=" and any long
+        double ps[3] = {0.5, 0.99, 0.999};
+        for (int i = 0; i < 3; i++) {
+            long us = stats_percentile_us(t, k, ps[i]);
+            if (n == 0) {
+                snprintf(pct[i], sizeof pct[i], "-");
+            } else if (us < 0) {
+                snprintf(pct[i], sizeof pct[i], ">%ld", stats_bounds_us[STATS_BUCKETS - 2]);
+            } else {
+                snprintf(pct[i], sizeof pct[i], "<=%ld", us);
+            }
+        }
+        stats_appendf(out, "%-8s %10lu %14lu %10lu %10s %10s %10s\n", stats_kind_names[k], n, t->bytes[k],
+            n > 0 ? t->latency_us[k] / n : 0, pct[0], pct[1], pct[2]);
+    }
+
+    stats_appendf(out, "\n%-8s", "status");
+    for (int k = 0; k < STATS_KINDS; k++) {
+        stats_appendf(out, " %10s", stats_kind_names[k]);
+    }
+    stats_appendf(out, "\n");
+    for (int c = 0; c <= STATS_CODES; c++) {
+        unsigned long row = 0;
+        for (int k = 0; k < STATS_KINDS; k++) {
+            row += t->requests[k][c];
+        }
+        if (row == 0) {
+            continue;
+        }
+        if (c < STATS_CODES) {
+            stats_appendf(out, "%-8d", stats_codes[c]);
+        } else {
+            stats_appendf(out, "%-8s", "other");
+        }
+        for (int k = 0; k < STATS_KINDS; k++) {
+            stats_appendf(out, " %10lu", t->requests[k][c]);
+        }
+        stats_appendf(out, "\n");
+    }
+}
+
+// /metrics: Prometheus text exposition format (version 0.0.4)
+void stats_format_prometheus(std::string* out, const struct stats_totals* t, const struct stats_gauges* g) {
+    out->append("# HELP wserver_requests_total Responses sent, by request type and status code.\n"
+        "# TYPE wserver_requests_total counter\n");
+    for (int k = 0; k < STATS_KINDS; k++) {
+        for (int c = 0; c <= STATS_CODES; c++) {
+            if (t->requests[k][c] == 0) {
+                continue;
+            }
+            char code[8];
+            if (c < STATS_CODES) {
+                snprintf(code, sizeof code, "%d", stats_codes[c]);
+            } else {
+                snprintf(code, sizeof code, "other");
+            }
+            stats_appendf(out, "wserver_requests_total{type=\"%s\",code=\"%s\"} %lu\n", stats_kind_names[k], code, t->requests[k][c]);
+        }
+    }
+
+    out->append("# HELP wserver_sent_bytes_total Response bytes sent, headers included.\n"
+        "# TYPE wserver_sent_bytes_total counter\n");
+    for (int k = 0; k < STATS_KINDS; k++) {
+        stats_appendf(out, "wserver_sent_bytes_total{type=\"%s\"} %lu\n", stats_kind_names[k], t->bytes[k]);
+    }
+
+    out->append("# HELP wserver_request_duration_seconds Time from a complete request to its response being sent.\n"
+        "# TYPE wserver_request_duration_seconds histogram\n");
+    for (int k = 0; k < STATS_KINDS; k++) {
+        unsigned long cumulative = 0;
+        for (int b = 0; b < STATS_BUCKETS; b++) {
+            cumulative += t->latency[k][b];
+            if (b < STATS_BUCKETS - 1) {
+                stats_appendf(out, "wserver_request_duration_seconds_bucket{type=\"%s\",le=\"%g\"} %lu\n",
+                    stats_kind_names[k], stats_bounds_us[b] / 1e6, cumulative);
+            } else {
+                stats_appendf(out, "wserver_request_duration_seconds_bucket{type=\"%s\",le=\"+Inf\"} %lu\n",
+                    stats_kind_names[k], cumulative);
+            }
+        }
+        stats_appendf(out, "wserver_request_duration_seconds_sum{type=\"%s\"} %.6f\n", stats_kind_names[k], t->latency_us[k] / 1e6);
+        stats_appendf(out, "wserver_request_duration_seconds_count{type=\"%s\"} %lu\n", stats_kind_names[k], cumulative);
+    }
+
+    out->append("# HELP wserver_threads Threads answering requests, by role and state.\n"
+        "# TYPE wserver_threads gauge\n");
+    for (int r = 0; r < STATS_ROLES; r++) {
+        if (t->threads[r] > 0) {
+            stats_appendf(out, "wserver_threads{role=\"%s\",state=\"busy\"} %d\n", stats_role_names[r], t->busy[r]);
+            stats_appendf(out, "wserver_threads{role=\"%s\",state=\"idle\"} %d\n", stats_role_names[r], t->threads[r] - t->busy[r]);
+        }
+    }
+
+    if (g->queue_slots > 0) {
+        stats_appendf(out, "# HELP wserver_queued_connections Accepted connections waiting for a worker.\n"
+            "# TYPE wserver_queued_connections gauge\nwserver_queued_connections %ld\n", g->queued);
+        stats_appendf(out, "# HELP wserver_queue_slots Capacity of the accepted connection queues (-b).\n"
+            "# TYPE wserver_queue_slots gauge\nwserver_queue_slots %ld\n", g->queue_slots);
+    }
+    stats_appendf(out, "# HELP wserver_cgi_in_flight fib.cgi requests being answered by a child or pooled worker.\n"
+        "# TYPE wserver_cgi_in_flight gauge\nwserver_cgi_in_flight %ld\n", g->cgi_running);
+    if (strcmp(g->mode, "epoll") == 0) {
+        stats_appendf(out, "# HELP wserver_cgi_jobs_waiting fib.cgi requests waiting for a job thread.\n"
+            "# TYPE wserver_cgi_jobs_waiting gauge\nwserver_cgi_jobs_waiting %ld\n", g->cgi_waiting);
+    }
+    stats_appendf(out, "# HELP wserver_start_time_seconds Unix time the server started.\n"
+        "# TYPE wserver_start_time_seconds gauge\nwserver_start_time_seconds %ld\n", (long) server_stats.started);
+}
+
+#endif
@@ -0,0 +1,120 @@
+/*
+File: single_flight.h
+Description: coalesces identical dynamic requests that are in progress at the same time.
+    When a burst of clients asks for the same fib.cgi?n=... every one of
+    them used to take its own CGI worker and compute the same answer.
+    The first request for a key becomes the flight's leader and runs the
+    program, requests for the same key that arrive while it runs join the
+    flight and sleep until the leader publishes the response, then all of
+    them send the same bytes.
+    A flight only lives while its request is running, once the leader
+    lands the next request for the key starts a new one (keeping answers
+    around is the dynamic cache's job, dynamic_cache.h).
+    Only the CGI worker pool's requests (-g N) fly: a program spawned with
+    -g 0 streams its output to its own client as it writes it, so there is
+    no whole answer to share until it is over.
+*/
+
+#ifndef SINGLE_FLIGHT_H
+#define SINGLE_FLIGHT_H
+
+// stdlib
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+// concurrency control
+#include <pthread.h>
+#include <atomic>
+
+// stl
+#include <string>
+#include <unordered_map>
+
+struct flight {
+    int done;
+    ssize_t length; // -1 if the leader failed, everyone answers 500
+    std::string response;
+    int refs; // the leader plus one per waiter, under the group's lock
+};
+
+struct flight_group {
+    pthread_mutex_t lock;
+    pthread_cond_t landed; // broadcast whenever a flight is done
+    std::unordered_map<std::string, struct flight*> in_flight;
+
+    // for the stats thread
+    std::atomic<unsigned long> leaders;
+    std::atomic<unsigned long> coalesced;
+};
+
+void flight_group_init(struct flight_group* group) {
+    pthread_mutex_init(&group->lock, NULL);
+    pthread_cond_init(&group->landed, NULL);
+    group->leaders = 0;
+    group->coalesced = 0;
+}
+
+/*
+Join the flight for key, starting it if there is none.
+*leader is set to 1 if the caller has to run the request and flight_land() the result, 0 if it should
+flight_wait() for someone else's. Either way the caller flight_release()s the flight when done with it.
+*/
+struct flight* flight_join(struct flight_group* group, const std::string& key, int* leader) {
+    pthread_mutex_lock(&group->lock);
+    auto it = group->in_flight.find(key);
+    struct flight* f;
+    if (it != group->in_flight.end()) {
+        f = it->second;
+        f->refs++;
+        *leader = 0;
+        group->coalesced.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        f = new struct flight;
+        f->done = 0;
+        f->length = -1;
+        f->refs = 1;
+        group->in_flight[key] = f;
+        *leader = 1;
+        group->leaders.fetch_add(1, std::memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&group->lock);
+    return f;
+}
+
+// the leader publishes its response (length -1 for a failure) and wakes the waiters
+void flight_land(struct flight_group* group, const std::string& key, struct flight* f, const char* response, ssize_t length) {
+    pthread_mutex_lock(&group->lock);
+    if (length >= 0 && f->refs > 1) { // only copied for waiters, once the flight is erased nobody else can join
+        f->response.assign(response, length);
+    }
+    f->length = length;
+    f->done = 1;
+    group->in_flight.erase(key); // later requests start a fresh flight
+    pthread_cond_broadcast(&group->landed);
+    pthread_mutex_unlock(&group->lock);
+}
+
+// blocks until the leader landed f
+void flight_wait(struct flight_group* group, struct flight* f) {
+    pthread_mutex_lock(&group->lock);
+    while (!f->done) {
+        pthread_cond_wait(&group->landed, &group->lock);
+    }
+    pthread_mutex_unlock(&group->lock);
+}
+
+void flight_release(struct flight_group* group, struct flight* f) {
+    pthread_mutex_lock(&group->lock);
+    int last = --f->refs == 0;
+    pthread_mutex_unlock(&group->lock);
+    if (last) {
+        delete f;
+    }
+}
+
+void flight_stats(struct flight_group* group, char* buf, size_t cap) {
+    snprintf(buf, cap, "single flight: runs %lu coalesced %lu\n", group->leaders.load(), group->coalesced.load());
+}
+
+#endif
@@ -0,0 +1,257 @@
+/*
+File: tests/test_parser.c
+Description: tests for http_parser.h, run with make test.
+    Every request is parsed whole, split in two at every byte boundary and
+    fed one byte at a time, with each line scanner this cpu has (libc
+    memchr(), SSE2, AVX2), and all of those must give the same answer.
+    Also covers the limits: exactly HTTP_MAX_HEADERS headers and one more,
+    a head of exactly HTTP_MAX_REQUEST bytes and one byte longer, bare CRs
+    and bare LFs, and the scanners themselves on buffers with the line
+    feed at every offset.
+    Prints each failed check and exits with status 1 if there was one.
+*/
+
+// std io functions
+#include <stdio.h>
+
+// std lib
+#include <stdlib.h>
+
+// string
+#include <string.h>
+
+// stl
+#include <string>
+#include <vector>
+
+#include "../http_parser.h"
+
+const char* scan_names[] = {"memchr", "sse2", "avx2"};
+
+int failures = 0;
+int checks = 0;
+int checking = HTTP_SCAN_MEMCHR; // scanner under test, for the failure message
+
+void expect(const char* what, const std::string& got, const std::string& want) {
+    checks++;
+    if (got != want) {
+        printf("FAIL %s (%s scanner):\n  got  %s\n  want %s\n", what, scan_names[checking], got.c_str(), want.c_str());
+        failures++;
+    }
+}
+
+// everything the parser found, as one string, so two parses can be compared
+std::string describe(int rv, const struct http_request* req) {
+    if (rv != HTTP_PARSE_DONE) {
+        return "rv " + std::to_string(rv);
+    }
+    std::string d = std::string(req->method.p, req->method.len) + "|" + std::string(req->path.p, req->path.len) + "|"
+        + std::string(req->query.p, req->query.len) + "|" + std::string(req->version.p, req->version.len) + "|"
+        + std::to_string(req->length) + "|" + std::to_string(http_keep_alive(req));
+    for (int i = 0; i < req->header_count; i++) {
+        d += "|" + std::string(req->headers[i].name.p, req->headers[i].name.len) + "="
+            + std::string(req->headers[i].value.p, req->headers[i].value.len);
+    }
+    return d;
+}
+
+/*
+Parse text the way the server reads it: the first cut bytes, then the rest, in a buffer that only grows.
+cut 0 (or text.size()) is the whole request in one read. An answer other than HTTP_PARSE_INCOMPLETE after
+the first read is final, like it is for the server.
+*/
+std::string parse_split(const std::string& text, size_t cut) {
+    std::vector<char> buffer(text.begin(), text.end()); // its own allocation, so a scanner reading past len would be caught by ASan
+    struct http_parser parser;
+    struct http_request req;
+    http_parser_init(&parser);
+    int rv = HTTP_PARSE_INCOMPLETE;
+    if (cut > 0 && cut < text.size()) {
+        rv = http_parse(&parser, buffer.data(), cut, &req);
+    }
+    if (rv == HTTP_PARSE_INCOMPLETE) {
+        rv = http_parse(&parser, buffer.data(), text.size(), &req);
+    }
+    return describe(rv, &req);
+}
+
+// the same request arriving one byte per read
+std::string parse_bytewise(const std::string& text) {
+    struct http_parser parser;
+    struct http_request req;
+    http_parser_init(&parser);
+    int rv = HTTP_PARSE_INCOMPLETE;
+    for (size_t len = 1; len <= text.size() && rv == HTTP_PARSE_INCOMPLETE; len++) {
+        rv = http_parse(&parser, text.data(), len, &req);
+    }
+    return describe(rv, &req);
+}
+
+// n headers after the request line, all of them padded so the head is length bytes long (0 for no padding)
+std::string request_with_headers(int n, size_t length) {
+    std::string text = "GET /many HTTP/1.1\r\n";
+    for (int i = 0; i < n; i++) {
+        text += "X-H" + std::to_string(i) + ": v\r\n";
+    }
+    if (length > 0) {
+        size_t pad = length - text.size() - strlen("X-Pad: \r\n\r\n");
+        text += "X-Pad: " + std::string(pad, 'p') + "\r\n";
+    }
+    return text + "\r\n";
+}
+
+struct parse_case {
+    const char* name;
+    std::string text;
+    std::string want; // what the memchr() scanner's whole parse says, "" to only check that every way agrees
+};
+
+std::vector<struct parse_case> parse_cases() {
+    std::string cookie;
+    while (cookie.size() < 4096) {
+        cookie += "session_" + std::to_string(cookie.size()) + "=0123456789abcdef; ";
+    }
+    std::string exactly_max = request_with_headers(3, HTTP_MAX_REQUEST);
+    std::string max_headers = request_with_headers(HTTP_MAX_HEADERS, 0);
+
+    std::vector<struct parse_case> cases = {
+        {"minimal", "GET /index.html HTTP/1.1\r\nHost: localhost\r\n\r\n", "GET|/index.html||HTTP/1.1|45|1|Host=localhost"},
+        {"no headers", "GET / HTTP/1.0\r\n\r\n", "GET|/||HTTP/1.0|18|1"},
+        {"query and spaces", "GET /fib.cgi?user=a&n=5 HTTP/1.1\r\nHost:x\r\nAccept:  text/html \t\r\n\r\n",
+            "GET|/fib.cgi|user=a&n=5|HTTP/1.1|66|1|Host=x|Accept=text/html"},
+        {"keep-alive token", "GET /a?b=c HTTP/1.1\r\nConnection:  Upgrade , CLOSE \r\n\r\n",
+            "GET|/a|b=c|HTTP/1.1|54|0|Connection=Upgrade , CLOSE"},
+        {"pipelined", "GET /first HTTP/1.1\r\nHost: x\r\n\r\nGET /second HTTP/1.1\r\n\r\n", "GET|/first||HTTP/1.1|32|1|Host=x"},
+        {"cookie", "GET / HTTP/1.1\r\nHost: x\r\nCookie: " + cookie + "\r\n\r\n", ""},
+        {"incomplete", "GET / HTTP/1.1\r\nHost: x\r\n", "rv 0"},
+        {"incomplete after CR", "GET / HTTP/1.1\r\nHost: x\r\n\r", "rv 0"},
+        {"bare LF", "GET / HTTP/1.1\nHost: x\n\n", "rv -1"},
+        {"blank line ended by a bare LF", "GET / HTTP/1.1\r\nHost: x\r\n\n", "rv -1"},
+        {"CR without LF in the request line", "GET / HTTP/1.1\rHost: x\r\n\r\n", "rv -1"},
+        {"CR without LF in a header", "GET / HTTP/1.1\r\nHost: x\rEvil: y\r\n\r\n", "rv -1"},
+        {"CR without LF in the target", "GET /a\rb HTTP/1.1\r\n\r\n", "rv -1"},
+        {"space before the colon", "GET / HTTP/1.1\r\nHost : x\r\n\r\n", "rv -1"},
+        {"obs-fold", "GET / HTTP/1.1\r\nHost: x\r\n folded\r\n\r\n", "rv -1"},
+        {"no version", "GET /HTTP/1.1\r\n\r\n", "rv -1"},
+        {"no header name", "GET / HTTP/1.1\r\n: x\r\n\r\n", "rv -1"},
+        {"empty", "\r\n\r\n", "rv -1"},
+        {"exactly HTTP_MAX_HEADERS headers", max_headers, ""},
+        {"one header too many", request_with_headers(HTTP_MAX_HEADERS + 1, 0), "rv -2"},
+        {"exactly HTTP_MAX_REQUEST bytes", exactly_max, ""},
+    };
+    return cases;
+}
+
+// the parse answers that don't fit in a want string
+void check_limits() {
+    struct http_parser parser;
+    struct http_request req;
+
+    std::string max_headers = request_with_headers(HTTP_MAX_HEADERS, 0);
+    http_parser_init(&parser);
+    int rv = http_parse(&parser, max_headers.data(), max_headers.size(), &req);
+    expect("HTTP_MAX_HEADERS headers parse", std::to_string(rv), std::to_string(HTTP_PARSE_DONE));
+    expect("HTTP_MAX_HEADERS headers kept", std::to_string(req.header_count), std::to_string(HTTP_MAX_HEADERS));
+    std::string last = "X-H" + std::to_string(HTTP_MAX_HEADERS - 1);
+    expect("last header", std::string(req.headers[HTTP_MAX_HEADERS - 1].name.p, req.headers[HTTP_MAX_HEADERS - 1].name.len), last);
+
+    // a head that fills the server's buffer exactly is a request, one byte more never completes in it (431)
+    std::string exactly_max = request_with_headers(3, HTTP_MAX_REQUEST);
+    expect("head size", std::to_string(exactly_max.size()), std::to_string(HTTP_MAX_REQUEST));
+    http_parser_init(&parser);
+    rv = http_parse(&parser, exactly_max.data(), exactly_max.size(), &req);
+    expect("HTTP_MAX_REQUEST bytes parse", std::to_string(rv), std::to_string(HTTP_PARSE_DONE));
+    expect("HTTP_MAX_REQUEST bytes length", std::to_string(req.length), std::to_string(HTTP_MAX_REQUEST));
+    std::string one_more = request_with_headers(3, HTTP_MAX_REQUEST + 1);
+    http_parser_init(&parser);
+    rv = http_parse(&parser, one_more.data(), HTTP_MAX_REQUEST, &req);
+    expect("HTTP_MAX_REQUEST + 1 bytes in a full buffer", std::to_string(rv), std::to_string(HTTP_PARSE_INCOMPLETE));
+
+    // the pipelined request starts where the first one's length says
+    std::string pipelined = "GET /first HTTP/1.1\r\n\r\nGET /second HTTP/1.1\r\nHost: y\r\n\r\n";
+    http_parser_init(&parser);
+    rv = http_parse(&parser, pipelined.data(), pipelined.size(), &req);
+    std::string rest = pipelined.substr(req.length);
+    expect("second pipelined request", parse_split(rest, 0), "GET|/second||HTTP/1.1|33|1|Host=y");
+}
+
+// every parse case, whole, split at every byte and byte by byte, must agree with want (or with the whole parse)
+void check_parses(const std::vector<struct parse_case>& cases, const std::vector<std::string>& want) {
+    for (size_t i = 0; i < cases.size(); i++) {
+        const std::string& text = cases[i].text;
+        std::string what = std::string(cases[i].name) + ": ";
+        expect((what + "whole").c_str(), parse_split(text, 0), want[i]);
+        for (size_t cut = 1; cut < text.size(); cut++) {
+            std::string got = parse_split(text, cut);
+            if (got != want[i]) { // one failure per case is enough to read
+                expect((what + "split at byte " + std::to_string(cut)).c_str(), got, want[i]);
+                break;
+            }
+            checks++;
+        }
+        expect((what + "byte by byte").c_str(), parse_bytewise(text), want[i]);
+    }
+}
+
+/*
+The scanners on their own: a line feed at every offset of buffers of every length up to a few vector widths,
+searched from every start, so the 64 byte, 16/32 byte and byte at a time paths and all their tails are covered.
+*/
+void check_scanners(int kind) {
+    const size_t max_len = 200;
+    std::vector<char> buf(max_len);
+    for (size_t len = 0; len <= max_len; len++) {
+        for (size_t lf = 0; lf <= len; lf++) { // lf == len: no line feed at all
+            for (size_t i = 0; i < len; i++) {
+                buf[i] = (char) ('a' + i % 26);
+            }
+            if (lf < len) {
+                buf[lf] = '\n';
+            }
+            for (size_t from = 0; from <= len; from += (from < 70 ? 1 : 13)) {
+                size_t want = from <= lf ? lf : len;
+                size_t got = http_find_lf(buf.data(), from, len);
+                checks++;
+                if (got != want) {
+                    printf("FAIL %s scanner: len %lu lf %lu from %lu gave %lu\n", scan_names[kind], (unsigned long) len,
+                        (unsigned long) lf, (unsigned long) from, (unsigned long) got);
+                    failures++;
+                    return;
+                }
+            }
+        }
+    }
+}
+
+int main() {
+    int top = http_parser_use(HTTP_SCAN_AVX2);
+    std::vector<struct parse_case> cases = parse_cases();
+
+    http_parser_use(HTTP_SCAN_MEMCHR);
+    checking = HTTP_SCAN_MEMCHR;
+    std::vector<std::string> want;
+    for (size_t i = 0; i < cases.size(); i++) {
+        std::string whole = parse_split(cases[i].text, 0);
+        if (!cases[i].want.empty()) {
+            expect(cases[i].name, whole, cases[i].want);
+        } else {
+            expect(cases[i].name, whole.substr(0, 3) == "rv " ? whole : "parsed", "parsed");
+        }
+        want.push_back(whole);
+    }
+    check_limits();
+
+    for (int kind = HTTP_SCAN_MEMCHR; kind <= top; kind++) {
+        checking = http_parser_use((enum http_scan_kind) kind);
+        check_scanners(checking);
+        check_parses(cases, want);
+        check_limits();
+    }
+
+    if (failures > 0) {
+        printf("%d of %d parser checks failed\n", failures, checks);
+        return 1;
+    }
+    printf("%d parser checks passed (scanners up to %s)\n", checks, scan_names[top]);
+    return 0;
+}
@@ -0,0 +1,209 @@
+/*
+File: tools/precompress.c
+Description: writes the precompressed siblings wserver serves to clients
+    that accept them. Every file under the document root whose type is
+    compressible (content_types.h decides, same as the server) gets a
+    foo.ext.gz made with gzip at level 9 (zlib, as wserver -o does) and a foo.ext.br made with brotli
+    at quality 11, the slowest and smallest settings: the work is done once
+    here, never while serving.
+    A sibling is only kept when it is smaller than the file. It is given
+    the file's mtime, which is how a later run tells it is up to date (and
+    skips it) and how wserver tells it was made from the current version.
+    Files below a minimum size are skipped, their headers would cost more
+    than compression saves.
+Usage: precompress [-m min bytes] [docroot]
+*/
+
+// std io functions
+#include <stdio.h>
+
+// std lib
+#include <stdlib.h>
+
+// string
+#include <string.h>
+#include <errno.h>
+
+// file I/O
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <ftw.h> // provides nftw()
+
+// stl
+#include <string>
+
+// compressor, gzip comes from compress.h
+#include <brotli/encode.h>
+
+#include "../content_types.h"
+#include "../compress.h"
+
+#define DEFAULT_MIN_SIZE 256 // bytes
+
+size_t min_size = DEFAULT_MIN_SIZE;
+
+// what a run did, printed at the end
+struct totals {
+    unsigned long files; // compressible files looked at
+    unsigned long written; // siblings (re)written
+    unsigned long current; // siblings already up to date
+    unsigned long bytes_in; // sizes of the files looked at
+    unsigned long bytes_gz; // of the .gz siblings kept, or the file where there is none
+    unsigned long bytes_br; // same for .br
+    unsigned long errors;
+};
+struct totals totals;
+
+// gzip at level 9 (compress.h), returns the compressed size or 0 on failure
+size_t gzip_file(const char* in, size_t len, std::string* out) {
+    out->resize(gzip_bound(len));
+    size_t size = gzip_buffer(in, len, Z_BEST_COMPRESSION, &(*out)[0], out->size());
+    out->resize(size);
+    return size;
+}
+
+// brotli at quality 11 with the largest window, returns the compressed size or 0 on failure
+size_t brotli_buffer(const char* in, size_t len, std::string* out) {
+    size_t size = BrotliEncoderMaxCompressedSize(len);
+    if (size == 0) {
+        return 0;
+    }
+    out->resize(size);
+    if (!BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_MAX_WINDOW_BITS, BROTLI_MODE_GENERIC,
+            len, (const uint8_t*) in, &size, (uint8_t*) &(*out)[0])) {
+        return 0;
+    }
+    out->resize(size);
+    return size;
+}
+
+// is the sibling there and made from this version of the file?
+int sibling_current(const std::string& sibling, const struct stat* filestat) {
+    struct stat s;
+    return stat(sibling.c_str(), &s) == 0 && s.st_mtim.tv_sec == filestat->st_mtim.tv_sec
+        && s.st_mtim.tv_nsec == filestat->st_mtim.tv_nsec;
+}
+
+/*
+Write data to sibling through a temporary file renamed into place, so the server never sees half of it,
+stamped with the file's mtime. Returns 0 on success.
+*/
+int write_sibling(const std::string& sibling, const std::string& data, const struct stat* filestat) {
+    std::string tmp = sibling + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, filestat->st_mode & 0666);
+    if (fd == -1) {
+        perror(tmp.c_str());
+        return -1;
+    }
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t rv = write(fd, data.data() + done, data.size() - done);
+        if (rv == -1 && errno == EINTR) continue;
+        if (rv <= 0) break;
+        done += rv;
+    }
+    struct timespec times[2] = {filestat->st_atim, filestat->st_mtim};
+    if (done != data.size() || futimens(fd, times) == -1 || close(fd) == -1 || rename(tmp.c_str(), sibling.c_str()) == -1) {
+        perror(sibling.c_str());
+        unlink(tmp.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+// make (or bring up to date) one sibling of path, adds its size (or the file's, if none is kept) to *bytes
+void precompress_one(const char* path, const char* data, size_t len, const struct stat* filestat, int encoding,
+        unsigned long* bytes) {
+    std::string sibling(path);
+    sibling += encoding_suffix(encoding);
+    struct stat s;
+    if (sibling_current(sibling, filestat) && stat(sibling.c_str(), &s) == 0) {
+        totals.current++;
+        *bytes += s.st_size;
+        return;
+    }
+    std::string out;
+    size_t size = encoding == ENCODING_BR ? brotli_buffer(data, len, &out) : gzip_file(data, len, &out);
+    if (size == 0) {
+        fprintf(stderr, "%s: %s compression failed\n", path, encoding_name(encoding));
+        totals.errors++;
+        *bytes += len;
+        return;
+    }
+    if (size >= len) { // no smaller, serving it would only cost the client a decompression
+        unlink(sibling.c_str()); // an old one was made from another version
+        *bytes += len;
+        return;
+    }
+    if (write_sibling(sibling, out, filestat) != 0) {
+        totals.errors++;
+        *bytes += len;
+        return;
+    }
+    totals.written++;
+    *bytes += size;
+}
+
+int visit(const char* path, const struct stat* filestat, int flag, struct FTW* ftw) {
+    (void) ftw;
+    if (flag != FTW_F || !S_ISREG(filestat->st_mode) || (size_t) filestat->st_size < min_size
+            || !content_type_for(path)->compressible) {
+        return 0; // .gz and .br files themselves aren't compressible types, so siblings are never compressed again
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        perror(path);
+        totals.errors++;
+        return 0;
+    }
+    std::string data(filestat->st_size, '\0');
+    size_t got = 0;
+    while (got < data.size()) {
+        ssize_t rv = read(fd, &data[0] + got, data.size() - got);
+        if (rv == -1 && errno == EINTR) continue;
+        if (rv <= 0) break;
+        got += rv;
+    }
+    close(fd);
+    if (got != data.size()) {
+        fprintf(stderr, "%s: short read\n", path);
+        totals.errors++;
+        return 0;
+    }
+
+    totals.files++;
+    totals.bytes_in += data.size();
+    precompress_one(path, data.data(), data.size(), filestat, ENCODING_GZIP, &totals.bytes_gz);
+    precompress_one(path, data.data(), data.size(), filestat, ENCODING_BR, &totals.bytes_br);
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    int c;
+    while ((c = getopt(argc, argv, "m:")) != -1) {
+        switch (c) {
+            case 'm':
+                min_size = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                fprintf(stderr, "usage: precompress [-m min bytes] [docroot]\n");
+                exit(1);
+        }
+    }
+    const char* docroot = optind < argc ? argv[optind] : ".";
+
+    content_types_init(MIME_TYPES_FILE);
+    if (nftw(docroot, visit, 32, FTW_PHYS) == -1) {
+        perror(docroot);
+        exit(1);
+    }
+
+    printf("%lu compressible files, %lu siblings written, %lu up to date, %lu errors\n",
+        totals.files, totals.written, totals.current, totals.errors);
+    if (totals.bytes_in > 0) {
+        printf("%lu bytes -> gzip %lu (%.1f%%), br %lu (%.1f%%)\n", totals.bytes_in,
+            totals.bytes_gz, 100.0 * totals.bytes_gz / totals.bytes_in, totals.bytes_br, 100.0 * totals.bytes_br / totals.bytes_in);
+    }
+    return totals.errors > 0;
+}
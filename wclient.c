@@ -5,6 +5,9 @@ Date: April 29th, 2024
 File: wclient.c
 Description: wclient sends an HTTP request to wserver,
     recieves the web server's response, and prints it.
+    Given any of -c -t -d -k -R -u -l it load tests the server
+    instead (load_test.h) and prints throughput, errors and a
+    latency percentile table.
 */
 
 // std io functions
@@ -27,7 +30,13 @@ Description: wclient sends an HTTP request to wserver,
 // good idea to include netinet if using arpa
 #include <netinet/in.h> 
 
-void parse_argv(int argc, char* argv[], char** server, char** port) {
+#include "load_test.h"
+
+/*
+Fills in server, port and the load test options, returns 1 if a load test option was given.
+*/
+int parse_argv(int argc, char* argv[], char** server, char** port, struct load_test_options* lt) {
+    int load_test = 0;
     for (int i = 1; i < argc; i+=2) {
         if ((i+1) >= argc) {
             fprintf(stderr, "specifier does not have corresponding value.\n");
@@ -43,11 +52,53 @@ void parse_argv(int argc, char* argv[], char** server, char** port) {
             }
             *(port) = argv[i+1];
         }
+        else if (strcmp("-c", argv[i]) == 0) {
+            lt->connections = atoi(argv[i+1]);
+            load_test = 1;
+        }
+        else if (strcmp("-t", argv[i]) == 0) {
+            lt->threads = atoi(argv[i+1]);
+            load_test = 1;
+        }
+        else if (strcmp("-d", argv[i]) == 0) {
+            lt->duration = atoi(argv[i+1]);
+            load_test = 1;
+        }
+        else if (strcmp("-k", argv[i]) == 0) {
+            lt->keep_alive = atoi(argv[i+1]) != 0;
+            load_test = 1;
+        }
+        else if (strcmp("-R", argv[i]) == 0) {
+            lt->rate = atof(argv[i+1]);
+            load_test = 1;
+        }
+        else if (strcmp("-u", argv[i]) == 0) {
+            lt->paths.push_back(argv[i+1]);
+            load_test = 1;
+        }
+        else if (strcmp("-l", argv[i]) == 0) {
+            if (load_test_read_paths(argv[i+1], &lt->paths) <= 0) {
+                fprintf(stderr, "no paths in %s.\n", argv[i+1]);
+                exit(1);
+            }
+            load_test = 1;
+        }
         else {
             fprintf(stderr, "setup improperly formatted.\n");
             exit(1);
         }
     }
+    if (lt->connections < 1 || lt->threads < 1 || lt->duration < 1 || lt->rate < 0) {
+        fprintf(stderr, "connections, threads and duration must be positive integers, rate not negative.\n");
+        exit(1);
+    }
+    if (lt->threads > lt->connections) {
+        lt->threads = lt->connections; // a thread without connections would have nothing to do
+    }
+    if (lt->paths.empty()) {
+        lt->paths.push_back("/index.html");
+    }
+    return load_test;
 }
 
 void get_addresses(struct addrinfo** servinfo, char* server, char* port) {
@@ -143,9 +194,19 @@ void read_and_print(int sockfd) {
 }
 
 int main(int argc, char* argv[]) {
-    char* server;
-    char* port;
-    parse_argv(argc, argv, &server, &port);
+    char* server = (char*) "localhost";
+    char* port = (char*) "10401"; // wserver's default
+    struct load_test_options lt;
+    lt.connections = 8;
+    lt.threads = 2;
+    lt.duration = 10;
+    lt.keep_alive = 1;
+    lt.rate = 0;
+    if (parse_argv(argc, argv, &server, &port, &lt)) {
+        lt.server = server;
+        lt.port = port;
+        return load_test_run(&lt);
+    }
     /* parse_argv test
     printf("argv parsed\nserver: %s\nport: %s\n", server, port);
     */
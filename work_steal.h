@@ -0,0 +1,193 @@
+/*
+File: work_steal.h
+Description: work-stealing scheduler for the worker pool.
+    Every worker owns a local queue (a conn_queue ring) of accepted
+    connections. The producer deals new connections out to the local
+    queues round robin, a worker serves its own queue first and, once that
+    is empty, steals from the other workers' queues before it goes to sleep.
+    A worker stuck on a slow request (a long fib.cgi) no longer holds up
+    the connections behind it, an idle worker takes them.
+    No lock is shared between the workers: pushes and steals are a
+    compare-and-swap on one worker's ring. What the whole pool shares are
+    the futexes idle workers (or a producer facing full queues) sleep on
+    and their sleeper counts: every push and pop reads a count, but the
+    futex words are only written when somebody is asleep (queue_signal()).
+    A pool with a single queue is the old shared FIFO, every worker takes
+    from the same ring (-q shared).
+*/
+
+#ifndef WORK_STEAL_H
+#define WORK_STEAL_H
+
+#include <atomic>
+
+#include "conn_queue.h"
+
+struct work_pool {
+    struct conn_queue* queues; // one per worker, or a single shared one
+    int nqueues;
+    unsigned next; // where the producer deals the next connection, only the producer touches it
+    int spins;
+
+    // futex words: bumped by a push / pop that finds someone asleep, sleepers wait for them to change
+    alignas(64) std::atomic<int> pushes;
+    std::atomic<int> pop_sleepers;
+    alignas(64) std::atomic<int> pops;
+    std::atomic<int> push_sleepers;
+};
+
+/*
+slots (-b) are split between the queues and each queue rounds its share up to a power of 2 (at least 2), so the
+pool holds up to nqueues * next_pow2(ceil(slots / nqueues)) connections, not slots: 8 queues and -b 1 give 16.
+Holding it to slots exactly would take a shared counter that every push and pop writes, the pool's other shared
+words are only read on those paths (written only when somebody sleeps).
+*/
+void work_pool_init(struct work_pool* pool, int nqueues, size_t slots) {
+    pool->nqueues = nqueues;
+    pool->queues = new struct conn_queue[nqueues];
+    size_t per_queue = (slots + nqueues - 1) / nqueues;
+    for (int i = 0; i < nqueues; i++) {
+        conn_queue_init(&pool->queues[i], per_queue);
+    }
+    pool->next = 0;
+    pool->spins = pool->queues[0].spins;
+    pool->pushes.store(0);
+    pool->pop_sleepers.store(0);
+    pool->pops.store(0);
+    pool->push_sleepers.store(0);
+}
+
+void work_pool_destroy(struct work_pool* pool) {
+    for (int i = 0; i < pool->nqueues; i++) {
+        conn_queue_destroy(&pool->queues[i]);
+    }
+    delete[] pool->queues;
+}
+
+// the worker's own queue first, then the others starting with its neighbour, so thieves spread out
+int work_pool_try_pop(struct work_pool* pool, int worker, int* fd) {
+    int own = worker % pool->nqueues;
+    for (int i = 0; i < pool->nqueues; i++) {
+        if (conn_queue_try_pop(&pool->queues[(own + i) % pool->nqueues], fd)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// round robin, skipping queues that are full
+int work_pool_try_push(struct work_pool* pool, int fd) {
+    for (int i = 0; i < pool->nqueues; i++) {
+        struct conn_queue* q = &pool->queues[pool->next++ % pool->nqueues];
+        if (conn_queue_try_push(q, fd)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+Push from a thread other than the producer without blocking (a connection coming back from a CGI relay),
+starting at the queue fd picks so the producer's round robin isn't touched. Returns 0 if every queue is full.
+*/
+int work_pool_offer(struct work_pool* pool, int fd) {
+    for (int i = 0; i < pool->nqueues; i++) {
+        if (conn_queue_try_push(&pool->queues[(fd + i) % pool->nqueues], fd)) {
+            queue_signal(&pool->pushes, &pool->pop_sleepers);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int work_pool_has_space(struct work_pool* pool) {
+    for (int i = 0; i < pool->nqueues; i++) {
+        struct conn_queue* q = &pool->queues[i];
+        if (q->enqueue_pos.load(std::memory_order_seq_cst) - q->dequeue_pos.load(std::memory_order_seq_cst) < q->capacity) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// connections waiting in the pool's queues right now (a snapshot, for the status page), *slots gets the capacity
+size_t work_pool_queued(struct work_pool* pool, size_t* slots) {
+    size_t queued = 0;
+    *slots = 0;
+    for (int i = 0; i < pool->nqueues; i++) {
+        struct conn_queue* q = &pool->queues[i];
+        size_t dequeued = q->dequeue_pos.load(std::memory_order_seq_cst); // read first, so pushes and pops in between can't make it pass enqueue_pos
+        size_t enqueued = q->enqueue_pos.load(std::memory_order_seq_cst);
+        queued += enqueued - dequeued;
+        *slots += q->capacity;
+    }
+    return queued;
+}
+
+// blocks (spin, then futex) until one of the queues takes fd, then wakes a sleeping worker to serve or steal it
+void work_pool_push(struct work_pool* pool, int fd) {
+    while (1) {
+        for (int i = 0; i < pool->spins; i++) {
+            if (work_pool_try_push(pool, fd)) {
+                queue_signal(&pool->pushes, &pool->pop_sleepers);
+                return;
+            }
+            cpu_relax();
+        }
+        // announce we're going to sleep, then look once more so a pop between the two isn't missed
+        int seen = pool->pops.load(std::memory_order_seq_cst);
+        queue_sleep_announce(&pool->push_sleepers);
+        if (work_pool_try_push(pool, fd)) {
+            pool->push_sleepers.fetch_sub(1, std::memory_order_seq_cst);
+            queue_signal(&pool->pushes, &pool->pop_sleepers);
+            return;
+        }
+        futex_wait(&pool->pops, seen);
+        pool->push_sleepers.fetch_sub(1, std::memory_order_seq_cst);
+    }
+}
+
+// blocks (spin, then futex) until the worker finds a connection in its own queue or someone else's
+int work_pool_pop(struct work_pool* pool, int worker) {
+    int fd;
+    while (1) {
+        for (int i = 0; i < pool->spins; i++) {
+            if (work_pool_try_pop(pool, worker, &fd)) {
+                queue_signal(&pool->pops, &pool->push_sleepers);
+                return fd;
+            }
+            cpu_relax();
+        }
+        int seen = pool->pushes.load(std::memory_order_seq_cst);
+        queue_sleep_announce(&pool->pop_sleepers);
+        if (work_pool_try_pop(pool, worker, &fd)) {
+            pool->pop_sleepers.fetch_sub(1, std::memory_order_seq_cst);
+            queue_signal(&pool->pops, &pool->push_sleepers);
+            return fd;
+        }
+        futex_wait(&pool->pushes, seen);
+        pool->pop_sleepers.fetch_sub(1, std::memory_order_seq_cst);
+    }
+}
+
+// blocks until some queue has a free slot, so the producer only accept()s what the pool can hold
+void work_pool_wait_space(struct work_pool* pool) {
+    while (1) {
+        for (int i = 0; i < pool->spins; i++) {
+            if (work_pool_has_space(pool)) {
+                return;
+            }
+            cpu_relax();
+        }
+        int seen = pool->pops.load(std::memory_order_seq_cst);
+        queue_sleep_announce(&pool->push_sleepers);
+        if (work_pool_has_space(pool)) {
+            pool->push_sleepers.fetch_sub(1, std::memory_order_seq_cst);
+            return;
+        }
+        futex_wait(&pool->pops, seen);
+        pool->push_sleepers.fetch_sub(1, std::memory_order_seq_cst);
+    }
+}
+
+#endif
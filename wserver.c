@@ -17,15 +17,11 @@ Description: wserver is a concurrent web server with
 // stdio functions
 #include <stdio.h>
 
-// stl queue
-#include <queue>
-
 // signal handling
 #include <signal.h>
 
 // concurrency control
 #include <sys/wait.h> // provides waitpid()
-#include <semaphore.h> // provides sem_...()
 #include <pthread.h>
 
 // unix socket
@@ -41,30 +37,131 @@ Description: wserver is a concurrent web server with
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/resource.h> // provides getrlimit()
+#include <sys/uio.h> // provides struct iovec
+#include <sys/sendfile.h> // provides sendfile()
+
+// event loop mode
+#include <sys/epoll.h>
+
+// stl
+#include <string>
+#include <deque>
+#include <unordered_map>
 
 // my headers
 #include "http_messaging.h"
+#include "http_parser.h"
+#include "arena.h"
+#include "content_types.h"
+#include "compress.h"
+#include "conditional.h"
+#include "file_cache.h"
+#include "conn_queue.h"
+#include "work_steal.h"
+#include "cgi_pool.h"
+#include "plugins.h"
+#include "dynamic_cache.h"
+#include "single_flight.h"
+#include "child_watch.h"
+#include "cgi_stream.h"
+#include "server_stats.h"
+#include "access_log.h"
 
 // default values
 const char* DEF_PORT = "10401";
 const char* DEF_THREADS = "1";
 const char* DEF_BUFFS = "1";
+const char* DEF_MODE = "threads";
+const int DEF_CACHE_MB = 32;
 
 // concurrency control
-sem_t full, empty;
-pthread_mutex_t queue_mutex, socket_mutex;
 
 // shared arguments between threads should be global to avoid memory corruption
-std::queue<int> q;
-int sockfd;
 
-void sigchld_handler(int s) { // waits until child is cleaned up
-    // waitpid() might overwrite errno, so we save and restore it:
-    // errno is a weird global variable, it needs to not be changed by waitpid()
-    int saved_errno = errno;
-    while(waitpid(-1, NULL, WNOHANG) > 0); // (-1, _, _) means wait for any child process, WNOHANG means to return immediately if no child exited
-    errno = saved_errno; 
-}
+/*
+A shard is one listening socket with its own threads: a producer, a buffer and -t workers (or -t event loops).
+With -s 1 (the default) there is a single shard, which is the classic producer/consumer server.
+With more shards every listener is bound to the same port with SO_REUSEPORT and the kernel spreads new
+connections across them, so accept() is no longer one thread's job and a connection stays on the shard
+(and, with -a 1, the cpu) that accepted it.
+*/
+struct shard {
+    int id;
+    int listen_fd;
+    int cpu; // cpu the shard's threads are pinned to, -1 when not pinned
+    struct work_pool pool; // accepted connections waiting for one of this shard's workers, -b slots
+};
+struct shard* shards;
+int num_shards = 1; // -s
+int pin_cpus = 0; // -a: pin shard i's threads to cpu i (mod the number of cpus)
+int work_stealing = 1; // -q steal: a queue per worker, -q shared: one FIFO for the whole shard
+
+// what a worker thread is started with
+struct worker {
+    struct shard* shard;
+    int id; // index within its shard, picks the worker's own queue
+};
+
+// keep-alive limits, set from the command line
+int keepalive_secs = 5; // -k: how long an idle connection is kept open, 0 turns keep-alive off
+int max_requests = 100; // -r: requests answered on one connection before it is closed
+
+// static files served from memory, capped at -c MB (0 turns the cache off)
+struct file_cache file_cache;
+int cache_mb = DEF_CACHE_MB;
+
+// -o: responses are gzipped on the fly at this level (1-9), 0 (the default) turns it off
+// files gzipped on the fly are kept in at most -i MB
+int gzip_level = 0;
+struct file_cache gzip_cache;
+int gzip_mb = 16;
+
+// fib.cgi requests go to -g pre-forked "fib.cgi --loop" workers, -g 0 spawns fib.cgi per request
+struct cgi_pool cgi_pool;
+int cgi_workers = -1; // -1 until parse_argv()/main() decide, defaults to one worker per cpu
+
+// in-process handler plugins are loaded from -d <dir>, none when it isn't given
+const char* handlers_dir = NULL;
+
+// fib.cgi 200 responses are kept for -e seconds (0, the default, turns the cache off) in at most -f MB
+struct dynamic_cache dynamic_cache;
+int dynamic_ttl = 0;
+int dynamic_mb = 8;
+
+// identical fib.cgi requests running at the same time share one CGI worker's answer
+struct flight_group cgi_flights;
+
+// with -g 0 spawned fib.cgi children are reaped by a poller thread, and killed after -w seconds (0 never)
+struct child_watch cgi_children;
+int cgi_timeout = 30;
+
+// /server-status and /metrics are answered unless -x 0 turns them off
+int status_pages = 1;
+const char* server_mode = "threads"; // -m, for the status page
+
+// every response is logged to -l <file> (none by default), which is rotated at -z MB
+const char* access_log_file = NULL;
+int access_log_mb = 64;
+
+/*
+What produce() knows about a connection it accepted, for the worker that takes it. Indexed by file
+descriptor: the entry is written before the descriptor goes into the queue and read after it comes out,
+the queue's own ordering makes it visible.
+*/
+struct parked_conn;
+struct accepted_conn {
+    long accepted_us;
+    struct client_addr client;
+    struct parked_conn* parked; // set when the connection comes back from a CGI relay instead of from accept()
+};
+#define ACCEPTED_CONNS_CAP (1 << 20)
+struct accepted_conn* accepted_conns;
+int accepted_conns_max = 0; // descriptors at or past this (beyond RLIMIT_NOFILE) have no entry
+
+// the parked connections among those without an entry, rare enough for a locked map
+std::unordered_map<int, struct parked_conn*> overflow_parked;
+pthread_mutex_t overflow_parked_lock = PTHREAD_MUTEX_INITIALIZER;
 
 void get_addresses(struct addrinfo** servinfo, char* port) {
     struct addrinfo hints;
@@ -87,7 +184,7 @@ void get_addresses(struct addrinfo** servinfo, char* port) {
     return;
 }
 
-int make_bound_socket(struct addrinfo* servinfo) { 
+int make_bound_socket(struct addrinfo* servinfo, int reuseport) { 
     int sockfd; 
     struct addrinfo* p;
     int yes = 1;
@@ -99,8 +196,8 @@ int make_bound_socket(struct addrinfo* servinfo) {
 
     // loop through results and bind to first we can
     for(p = servinfo; p != NULL; p = p->ai_next) { 
-        if ((sockfd = socket(p->ai_family, p->ai_socktype,
-                p->ai_protocol)) == -1) { // try to create socket with struct from servinfo list
+        if ((sockfd = socket(p->ai_family, p->ai_socktype | SOCK_CLOEXEC,
+                p->ai_protocol)) == -1) { // try to create socket with struct from servinfo list, CGI programs mustn't inherit it
             perror("server: socket");
             continue;
         }
@@ -110,6 +207,11 @@ int make_bound_socket(struct addrinfo* servinfo) {
             perror("setsockopt");
             exit(1); 
         }
+        if (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &yes,
+                sizeof(yes)) == -1) { // let every shard bind its own listener to the same port
+            perror("setsockopt SO_REUSEPORT");
+            exit(1);
+        }
 
         if (bind(sockfd, p->ai_addr, p->ai_addrlen) == -1) { 
             close(sockfd);
@@ -128,325 +230,1136 @@ int make_bound_socket(struct addrinfo* servinfo) {
     return sockfd;
 }
 
-void prepare_for_connection(int sockfd, struct sigaction* sa, int backlog) { // backlog is length of buffer, the number of request connections that can be accepted at one time
+/*
+Children are not reaped by a SIGCHLD handler: one calling waitpid(-1) would also reap children whose owner is
+about to wait for them, and their exit status would be lost. Forked CGI children are reaped by the child
+watch's poller (child_watch.h), pooled CGI workers by cgi_worker_stop().
+*/
+void prepare_for_connection(int sockfd, int backlog) { // backlog is length of buffer, the number of request connections that can be accepted at one time
     if (listen(sockfd, backlog) == -1) { // listen is a system call, backlog is a kernal level queue
         perror("listen"); 
         exit(1);
     }
 
-    /*
-    We can define how a child process is handled after it exits, 
-    this prevents the main process from being forced to exit, 
-    so we can keep listening and accept new requests :)
-    */
-    sa->sa_handler = sigchld_handler; // reap all dead processes
-    sigemptyset(&sa->sa_mask); // says to not block any signals, sa_mask is set of signals to be blocked
-    sa->sa_flags = SA_RESTART; // makes sure that program won't fail once child process terminates, accept/recieve/fork loop will continue
-    if (sigaction(SIGCHLD, sa, NULL) == -1) { // now we've built the struct sa to send into sigaction(), which actually sets our parameters
-        perror("sigaction");
-        exit(1);
-    }
-
     /* server listen test
     printf("server: waiting for connections...\n");
     */
 }
 
-void static_request(int new_fd, char* path) {
+/*
+A response waiting to be sent: the status line, headers and any in memory body (an error page, a file
+cache entry, or a memory mapped file) in out, optionally followed by a file that sendfile() copies
+to the socket inside the kernel.
+Both the thread pool and the event loop send it with send_some(), which remembers where it stopped
+when the socket was full.
+Pieces built for just this response (an error page) come from the connection's arena, which is reset
+once the response has been sent.
+*/
+struct response {
+    struct response_builder out;
+    struct arena* scratch; // the connection's arena, set by whoever owns the response
+    int file_fd; // file body sent with sendfile(), -1 when there is none
+    size_t file_len;
+    size_t file_sent;
+    void* mapped; // set when the body is a memory mapped file, unmapped by free_response()
+    size_t mapped_len;
+    struct cache_entry* cached; // set when the body belongs to a file cache entry, released by free_response()
+    struct plugin_output dynamic; // status, headers and body written by a handler plugin
+    struct dynamic_entry* dynamic_cached; // set when the response is a dynamic cache hit, released by free_response()
+    int kind; // what kind of request it answers (server_stats.h), set by route_request()
+    int accepted; // ENCODING_ bits the request's Accept-Encoding allows (content_types.h), set by route_request()
+};
+
+// what route_request() decided to do with a request
+enum route {
+    ROUTE_RESPONSE, // response is ready to be sent
+    ROUTE_CGI // answer with fib.cgi's output
+};
+
+void clear_response(struct response* res) {
+    res->file_fd = -1;
+    res->file_len = 0;
+    res->file_sent = 0;
+    res->mapped = NULL;
+    res->mapped_len = 0;
+    res->cached = NULL;
+    res->dynamic_cached = NULL;
+}
+
+void error_response(struct response* res, char* cause, char* errnum, char* shortmsg, char* longmsg, int keep_alive) {
+    clear_response(res);
+    char* body = (char*) arena_alloc(res->scratch, MAXBUF);
+    build_error_response(&res->out, body, cause, errnum, shortmsg, longmsg, keep_alive);
+}
+
+/*
+Swap fd (the file at path, described by filestat) for its precompressed sibling in the encoding the
+client prefers among those it accepts, if there is one at least as new as the file. Returns the encoding
+now in fd, ENCODING_IDENTITY if it is still the file itself.
+*/
+int open_variant(int* fd, struct stat* filestat, const char* path, int accepted) {
+    std::string& sibling = sibling_path; // the thread's, file_cache.h
+    for (int encoding : preferred_encodings) {
+        if ((accepted & encoding) == 0) {
+            continue;
+        }
+        sibling = path;
+        sibling += encoding_suffix(encoding);
+        int vfd = open(sibling.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat s;
+        if (vfd == -1) {
+            continue;
+        }
+        if (fstat(vfd, &s) == 0 && S_ISREG(s.st_mode) && (s.st_mtim.tv_sec > filestat->st_mtim.tv_sec
+                || (s.st_mtim.tv_sec == filestat->st_mtim.tv_sec && s.st_mtim.tv_nsec >= filestat->st_mtim.tv_nsec))) {
+            close(*fd);
+            *fd = vfd;
+            *filestat = s;
+            return encoding;
+        }
+        close(vfd);
+    }
+    return ENCODING_IDENTITY;
+}
+
+// -o: is the file at path, size bytes long, worth gzipping for a client that takes accepted?
+int gzip_wanted(const char* path, size_t size, int accepted) {
+    return gzip_level > 0 && (accepted & ENCODING_GZIP) != 0 && size >= COMPRESS_MIN_SIZE && content_type_for(path)->compressible;
+}
+
+// the gzip cache's copy of the version of path that is size bytes, modified at mtime, inode ino; NULL if it has none
+struct cache_entry* gzip_lookup(const char* path, size_t size, const struct timespec* mtime, ino_t ino) {
+    struct cache_entry* gz = file_cache_lookup(&gzip_cache, path, ENCODING_GZIP);
+    if (gz != NULL && (gz->file_size != size || gz->ino != ino || gz->mtime.tv_sec != mtime->tv_sec
+            || gz->mtime.tv_nsec != mtime->tv_nsec)) { // made from an older version, not yet noticed by revalidation
+        cache_release(gz);
+        return NULL;
+    }
+    return gz;
+}
+
+/*
+gzip data, the whole file at path (len bytes, modified at mtime, inode ino), and keep the result in the gzip
+cache, where it is revalidated against the file. Returns the entry with a reference held for the caller, or
+NULL if gzip didn't make it smaller or the result is too big to keep.
+*/
+struct cache_entry* gzip_cache_add(const char* path, const char* data, size_t len, const struct timespec* mtime, ino_t ino) {
+    size_t cap = gzip_bound(len);
+    char* out = (char*) malloc(cap);
+    size_t size = out != NULL ? gzip_buffer(data, len, gzip_level, out, cap) : 0;
+    if (size == 0 || size >= len || size > gzip_cache.shard_cap) {
+        if (size >= len) {
+            compress_counters.incompressible.fetch_add(1, std::memory_order_relaxed);
+        }
+        free(out);
+        return NULL;
+    }
+    char* shrunk = (char*) realloc(out, size); // out had room for the worst case
+    if (shrunk != NULL) {
+        out = shrunk;
+    }
+
+    struct cache_entry* entry = new struct cache_entry;
+    cache_key(&entry->path, path, ENCODING_GZIP);
+    entry->file = path;
+    entry->encoding = ENCODING_GZIP;
+    entry->data = out;
+    entry->size = size;
+    entry->variants = 0;
+    entry->incompressible = 0;
+    entry->file_size = len;
+    entry->mtime = *mtime;
+    entry->ino = ino;
+    cache_entry_headers(entry, path);
+    file_cache_insert(&gzip_cache, entry);
+    return entry;
+}
+
+void cached_request(struct response* res, struct cache_entry* entry, const struct http_request* req, int keep_alive);
+
+/*
+304 for a file the client already has: the validators, Vary and Cache-Control the 200 would have carried,
+no body. The caller has cleared res.
+*/
+void not_modified_response(struct response* res, const char* validators, size_t validators_len, int vary,
+        const std::string* cache_control, int keep_alive) {
+    rb_start(&res->out, 304, "Not Modified");
+    rb_add(&res->out, validators, validators_len);
+    if (vary) {
+        rb_add(&res->out, VARY_ACCEPT_ENCODING, strlen(VARY_ACCEPT_ENCODING));
+    }
+    if (cache_control != NULL) {
+        rb_add(&res->out, cache_control->data(), cache_control->size());
+    }
+    rb_end_headers(&res->out, keep_alive);
+}
+
+void static_request(struct response* res, char* path, const struct http_request* req, int keep_alive) {
+    int accepted = res->accepted;
     /*
-    Open and memory map requested file.
-    Mem-mapping allows server to read contents of file directly from disk into memory without having to perform explicit read operations.
-    OS will map a region of virtual memory to the file on the disk, leveraging OS's mem-management and caching mecahnisms.
-    It's also simpler to use, don't have to treat files on disk differently than standard memory access.
+    Open the requested file and keep it open, send_some() hands it to sendfile(), which copies the
+    file's pages from the page cache straight into the socket. The file never passes through user space,
+    so nothing is faulted into this process and large files cost no extra memory.
     */
-    int fd = open(path, O_RDONLY);
+    int fd = open(path, O_RDONLY | O_CLOEXEC); // a CGI program spawned meanwhile mustn't inherit it
     struct stat filestat;
-    fstat(fd, &filestat);
-    void *mapped = mmap(NULL, filestat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-    close(fd);
-
-    pthread_mutex_lock(&socket_mutex);
-    // send HTTP response with file contents
-    char header[8192];
-    sprintf(header, "HTTP/1.1 200 OK\r\nConnection: close\r\nContent-Length: %ld\r\n", filestat.st_size);
-    write_or_die(new_fd, header, strlen(header));
-    sprintf(header, "Content-Type: text/html\r\nServer: cpsc4510 web server 1.0\r\n\r\n");
-    write_or_die(new_fd, header, strlen(header));
-
-    int rv;
-    if ((rv = write(new_fd, mapped, filestat.st_size)) == -1) {
-        perror("server: write mapped file");
-        exit(1);
+    if (fd == -1 || fstat(fd, &filestat) == -1) {
+        if (fd != -1) close(fd);
+        char error[] = "The requested file does not exist";
+        char errnum[] = "404";
+        char reason[] = "Not Found";
+        char msg[] = "Server could not find this file.";
+        error_response(res, error, errnum, reason, msg, keep_alive);
+        return;
+    }
+    const struct content_type* type = content_type_for(path);
+    int encoding = ENCODING_IDENTITY;
+    if (type->compressible && accepted != 0) {
+        encoding = open_variant(&fd, &filestat, path, accepted);
+    }
+    /*
+    -o: gzip it (once per version, the copy is kept in the gzip cache). Files bigger than a gzip cache
+    shard go out as they are, their copy couldn't be kept and compressing them per request would cost
+    more than it saves.
+    */
+    if (encoding == ENCODING_IDENTITY && gzip_wanted(path, filestat.st_size, accepted)
+            && (size_t) filestat.st_size <= gzip_cache.shard_cap) {
+        struct cache_entry* gz = gzip_lookup(path, filestat.st_size, &filestat.st_mtim, filestat.st_ino);
+        if (gz == NULL) {
+            void* mapped = mmap(NULL, filestat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped != MAP_FAILED) {
+                gz = gzip_cache_add(path, (const char*) mapped, filestat.st_size, &filestat.st_mtim, filestat.st_ino);
+                munmap(mapped, filestat.st_size);
+            }
+        }
+        if (gz != NULL) {
+            close(fd);
+            compress_counters.responses.fetch_add(1, std::memory_order_relaxed);
+            cached_request(res, gz, req, keep_alive);
+            return;
+        }
     }
 
-    pthread_mutex_unlock(&socket_mutex);
+    // validators of what is about to be sent, in the arena since they are built per request
+    char etag[ETAG_MAX];
+    size_t etag_len = build_etag(etag, sizeof etag, filestat.st_ino, filestat.st_size, &filestat.st_mtim, encoding);
+    char* validators = (char*) arena_alloc(res->scratch, VALIDATORS_MAX);
+    size_t validators_len = build_validators(validators, VALIDATORS_MAX, etag, etag_len, filestat.st_mtim.tv_sec);
+    const std::string* cache_control = cache_control_for(path);
+    clear_response(res);
+    if (not_modified(req, etag, etag_len, filestat.st_mtim.tv_sec)) {
+        close(fd);
+        not_modified_response(res, validators, validators_len, type->compressible, cache_control, keep_alive);
+        return;
+    }
+    res->file_len = filestat.st_size;
+    res->file_fd = fd;
+    if (res->file_len == 0) { // nothing to send
+        close(fd);
+        res->file_fd = -1;
+    }
 
-    // cleanup
-    munmap(mapped, filestat.st_size);
+    // HTTP response header for the file contents
+    rb_start(&res->out, 200, "OK");
+    rb_content_length(&res->out, filestat.st_size);
+    rb_add(&res->out, type->field.data(), type->field.size());
+    if (type->compressible) {
+        const char* content_encoding = encoding_field(encoding);
+        rb_add(&res->out, content_encoding, strlen(content_encoding));
+        rb_add(&res->out, VARY_ACCEPT_ENCODING, strlen(VARY_ACCEPT_ENCODING));
+    }
+    rb_add(&res->out, validators, validators_len);
+    if (cache_control != NULL) {
+        rb_add(&res->out, cache_control->data(), cache_control->size());
+    }
+    rb_end_headers(&res->out, keep_alive);
+}
 
-    close(new_fd);
+/*
+Fallback for when sendfile() can't read from the file (some file systems don't support it):
+memory map the file and send it as an in memory body instead.
+Mem-mapping allows server to read contents of file directly from disk into memory without having to perform explicit read operations.
+*/
+int map_file_body(struct response* res) {
+    void* mapped = mmap(NULL, res->file_len, PROT_READ, MAP_PRIVATE, res->file_fd, 0);
+    if (mapped == MAP_FAILED) {
+        return -1;
+    }
+    res->mapped = mapped;
+    res->mapped_len = res->file_len;
+    rb_add(&res->out, mapped, res->file_len);
+    close(res->file_fd);
+    res->file_fd = -1;
+    return 0;
 }
 
-void dynamic_request(int new_fd, char* path) {
-    char* params = path;
-    params += strlen("fib.cgi?"); // get everything after ? in path
+/*
+Answer from a file cache entry, with a 304 if req's validators show the client has it already.
+The reference held on entry is released by free_response().
+*/
+void cached_request(struct response* res, struct cache_entry* entry, const struct http_request* req, int keep_alive) {
+    clear_response(res);
+    res->cached = entry;
+    if (not_modified(req, entry->etag, entry->etag_len, entry->mtime.tv_sec)) {
+        not_modified_response(res, entry->validators, entry->validators_len, entry->vary, entry->cache_control, keep_alive);
+        return;
+    }
+    rb_start(&res->out, 200, "OK");
+    rb_add(&res->out, entry->fields, entry->fields_len);
+    rb_add(&res->out, entry->validators, entry->validators_len);
+    if (entry->cache_control != NULL) {
+        rb_add(&res->out, entry->cache_control->data(), entry->cache_control->size());
+    }
+    rb_end_headers(&res->out, keep_alive);
+    rb_add(&res->out, entry->data, entry->size);
+}
 
-    /* path and params test
-    printf("path: %s\n", path);
-    printf("params: %s\n", params);
-    */
+/*
+The entry to answer with, for entry (a cached file in no encoding): a cached precompressed sibling in the
+encoding the client prefers if the file has one, else with -o the file gzipped on the fly (kept in the gzip
+cache, so each version of the file is compressed once), else entry itself. The reference on whichever isn't
+returned is dropped.
+*/
+struct cache_entry* encoded_variant(struct cache_entry* entry, const char* path, int accepted) {
+    int usable = entry->variants.load(std::memory_order_relaxed) & accepted;
+    for (int encoding : preferred_encodings) {
+        if ((usable & encoding) == 0) {
+            continue;
+        }
+        struct cache_entry* variant = file_cache_lookup(&file_cache, path, encoding);
+        if (variant == NULL) {
+            variant = file_cache_load(&file_cache, path, encoding);
+        }
+        if (variant != NULL) {
+            cache_release(entry);
+            return variant;
+        }
+    }
+
+    if (!gzip_wanted(path, entry->size, accepted) || entry->incompressible.load(std::memory_order_relaxed)) {
+        return entry;
+    }
+    struct cache_entry* gz = gzip_lookup(path, entry->size, &entry->mtime, entry->ino);
+    if (gz == NULL) {
+        gz = gzip_cache_add(path, entry->data, entry->size, &entry->mtime, entry->ino);
+    }
+    if (gz == NULL) {
+        entry->incompressible.store(1, std::memory_order_relaxed); // not for this version of the file, anyway
+        return entry;
+    }
+    compress_counters.responses.fetch_add(1, std::memory_order_relaxed);
+    cache_release(entry);
+    return gz;
+}
+
+// dynamic cache key of a request path ("fib.cgi?user=me&n=5" -> "fib.cgi?n=5&user=me"), the thread's until its next call
+const std::string& dynamic_key_for(const char* path) {
+    const char* question = strchr(path, '?');
+    size_t handler_len = question != NULL ? (size_t) (question - path) : strlen(path);
+    return dynamic_key(path, handler_len, question != NULL ? question + 1 : "");
+}
+
+// -o: is a dynamic response worth gzipping (for a client that takes it)?
+int dynamic_compressible(int code, const std::string& headers, int has_content_type, size_t body_len) {
+    return gzip_level > 0 && code == 200 && body_len >= COMPRESS_MIN_SIZE && headers_compressible(headers, has_content_type);
+}
+
+/*
+A dynamic response from its parts, which must stay valid until it is sent.
+With -o a compressible body goes out gzipped if res->accepted allows: gzipped is the body compressed
+ahead of time (a dynamic cache entry's, empty if that didn't make it smaller), or NULL to compress it now
+into the connection's arena.
+*/
+void build_dynamic_response(struct response* res, int code, const std::string& reason, const std::string& headers,
+        int has_content_type, const std::string& body, const std::string* gzipped, int keep_alive) {
+    const char* data = body.data();
+    size_t len = body.size();
+    int compressible = dynamic_compressible(code, headers, has_content_type, body.size());
+    int encoding = ENCODING_IDENTITY;
+    if (compressible && (res->accepted & ENCODING_GZIP) != 0) {
+        if (gzipped == NULL) {
+            size_t cap = gzip_bound(len);
+            char* out = (char*) arena_alloc(res->scratch, cap);
+            size_t size = gzip_buffer(data, len, gzip_level, out, cap);
+            if (size > 0 && size < len) {
+                data = out;
+                len = size;
+                encoding = ENCODING_GZIP;
+            } else {
+                compress_counters.incompressible.fetch_add(1, std::memory_order_relaxed);
+            }
+        } else if (!gzipped->empty()) {
+            data = gzipped->data();
+            len = gzipped->size();
+            encoding = ENCODING_GZIP;
+        }
+        if (encoding == ENCODING_GZIP) {
+            compress_counters.responses.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    rb_start(&res->out, code, reason.c_str());
+    rb_content_length(&res->out, len);
+    if (!has_content_type) {
+        rb_add(&res->out, CONTENT_TYPE_HTML, strlen(CONTENT_TYPE_HTML));
+    }
+    rb_add(&res->out, headers.data(), headers.size());
+    if (encoding == ENCODING_GZIP) {
+        rb_add(&res->out, encoding_field(ENCODING_GZIP), strlen(encoding_field(ENCODING_GZIP)));
+    }
+    if (compressible) {
+        rb_add(&res->out, VARY_ACCEPT_ENCODING, strlen(VARY_ACCEPT_ENCODING));
+    }
+    rb_end_headers(&res->out, keep_alive);
+    rb_add(&res->out, data, len);
+}
+
+// run a handler plugin in this thread and answer with whatever it wrote
+void plugin_request(struct response* res, struct plugin* p, const char* method, char* path, int keep_alive) {
+    if (plugin_call(p, method, path, &res->dynamic) != 0) {
+        char error[] = "The request handler failed";
+        char errnum[] = "500";
+        char reason[] = "Internal Server Error";
+        char msg[] = "Server could not complete this request.";
+        error_response(res, error, errnum, reason, msg, keep_alive);
+        return;
+    }
+    clear_response(res);
+    struct plugin_output* po = &res->dynamic;
+    build_dynamic_response(res, po->code, po->reason, po->headers, po->has_content_type, po->body, NULL, keep_alive);
+}
+
+// answer from the dynamic cache, the entry's strings stay alive until free_response() releases it
+void dynamic_cached_request(struct response* res, struct dynamic_entry* entry, int keep_alive) {
+    clear_response(res);
+    res->dynamic_cached = entry;
+    build_dynamic_response(res, entry->code, entry->reason, entry->headers, entry->has_content_type, entry->body,
+        &entry->gzip_body, keep_alive);
+}
+
+// cleanup once the response has been sent (or the client went away)
+void free_response(struct response* res) {
+    if (res->file_fd != -1) {
+        close(res->file_fd);
+        res->file_fd = -1;
+    }
+    if (res->mapped != NULL) {
+        munmap(res->mapped, res->mapped_len);
+        res->mapped = NULL;
+    }
+    if (res->cached != NULL) {
+        cache_release(res->cached);
+        res->cached = NULL;
+    }
+    if (res->dynamic_cached != NULL) {
+        dynamic_release(res->dynamic_cached);
+        res->dynamic_cached = NULL;
+    }
+}
+
+/*
+send_some() writes as much of the response as the socket takes, looping over partial writes.
+Returns 1 when the whole response is out, 0 if a non-blocking socket is full (call again when it is
+writable, the event loop does), -1 if the client went away (only this connection is affected).
+On a blocking socket (thread pool) it only returns once everything is sent or the write failed.
+*/
+int send_some(int fd, struct response* res) {
+    while (1) {
+        ssize_t rv;
+        if (!rb_done(&res->out)) {
+            // MSG_MORE holds a header back until the sendfile() data follows, so they leave in the same packets
+            rv = rb_send(fd, &res->out, res->file_fd != -1 ? MSG_MORE : 0);
+        } else if (res->out.overflow == RB_REPLACED) {
+            return 1; // a bodyless 500 went out instead, the file mustn't follow it
+        } else if (res->file_fd != -1 && res->file_sent < res->file_len) {
+            off_t offset = res->file_sent;
+            rv = sendfile(fd, res->file_fd, &offset, res->file_len - res->file_sent);
+            if (rv == -1 && (errno == EINVAL || errno == ENOSYS) && res->file_sent == 0) {
+                if (map_file_body(res) == 0) { // file can't be sendfile()d, send it from a mapping instead
+                    continue;
+                }
+            }
+            if (rv == 0) { // file got shorter since fstat(), the promised Content-Length can't be met
+                return -1;
+            }
+            if (rv > 0) {
+                res->file_sent += rv;
+            }
+        } else {
+            return 1;
+        }
+        if (rv == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+    }
+}
+
+// blocking send used by the thread pool, new_fd belongs only to this worker so no lock is needed
+// returns -1 if the client went away, only this connection is affected
+int send_response(int new_fd, struct response* res) {
+    int rv = send_some(new_fd, res);
+    free_response(res);
+    return rv == 1 ? 0 : -1;
+}
 
+/*
+Check that fib.cgi can be run before spawning it. If it can't, put the 404 or 403 in res and return 1.
+Returns 0 if it can be run.
+*/
+int cgi_unavailable(struct response* res, int keep_alive) {
     if (access("fib.cgi", F_OK) == -1) { // file does not exist
-        pthread_mutex_lock(&socket_mutex);
         char error[] = "The requested file does not exist";
         char errnum[] = "404";
         char reason[] = "Not Found";
         char msg[] = "Server could not find this file.";
-        write_error_response(new_fd, error, errnum, reason, msg);
-        pthread_mutex_unlock(&socket_mutex);
-        exit(1);
-    }
-
-    if (access("fib.cgi", R_OK) == -1) { // server does not have read persmissions for file
-        pthread_mutex_lock(&socket_mutex);
+        error_response(res, error, errnum, reason, msg, keep_alive);
+    } else if (access("fib.cgi", R_OK) == -1) { // server does not have read persmissions for file
         char error[] = "The requested file is not located on the sub-tree of the file system hierarchy that's rooted at the server's base working directory, or the web server does not have permissions to read the file.";
         char errnum[] = "403";
         char reason[] = "Forbidden";
         char msg[] = "Server could not read this file.";
-        write_error_response(new_fd, error, errnum, reason, msg);
-        pthread_mutex_unlock(&socket_mutex);
-        exit(1);
+        error_response(res, error, errnum, reason, msg, keep_alive);
+    } else {
+        return 0;
     }
+    return 1;
+}
 
-    char executable[] = "fib.cgi"; // computer can't run .cpp source files, only binary executables (the correct one will be created via Makefile)
-    char* args[] = {executable, NULL};
-    char query_string[strlen("QUERY_STRING=")+strlen(params)]; // allocates buffer big enough for both strings
-    strcpy(query_string, "QUERY_STRING="); // copy for string literal
-    strcat(query_string, params); // add to the end, already null terminated
+/*
+request_ready() looks for a complete request at the start of buffer (len bytes read so far).
+Returns HTTP_PARSE_DONE when req holds it, HTTP_PARSE_INCOMPLETE if more has to be read, or an error
+when the request can't be answered: HTTP_PARSE_TOO_LARGE also covers a head that doesn't fit in
+HTTP_MAX_REQUEST bytes.
+*/
+int request_ready(struct http_parser* parser, char* buffer, size_t len, struct http_request* req) {
+    int rv = http_parse(parser, buffer, len, req);
+    if (rv == HTTP_PARSE_INCOMPLETE && len >= HTTP_MAX_REQUEST) {
+        return HTTP_PARSE_TOO_LARGE;
+    }
+    return rv;
+}
+
+// the 400 or 431 for a request_ready() error, the connection closes after it since there is no telling where the next request would start
+void unparsable_response(struct response* res, int parse_error) {
+    res->kind = STATS_OTHER;
+    if (parse_error == HTTP_PARSE_ERROR) {
+        char error[] = "The request could not be parsed";
+        char errnum[] = "400";
+        char reason[] = "Bad Request";
+        char msg[] = "Server could not understand this request.";
+        error_response(res, error, errnum, reason, msg, 0);
+    } else {
+        char error[] = "The request line and headers are too large";
+        char errnum[] = "431";
+        char reason[] = "Request Header Fields Too Large";
+        char msg[] = "Server will not read a request this large.";
+        error_response(res, error, errnum, reason, msg, 0);
+    }
+}
+
+// the gauges server_stats.h doesn't keep itself, defined with the event loop since it also reads the CGI job queue
+void stats_gauges_now(struct stats_gauges* g);
+
+// each thread's page as it is formatted, reused so that once it has grown formatting one doesn't allocate
+thread_local std::string status_text;
+
+/*
+/server-status (plain text) and /metrics (Prometheus): every thread's counters added up, plus the gauges.
+This is the only place the per-thread shards are read. The body is copied into the connection's arena, so it
+lives until the response has been sent.
+*/
+void status_request(struct response* res, int prometheus, int keep_alive) {
+    struct stats_totals totals;
+    struct stats_gauges gauges;
+    stats_collect(&totals);
+    stats_gauges_now(&gauges);
+    std::string& text = status_text;
+    text.clear();
+    if (prometheus) {
+        stats_format_prometheus(&text, &totals, &gauges);
+    } else {
+        stats_format_text(&text, &totals, &gauges);
+    }
+    char* body = (char*) arena_alloc(res->scratch, text.size());
+    memcpy(body, text.data(), text.size());
+
+    clear_response(res);
+    rb_start(&res->out, 200, "OK");
+    rb_content_length(&res->out, text.size());
+    const char* fields = prometheus ? STATS_PROMETHEUS_FIELDS : STATS_TEXT_FIELDS;
+    rb_add(&res->out, fields, strlen(fields));
+    rb_end_headers(&res->out, keep_alive);
+    rb_add(&res->out, body, text.size());
+}
+
+// what the metrics and the access log know about the request being answered, besides its response
+struct request_trace {
+    long started_us; // when the request had been read completely
+    long queue_us; // how long the connection waited in the accepted connection buffer, 0 after its first request
+    const struct client_addr* client; // NULL when unknown
+    struct str_view method; // both empty when the request couldn't be parsed
+    struct str_view target;
+};
+
+// count a response that went out in the server's metrics, and log it
+void finish_request(struct request_trace* trace, int kind, int code, size_t bytes) {
+    long service_us = stats_now_us() - trace->started_us;
+    stats_request(kind, code, bytes, service_us);
+    if (access_log.on) {
+        access_log_add(&access_log, trace->client, trace->method.p, trace->method.len, trace->target.p, trace->target.len,
+            code, bytes, trace->queue_us, service_us);
+    }
+}
+
+void count_response(struct response* res, struct request_trace* trace) {
+    finish_request(trace, res->kind, res->out.code, res->out.length + res->file_sent);
+}
 
-    /* qstring variable test
-    printf("qstring = %s\n", query_string);
+// a trace for the request req (or, when it couldn't be parsed, NULL) that has just been read
+void trace_start(struct request_trace* trace, struct http_request* req) {
+    trace->started_us = stats_now_us();
+    if (req != NULL) {
+        trace->method = req->method;
+        trace->target = req->target;
+    } else {
+        trace->method.len = trace->target.len = 0;
+        trace->method.p = trace->target.p = "";
+    }
+}
+
+/*
+route_request() decides how to answer one parsed request (http_parser.h).
+Static files and errors fill res, fib.cgi requests return ROUTE_CGI with *cgi_path pointing into the
+request buffer. The request target is null terminated in place (over the space after it), so the buffer
+must be the caller's and writable.
+*keep_alive says whether the connection stays open after this response, requests the server can't
+make sense of turn it off since there is no telling where the next request would start.
+res->kind records what kind of request it was, for the metrics.
+It never touches the socket, so both the thread pool and the event loop use it.
+*/
+enum route route_request(struct http_request* req, struct response* res, char** cgi_path, int* keep_alive) {
+    res->kind = STATS_OTHER;
+    res->accepted = accepted_encodings(req);
+
+    /* request line test
+    printf("method = %.*s target = %.*s version = %.*s\n", (int) req->method.len, req->method.p,
+        (int) req->target.len, req->target.p, (int) req->version.len, req->version.p);
     */
 
-    char* env_args[] = {query_string, NULL}; // make envp char* array, fib.cgi can access what you put in this via environ global variable
+    if (!sv_eq(req->method, "GET")) {
+        // if the request method is not GET
+        char error[] = "HTTP method other than GET";
+        char errnum[] = "501";
+        char reason[] = "Not Implemented";
+        char msg[] = "Server does not implement this method.";
+        *keep_alive = 0; // a request body may follow that we won't read
+        error_response(res, error, errnum, reason, msg, *keep_alive);
+        return ROUTE_RESPONSE;
+    }
+
+    char* path = (char*) req->target.p;
+    path[req->target.len] = '\0'; // was the space before the version, which req->version doesn't include
 
-    // redirect standard output to the socket before executing fib.cpp
-    if (dup2(new_fd, STDOUT_FILENO) == -1) {
-        perror("dup2 stdout");
-        close(new_fd);
-        exit(EXIT_FAILURE);
+    if (strstr(path, "..") != NULL) { // send error is path contains ".."
+        char error[] = "The requested file is not located on the sub-tree of the file system hierarchy that's rooted at the server's base working directory, or the web server does not have permissions to read the file.";
+        char errnum[] = "403";
+        char reason[] = "Forbidden";
+        char msg[] = "Server could not read this file.";
+        error_response(res, error, errnum, reason, msg, *keep_alive);
+        return ROUTE_RESPONSE;
     }
-    if (dup2(new_fd, STDERR_FILENO) == -1) {
-        perror("dup2 stderr");
-        close(new_fd);
-        exit(EXIT_FAILURE);
+
+    if (path[0] == '/') { // if path starts with "/" skip it so it doesn't cause issues during lookup
+        path++;
     }
 
-    close(new_fd); // close new_fd before terminating this process and calling exec, which will just print. In the event that execve fails, new_fd will still be closed because it is called here
-    
-    if (execve(args[0], args, env_args) == -1) {
-        perror("execve");
-        exit(EXIT_FAILURE);
+    if (!sv_eq(req->version, "HTTP/1.1")) { // send error is HTTP version not 1.1
+        char error[] = "HTTP version other than 1.1";
+        char errnum[] = "502";
+        char reason[] = "Not Supported";
+        char msg[] = "Server does not support this version.";
+        *keep_alive = 0;
+        error_response(res, error, errnum, reason, msg, *keep_alive);
+        return ROUTE_RESPONSE;
     }
 
-    // If execve fails, print error message
-    perror("execve");
-    exit(EXIT_FAILURE);
-}
+    if (status_pages && (sv_eq(req->path, "/server-status") || sv_eq(req->path, "/metrics"))) {
+        status_request(res, sv_eq(req->path, "/metrics"), *keep_alive);
+        return ROUTE_RESPONSE;
+    }
 
-void* consume(void* arg) {
-    // convert void* arguments back
-    std::queue<int>* q = (std::queue<int>*) arg;
+    struct plugin* plugin = plugins_find(path);
+    if (plugin != NULL) { // answered in this thread by a handler plugin, no process involved
+        res->kind = STATS_PLUGIN;
+        plugin_request(res, plugin, "GET", path, *keep_alive);
+        return ROUTE_RESPONSE;
+    }
 
-    while(1) {
-        sem_wait(&full); // when there is something to consume in the queue
-
-        ssize_t max_chars = 1024; // should be plenty for our requests
-        char buffer[max_chars]; // buffer is not necessarily null terminated
-        ssize_t total_bytes = 0; // number of bytes recieved so far
-        pthread_mutex_lock(&queue_mutex);
-        int new_fd = q->front(); // get the new_fd to consume and process
-        q->pop();
-        pthread_mutex_unlock(&queue_mutex);
-
-        pthread_mutex_lock(&socket_mutex);
-        ssize_t bytes_read = read(new_fd, &buffer, max_chars); // ssize_t is a signed size_t
-        if(bytes_read == 0) {
-            fprintf(stderr, "server: read() within outer fork\n"); 
-            exit(1); 
+    if (strstr(path, "fib.cgi") != NULL) { // fib.cgi requests are answered by the cgi program
+        res->kind = STATS_CGI;
+        struct dynamic_entry* hit;
+        if (dynamic_ttl > 0 && (hit = dynamic_cache_lookup(&dynamic_cache, dynamic_key_for(path))) != NULL) {
+            dynamic_cached_request(res, hit, *keep_alive); // same answer as last time, no program runs
+            return ROUTE_RESPONSE;
         }
+        *cgi_path = path;
+        return ROUTE_CGI;
+    }
 
-        /* bytes_read variable test
-        printf("bytes read: %d\n", bytes_read);
-        */
-        
+    // otherwise treat it as a static request, hot files are answered from memory without touching the file system
+    res->kind = STATS_STATIC;
+    struct cache_entry* entry = NULL;
+    if (cache_mb > 0 && (entry = file_cache_lookup(&file_cache, path, ENCODING_IDENTITY)) != NULL) {
+        cached_request(res, encoded_variant(entry, path, res->accepted), req, *keep_alive);
+        return ROUTE_RESPONSE;
+    }
 
-        while (bytes_read != 0) {
-            if(bytes_read < 0) {
-                fprintf(stderr, "server: read() within outer fork\n"); 
-                exit(1); 
-            }
+    if (access(path, F_OK) == -1) { // file does not exist
+        char error[] = "The requested file does not exist";
+        char errnum[] = "404";
+        char reason[] = "Not Found";
+        char msg[] = "Server could not find this file.";
+        error_response(res, error, errnum, reason, msg, *keep_alive);
+        return ROUTE_RESPONSE;
+    }
 
-            total_bytes += bytes_read;
-            // if end of request (\r\n\r\n) is in the buffer, do not attempt to read again, will get stuck
-            if (strstr(buffer, "\r\n\r\n") != NULL) {
-                break;
-            }
-    
-            /*
-            read() and write() are universally used, recv() and send() are for more specialized cases
-            so for this use read() and write()
-            */
+    if (access(path, R_OK) == -1) { // web server does not have read permissions for file
+        char error[] = "The requested file is not located on the sub-tree of the file system hierarchy that's rooted at the server's base working directory, or the web server does not have permissions to read the file.";
+        char errnum[] = "403";
+        char reason[] = "Forbidden";
+        char msg[] = "Server could not read this file.";
+        error_response(res, error, errnum, reason, msg, *keep_alive);
+        return ROUTE_RESPONSE;
+    }
 
-            bytes_read = read(new_fd, (&buffer + total_bytes), max_chars); // add into buffer offset by however many bytes already read (until request is done reading)
-        }
-        pthread_mutex_unlock(&socket_mutex);
+    if (cache_mb > 0 && (entry = file_cache_load(&file_cache, path, ENCODING_IDENTITY)) != NULL) {
+        cached_request(res, encoded_variant(entry, path, res->accepted), req, *keep_alive);
+        return ROUTE_RESPONSE;
+    }
 
-        // strings don't have endianness, so no need to ntoh()
+    static_request(res, path, req, *keep_alive); // too big to cache (or cache off), map it straight from disk
+    return ROUTE_RESPONSE;
+}
 
-        /* buffer test
-        printf("buffer: %.*s\n", total_bytes, buffer);
-        */
+// keep a successful CGI response (parsed, the cache takes entry over) for later identical requests
+void dynamic_cache_store(const char* path, struct dynamic_entry* entry) {
+    if (entry->code != 200) {
+        delete entry;
+        return;
+    }
+    if (dynamic_compressible(entry->code, entry->headers, entry->has_content_type, entry->body.size())) {
+        // compressed once here, every hit for a client that takes gzip is sent this copy
+        entry->gzip_body.resize(gzip_bound(entry->body.size()));
+        size_t size = gzip_buffer(entry->body.data(), entry->body.size(), gzip_level, &entry->gzip_body[0], entry->gzip_body.size());
+        entry->gzip_body.resize(size < entry->body.size() ? size : 0);
+    }
+    entry = dynamic_cache_insert(&dynamic_cache, dynamic_key_for(path), entry);
+    if (entry != NULL) {
+        dynamic_release(entry); // only the cache keeps it
+    }
+}
 
-        char* method = strtok(buffer, " ");
-        
-        /* request method extraction test
-        printf("request method = %s\n", method);
-        */
+void cgi_failed_response(struct response* res, int keep_alive) {
+    char error[] = "The CGI worker answering this request exited";
+    char errnum[] = "500";
+    char reason[] = "Internal Server Error";
+    char msg[] = "Server could not complete this request.";
+    error_response(res, error, errnum, reason, msg, keep_alive);
+}
 
-        if (strcmp(method, "GET") != 0) {
-            // if the request method is not GET
-            pthread_mutex_lock(&socket_mutex);
-            char error[] = "HTTP method other than GET";
-            char errnum[] = "501";
-            char reason[] = "Not Implemented";
-            char msg[] = "Server does not implement this method.";
-            write_error_response(new_fd, error, errnum, reason, msg);
-            pthread_mutex_unlock(&socket_mutex);
-            exit(1);
+/*
+Put a pooled worker's response into res, taken apart and framed again by the response builder like any
+dynamic answer: the server's Date and Connection headers, and with -o gzipped if res->accepted allows
+(compressed into res->scratch). A response that doesn't parse is answered with a 502.
+Returns the parsed response (the caller owns it, for the dynamic cache), NULL if it didn't parse.
+*/
+struct dynamic_entry* pooled_response(struct response* res, const char* response, size_t length, int keep_alive) {
+    struct dynamic_entry* parsed = new struct dynamic_entry;
+    if (parse_http_response(response, length, parsed) == -1) {
+        delete parsed;
+        char error[] = "The CGI worker's response could not be understood";
+        char errnum[] = "502";
+        char reason[] = "Bad Gateway";
+        char msg[] = "Server could not complete this request.";
+        error_response(res, error, errnum, reason, msg, keep_alive);
+        return NULL;
+    }
+    clear_response(res);
+    struct plugin_output* po = &res->dynamic; // the strings have to outlive the send, as a plugin's do
+    po->code = parsed->code;
+    po->reason = parsed->reason;
+    po->headers = parsed->headers;
+    po->has_content_type = parsed->has_content_type;
+    po->body = parsed->body;
+    build_dynamic_response(res, po->code, po->reason, po->headers, po->has_content_type, po->body, NULL, keep_alive);
+    return parsed;
+}
+
+/*
+Answer a fib.cgi request with one of the pooled workers: the query string goes to the worker in a frame,
+the HTTP response comes back in a frame and is put into res, for the caller to send like any other response.
+If the same request (same dynamic cache key) is already being answered, wait for that answer instead of
+taking another worker to compute it again (single_flight.h).
+*/
+void pooled_cgi(char* path, struct response* res, int keep_alive) {
+    std::string key = dynamic_key_for(path); // a copy, the flight outlives the thread's key
+    int leader;
+    struct flight* f = flight_join(&cgi_flights, key, &leader);
+    if (!leader) {
+        flight_wait(&cgi_flights, f);
+        if (f->length == -1) {
+            cgi_failed_response(res, keep_alive);
+        } else {
+            delete pooled_response(res, f->response.data(), f->length, keep_alive);
         }
-        char* path = strtok(NULL, " ");
+        flight_release(&cgi_flights, f);
+        return;
+    }
 
-        /* request path extraction test 
-        printf("request path = %s\n", path);
-        */
+    char* query = strchr(path, '?');
+    query = query != NULL ? query + 1 : (char*) "";
 
-        if (path[0] == '/') { // if path starts with "/" take it out so it doesn't cause issues during lookup
-            memmove(path, path+1, strlen(path));
-        }
+    char* response;
+    ssize_t length = cgi_pool_exchange(&cgi_pool, query, &response);
+    flight_land(&cgi_flights, key, f, response, length);
+    flight_release(&cgi_flights, f);
+    if (length == -1) {
+        cgi_failed_response(res, keep_alive);
+        return;
+    }
+    struct dynamic_entry* parsed = pooled_response(res, response, length, keep_alive);
+    free(response);
+    if (parsed != NULL && dynamic_ttl > 0) {
+        dynamic_cache_store(path, parsed);
+    } else {
+        delete parsed;
+    }
+}
 
-        if (strstr(path, "..") != NULL) { // send error is path contains ".."
-            pthread_mutex_lock(&socket_mutex);
-            char error[] = "The requested file is not located on the sub-tree of the file system hierarchy that's rooted at the server's base working directory, or the web server does not have permissions to read the file.";
-            char errnum[] = "403";
-            char reason[] = "Forbidden";
-            char msg[] = "Server could not read this file.";
-            write_error_response(new_fd, error, errnum, reason, msg);
-            pthread_mutex_unlock(&socket_mutex);
-            exit(1);
+// a spawned fib.cgi's 200, relayed whole (cgi_stream.h): into the dynamic cache, as a pooled worker's answer goes
+void cache_spawned(struct cgi_relay* relay) {
+    struct dynamic_entry* entry = new struct dynamic_entry;
+    entry->code = relay->head.code;
+    entry->reason = relay->head.reason;
+    entry->headers = relay->head.headers;
+    entry->has_content_type = relay->head.has_content_type;
+    entry->body.swap(relay->capture);
+    dynamic_cache_store(relay->capture_path.c_str(), entry);
+}
+
+/*
+-g 0: spawn fib.cgi for the request (cgi_spawn.h) with the query in its environment and a pipe as its
+stdout, and hand the pipe and the connection to a relay (cgi_stream.h) that the child watch's poller drives.
+The child watch reaps the child, and kills it (shutting down the connection first, so the relay stops) if it
+runs past -w seconds. The environment is built in res->scratch, the connection's arena, res->accepted is the
+request's Accept-Encoding, for -o. With -e a 200 the relay sends whole also goes into the dynamic cache.
+Returns 1 once the relay has the connection: the caller must leave fd alone until the poller calls
+done(relay, reusable) with it (on the poller's thread), owner is for done(). Returns 0 with the answer in res
+(404 or 403 when fib.cgi can't be run, 500 when it couldn't be started) otherwise.
+*/
+int spawn_cgi(int fd, char* path, struct response* res, int keep_alive, int (*done)(struct cgi_relay*, int), void* owner) {
+    if (cgi_unavailable(res, keep_alive)) {
+        return 0;
+    }
+    char* query = strchr(path, '?');
+    query = query != NULL ? query + 1 : (char*) "";
+    char executable[] = "fib.cgi"; // computer can't run .cpp source files, only binary executables (the correct one will be created via Makefile)
+    char* args[] = {executable, NULL};
+
+    int out[2];
+    pid_t pid = -1;
+    if (pipe2(out, O_CLOEXEC) == -1) {
+        perror("pipe2");
+    } else {
+        pid = cgi_spawn(executable, args, cgi_environment(res->scratch, executable, query), -1, out[1]);
+        close(out[1]); // the child's copy is the only writer left, so the pipe reads EOF when it exits
+        if (pid == -1) {
+            perror("server: posix_spawn");
+            close(out[0]);
         }
+    }
+    if (pid == -1) {
+        char error[] = "The CGI program could not be started";
+        char errnum[] = "500";
+        char reason[] = "Internal Server Error";
+        char msg[] = "Server could not complete this request.";
+        error_response(res, error, errnum, reason, msg, keep_alive);
+        return 0;
+    }
 
-        char* protocol = strtok(NULL, "\r\n");
+    struct cgi_relay* relay = cgi_relay_new(fd, out[0], keep_alive, gzip_level, res->accepted);
+    relay->done = done;
+    relay->owner = owner;
+    if (dynamic_ttl > 0) { // a body larger than a cache shard would never be kept
+        relay->capture_max = dynamic_cache.shard_cap;
+        relay->capture_path = path;
+        relay->captured = cache_spawned;
+    }
+    if (child_watch_add(&cgi_children, pid, fcntl(fd, F_DUPFD_CLOEXEC, 0), &relay->watch_id) == -1) {
+        relay->pid = pid; // no pidfd, the relay reaps the child once its output is over
+    }
+    if (cgi_relay_start(&cgi_children, relay) == -1) {
+        perror("server: cgi relay");
+        relay->failed = 1;
+        relay->done = NULL;
+        relay_finish(&cgi_children, relay); // never reached the poller, so nobody else has it
+        char error[] = "The CGI program's output could not be relayed";
+        char errnum[] = "500";
+        char reason[] = "Internal Server Error";
+        char msg[] = "Server could not complete this request.";
+        error_response(res, error, errnum, reason, msg, keep_alive);
+        return 0;
+    }
+    return 1;
+}
 
-        /* request protocol extraction test
-        printf("request protocol = %s\n", protocol);
-        */
+/*
+A thread pool connection whose fib.cgi answer is being relayed (spawn_cgi()). The worker that read the request
+has gone back to serving, once the relay is done the connection is put back into its shard's pool with what
+handle_connection() needs to carry on where it left off.
+*/
+struct parked_conn {
+    int fd;
+    struct work_pool* pool;
+    std::string pending; // requests read after the fib.cgi one (pipelining)
+    int requests_served;
+    std::string target; // the fib.cgi request's, for the access log, the worker's buffer is gone
+    struct request_trace trace;
+    struct response_summary sent;
+    int reusable;
+};
 
-        if (strcmp(protocol, "HTTP/1.1") != 0) { // send error is HTTP version not 1.1
-            pthread_mutex_lock(&socket_mutex);
-            char error[] = "HTTP version other than 1.1";
-            char errnum[] = "502";
-            char reason[] = "Not Supported";
-            char msg[] = "Server does not support this version.";
-            write_error_response(new_fd, error, errnum, reason, msg);
-            pthread_mutex_unlock(&socket_mutex);
-            exit(1);
+/*
+The relay's done() for a parked connection, on the poller's thread: queue it for a worker (handle_connection()
+picks up the parked_conn through accepted_conns, or overflow_parked for a descriptor without an entry).
+Returns -1 while every queue is full.
+*/
+int unpark_connection(struct cgi_relay* relay, int reusable) {
+    struct parked_conn* parked = (struct parked_conn*) relay->owner;
+    parked->sent = relay->sent;
+    parked->reusable = reusable;
+    if (parked->fd < accepted_conns_max) {
+        accepted_conns[parked->fd].parked = parked;
+    } else {
+        pthread_mutex_lock(&overflow_parked_lock);
+        overflow_parked[parked->fd] = parked;
+        pthread_mutex_unlock(&overflow_parked_lock);
+    }
+    return work_pool_offer(parked->pool, parked->fd) ? 0 : -1;
+}
+
+// the parked_conn new_fd came back from a CGI relay with (origin is its entry, if it has one), NULL for a new connection
+struct parked_conn* take_parked(int new_fd, struct accepted_conn* origin) {
+    struct parked_conn* parked = NULL;
+    if (origin != NULL) {
+        parked = origin->parked;
+        origin->parked = NULL;
+    } else {
+        pthread_mutex_lock(&overflow_parked_lock);
+        std::unordered_map<int, struct parked_conn*>::iterator it = overflow_parked.find(new_fd);
+        if (it != overflow_parked.end()) {
+            parked = it->second;
+            overflow_parked.erase(it);
         }
+        pthread_mutex_unlock(&overflow_parked_lock);
+    }
+    return parked;
+}
 
+// what a worker leaves behind for the one that picks new_fd up after its fib.cgi request (trace) has been relayed
+struct parked_conn* park_connection(int new_fd, struct work_pool* pool, const char* pending, size_t pending_len,
+        int requests_served, const struct request_trace* trace) {
+    struct parked_conn* parked = new struct parked_conn;
+    parked->fd = new_fd;
+    parked->pool = pool;
+    parked->pending.assign(pending, pending_len);
+    parked->requests_served = requests_served;
+    parked->target.assign(trace->target.p, trace->target.len);
+    parked->trace = *trace;
+    parked->sent.code = 0;
+    parked->sent.bytes = 0;
+    parked->reusable = 0;
+    return parked;
+}
 
-        if (strstr(path, "fib.cgi") == NULL) { // if path does not request fib.cgi, treat it as a static request
-            if (access(path, F_OK) == -1) { // file does not exist
-                pthread_mutex_lock(&socket_mutex);
-                char error[] = "The requested file does not exist";
-                char errnum[] = "404";
-                char reason[] = "Not Found";
-                char msg[] = "Server could not find this file.";
-                write_error_response(new_fd, error, errnum, reason, msg);
-                pthread_mutex_unlock(&socket_mutex);
-                exit(1);
-            }
+/*
+handle_connection() answers requests from new_fd until the connection is done, then closes new_fd.
+Every connection is owned by exactly one worker thread, so reads and writes on it never need a lock,
+and a bad request or a client that went away only ends this connection (never the whole server).
+The connection stays open between requests (keep-alive) until the client asks to close, max_requests
+have been answered, or it sits idle for keepalive_secs. Requests that arrive together in one read
+(pipelining) are answered in order straight out of the buffer.
+Per-request scratch memory comes from the connection's arena, reset after every response.
+A spawned fib.cgi's answer (-g 0) is relayed by the child watch's poller: the worker parks the connection and
+returns without closing it, and whichever worker takes it out of pool afterwards carries on from there.
+*/
+void handle_connection(int new_fd, struct work_pool* pool) {
+    char buffer[HTTP_MAX_REQUEST];
+    ssize_t total_bytes = 0; // number of bytes recieved so far
+    struct http_parser parser; // remembers how much of buffer has been searched for the end of the request
+    http_parser_init(&parser);
+    int requests_served = 0;
+    struct arena scratch;
+    arena_init(&scratch);
+    struct response res; // outside the loop, so a plugin's output strings keep their capacity between requests
+    res.scratch = &scratch;
+    struct request_trace trace;
+    struct accepted_conn* origin = new_fd < accepted_conns_max ? &accepted_conns[new_fd] : NULL;
+    trace.client = origin != NULL ? &origin->client : NULL;
+    trace.queue_us = origin != NULL ? stats_now_us() - origin->accepted_us : 0; // consume() calls this right after taking new_fd
+
+    struct parked_conn* parked = take_parked(new_fd, origin);
+    if (parked != NULL) { // back from a CGI relay, which has answered the last request read
+        fcntl(new_fd, F_SETFL, fcntl(new_fd, F_GETFL) & ~O_NONBLOCK); // the relay left it non-blocking
+        trace = parked->trace;
+        trace.target.p = parked->target.data();
+        finish_request(&trace, STATS_CGI, parked->sent.code, parked->sent.bytes);
+        memcpy(buffer, parked->pending.data(), parked->pending.size());
+        total_bytes = parked->pending.size();
+        requests_served = parked->requests_served;
+        int reusable = parked->reusable;
+        delete parked;
+        if (!reusable) {
+            arena_release(&scratch);
+            close(new_fd);
+            return;
+        }
+        trace.queue_us = 0;
+    }
 
-            if (access(path, R_OK) == -1) { // web server does not have read permissions for file
-                pthread_mutex_lock(&socket_mutex);
-                char error[] = "The requested file is not located on the sub-tree of the file system hierarchy that's rooted at the server's base working directory, or the web server does not have permissions to read the file.";
-                char errnum[] = "403";
-                char reason[] = "Forbidden";
-                char msg[] = "Server could not read this file.";
-                write_error_response(new_fd, error, errnum, reason, msg);
-                pthread_mutex_unlock(&socket_mutex);
-                exit(1);
-            }
+    if (keepalive_secs > 0) { // read() gives up with EAGAIN once the connection has been idle too long
+        struct timeval timeout = {keepalive_secs, 0};
+        setsockopt(new_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+    }
 
-            
-            static_request(new_fd, path);
-        } else { 
-            pid_t pid = fork();
-            if(pid == -1) {
-                fprintf(stderr, "server: child failed to fork\n"); 
-                exit(1); 
+    while (1) {
+        struct http_request req;
+        int ready = request_ready(&parser, buffer, total_bytes, &req);
+
+        if (ready == HTTP_PARSE_INCOMPLETE) { // need more of the request
+            /*
+            read() and write() are universally used, recv() and send() are for more specialized cases
+            so for this use read() and write()
+            */
+            ssize_t bytes_read = read(new_fd, buffer + total_bytes, sizeof buffer - total_bytes); // add into buffer offset by however many bytes already read (until request is done reading)
+            if (bytes_read == -1 && errno == EINTR) {
+                continue;
+            }
+            if (bytes_read <= 0) { // client hung up, went idle, or read failed
+                break;
             }
+            total_bytes += bytes_read;
+            continue;
+        }
+        requests_served++;
+        trace_start(&trace, ready == HTTP_PARSE_DONE ? &req : NULL);
+
+        if (ready != HTTP_PARSE_DONE) { // nothing more can be read from this connection
+            unparsable_response(&res, ready);
+            send_response(new_fd, &res);
+            count_response(&res, &trace);
+            break;
+        }
 
-            pthread_mutex_lock(&socket_mutex); // lock output before dup2() and execve() inside child process
-            if(pid == 0) {
-                close(sockfd); // child doesn't need copy of the listener 
-                dynamic_request(new_fd, path); // close(new_fd) is called within dynamic request before execve()
-            } else {
-                // parent: wait for the child process to complete
-                int status;
-                waitpid(pid, &status, 0);
-                close(new_fd);
-                pthread_mutex_unlock(&socket_mutex);
+        int keep_alive = keepalive_secs > 0 && requests_served < max_requests && http_keep_alive(&req);
+        char* path;
+        enum route route = route_request(&req, &res, &path, &keep_alive);
+        if (route == ROUTE_CGI && cgi_workers > 0) {
+            pooled_cgi(path, &res, keep_alive);
+        } else if (route == ROUTE_CGI) {
+            // parked before the spawn, the relay can be done with the connection before spawn_cgi() returns
+            parked = park_connection(new_fd, pool, buffer + req.length, total_bytes - req.length, requests_served, &trace);
+            if (spawn_cgi(new_fd, path, &res, keep_alive, unpark_connection, parked)) {
+                arena_release(&scratch);
+                return;
             }
+            delete parked; // answered here after all, res says why
         }
+        int rv = send_response(new_fd, &res);
+        count_response(&res, &trace);
+        if (rv == -1 || !keep_alive) {
+            break;
+        }
+        arena_reset(&scratch);
+        trace.queue_us = 0; // later requests on the connection didn't wait in the buffer
+
+        // move the next pipelined request (if any) to the front of the buffer
+        memmove(buffer, buffer + req.length, total_bytes - req.length);
+        total_bytes -= req.length;
+        http_parser_init(&parser);
+    }
+
+    arena_release(&scratch);
+    close(new_fd);
+}
+
+// keep the calling thread on one cpu, so a shard's accept, queue and requests share that cpu's caches
+void pin_thread(int cpu) {
+    if (cpu < 0) {
+        return;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int rv = pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+    if (rv != 0) {
+        fprintf(stderr, "pthread_setaffinity_np: %s\n", strerror(rv));
+    }
+}
+
+void* consume(void* arg) {
+    // convert void* arguments back
+    struct worker* self = (struct worker*) arg;
+    struct work_pool* pool = &self->shard->pool;
+    pin_thread(self->shard->cpu);
+    stats_register(STATS_WORKER);
+
+    while(1) {
+        int new_fd = work_pool_pop(pool, self->id); // own queue first, then steal, sleeps while every queue is empty
 
-        sem_post(&empty); // signal that a slot in the buffer is emptied
+        stats_busy(1);
+        handle_connection(new_fd, pool);
+        stats_busy(0);
     }
 }
 
 void* produce(void* arg) {
     // convert void* arguments back
-    std::pair<std::queue<int>*, int*> * args = (std::pair<std::queue<int>*, int*> *) arg;
-    std::queue<int>* q = args->first;
-    int sockfd = *(args->second);
+    struct shard* shard = (struct shard*) arg;
+    struct work_pool* pool = &shard->pool;
+    int sockfd = shard->listen_fd;
+    pin_thread(shard->cpu);
 
     while(1) {
         int new_fd; // listen on sock_fd, new connection on new_fd 
         struct sockaddr_storage their_addr; // connector's address information 
         socklen_t sin_size;
-        char s[INET_ADDRSTRLEN]; // IPv4
 
         while(1) {
-            sem_wait(&empty); // when there is an empty slot in the buffer
+            work_pool_wait_space(pool); // when there is an empty slot in the buffer
 
             sin_size = sizeof their_addr;
-            new_fd = accept(sockfd, (struct sockaddr *)&their_addr, &sin_size);
+            new_fd = accept4(sockfd, (struct sockaddr *)&their_addr, &sin_size, SOCK_CLOEXEC); // CGI children only get the socket they answer
 
             if (new_fd == -1) {
                 perror("accept");
                 continue; 
             } else {
-                pthread_mutex_lock(&queue_mutex);
-                q->push(new_fd); // pass accepted sockfd into queue for consumers to consume
-                pthread_mutex_unlock(&queue_mutex);
+                if (new_fd < accepted_conns_max) { // who it is and when it arrived, for the access log's queue wait
+                    accepted_conns[new_fd].accepted_us = stats_now_us();
+                    client_addr_set(&accepted_conns[new_fd].client, &their_addr);
+                }
+                work_pool_push(pool, new_fd); // deal accepted sockfd to a worker's queue, wakes a sleeping worker
 
                 /* enqueue test 
                 printf("Produced item %d for Queue: \n", new_fd);
                 */
             }
 
-            sem_post(&full); // signal that a slot in the buffer has filled
-
             /* to test connected IP
+            char s[INET_ADDRSTRLEN]; // IPv4
             inet_ntop(their_addr.ss_family, 
                 &(((struct sockaddr_in*)(struct sockaddr *)&their_addr)->sin_addr), 
                 s, sizeof s);
@@ -456,11 +1369,515 @@ void* produce(void* arg) {
     }
 }
 
-void parse_argv(int argc, char* argv[], char** port, char** thread_str, char** buffer_str) {
+/*
+Event loop mode (-m epoll).
+Instead of one blocking worker per connection, each event loop thread multiplexes many non-blocking
+connections with epoll. A connection reads its request a piece at a time whenever data arrives, and
+writes its response a piece at a time whenever the socket has room, so idle or slow clients cost a
+struct connection and a file descriptor, not a thread.
+All loops share the (non-blocking) listening socket, EPOLLEXCLUSIVE wakes only one loop per new connection.
+*/
+
+#define MAX_EVENTS 256
+
+enum conn_state {
+    CONN_READING, // waiting for the rest of the request
+    CONN_WRITING, // waiting for room in the socket to send the rest of the response
+    CONN_RELAYING // out of the loop's epoll set while a CGI relay (-g 0) or a job thread (-g N) answers the request, until it hands it back
+};
+
+struct event_loop_state;
+
+struct connection {
+    int fd;
+    enum conn_state state;
+    struct arena_block* inbuf; // read buffer (same request limit as the thread pool), a pooled arena block held only while bytes are buffered
+    char* buffer; // inbuf's data
+    ssize_t total_bytes;
+    struct http_parser parser; // how much of the request has been searched already, so each read only scans new bytes
+    ssize_t request_len; // length of the request being answered, the rest of buffer is pipelined requests
+    struct request_trace trace; // the request being answered, for the metrics and the access log
+    struct client_addr client;
+    int requests_served;
+    int keep_alive; // connection stays open after the current response
+    struct response* res; // only allocated once there is something to send, idle connections stay small
+    struct arena scratch; // per-request memory, reset after each response
+    struct event_loop_state* loop; // the loop that owns it, for a CGI relay handing it back
+    struct response_summary relayed; // what the relay sent, and whether the connection can carry on
+    int relay_reusable;
+
+    // idle list, least recently active connection first, so timeouts only look at the front
+    time_t last_active;
+    struct connection* prev;
+    struct connection* next;
+};
+
+// everything one event loop thread owns
+struct event_loop_state {
+    int epfd;
+    struct connection* idle_head;
+    struct connection* idle_tail;
+};
+
+time_t now_secs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts); // second resolution is all the idle limit needs
+    return ts.tv_sec;
+}
+
+void idle_unlink(struct event_loop_state* loop, struct connection* c) {
+    if (c->prev != NULL) c->prev->next = c->next; else loop->idle_head = c->next;
+    if (c->next != NULL) c->next->prev = c->prev; else loop->idle_tail = c->prev;
+    c->prev = c->next = NULL;
+}
+
+// connection made progress, move it to the back of the idle list
+void touch(struct event_loop_state* loop, struct connection* c) {
+    if (loop->idle_tail != c) {
+        if (c->prev != NULL || loop->idle_head == c) {
+            idle_unlink(loop, c);
+        }
+        c->prev = loop->idle_tail;
+        if (loop->idle_tail != NULL) loop->idle_tail->next = c; else loop->idle_head = c;
+        loop->idle_tail = c;
+    }
+    c->last_active = now_secs();
+}
+
+void close_connection(struct event_loop_state* loop, struct connection* c) {
+    idle_unlink(loop, c);
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    if (c->res != NULL) {
+        free_response(c->res);
+        delete c->res;
+    }
+    arena_release(&c->scratch);
+    if (c->inbuf != NULL) {
+        arena_block_put(c->inbuf);
+    }
+    delete c;
+}
+
+// close every connection that has been idle for keepalive_secs or more
+void close_idle(struct event_loop_state* loop) {
+    time_t cutoff = now_secs() - keepalive_secs;
+    while (loop->idle_head != NULL && loop->idle_head->last_active <= cutoff) {
+        close_connection(loop, loop->idle_head);
+    }
+}
+
+void watch(struct event_loop_state* loop, struct connection* c, uint32_t events) {
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = c;
+    epoll_ctl(loop->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+/*
+Event loops must not wait for fib.cgi's answer. With -g 0 the loop spawns the program itself and a relay
+driven by the child watch's poller answers (relay_cgi()), with the pool the request is queued for
+cgi_job_thread()s, one per pooled worker, which wait for the answer with pooled_cgi() and hand the
+connection back to its loop to send it.
+*/
+struct cgi_job {
+    struct connection* conn; // out of its loop until the job is done, only the job thread touches it
+    char* path; // in the connection's buffer, which stays put while the loop doesn't have it
+};
+std::deque<struct cgi_job> cgi_jobs;
+pthread_mutex_t cgi_jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t cgi_jobs_cond = PTHREAD_COND_INITIALIZER;
+
+// back into the loop's epoll set, ready to write c->res, retried while epoll is out of memory
+void return_writable(struct connection* c) {
+    c->state = CONN_WRITING;
+    struct epoll_event ev;
+    ev.events = EPOLLOUT;
+    ev.data.ptr = c;
+    while (epoll_ctl(c->loop->epfd, EPOLL_CTL_ADD, c->fd, &ev) == -1) { // publishes c to the loop
+        perror("epoll_ctl");
+        usleep(CHILD_WATCH_RETRY_MS * 1000);
+    }
+}
+
+void* cgi_job_thread(void* arg) {
+    (void) arg;
+    stats_register(STATS_CGI_JOB);
+    while (1) {
+        pthread_mutex_lock(&cgi_jobs_lock);
+        while (cgi_jobs.empty()) {
+            pthread_cond_wait(&cgi_jobs_cond, &cgi_jobs_lock);
+        }
+        struct cgi_job job = cgi_jobs.front();
+        cgi_jobs.pop_front();
+        pthread_mutex_unlock(&cgi_jobs_lock);
+
+        stats_busy(1);
+        pooled_cgi(job.path, job.conn->res, job.conn->keep_alive);
+        stats_busy(0);
+        return_writable(job.conn); // the loop sends the answer and counts the request, as for its own responses
+    }
+}
+
+void stats_gauges_now(struct stats_gauges* g) {
+    g->mode = server_mode;
+    g->queued = 0;
+    g->queue_slots = 0;
+    if (strcmp(server_mode, "threads") == 0) { // event loops accept straight from the listener, there is no buffer
+        for (int s = 0; s < num_shards; s++) {
+            size_t slots;
+            g->queued += work_pool_queued(&shards[s].pool, &slots);
+            g->queue_slots += slots;
+        }
+    }
+    g->cgi_running = cgi_workers > 0 ? cgi_pool_busy(&cgi_pool) : (long) child_watch_running(&cgi_children);
+    g->cgi_capacity = cgi_workers > 0 ? cgi_workers : 0;
+    pthread_mutex_lock(&cgi_jobs_lock);
+    g->cgi_waiting = cgi_jobs.size();
+    pthread_mutex_unlock(&cgi_jobs_lock);
+}
+
+/*
+The event loop version of pooled_cgi(): the connection leaves the epoll set and the idle list while a job
+thread waits for the pooled worker's answer, and comes back writable with the answer in c->res.
+*/
+void start_cgi(struct event_loop_state* loop, struct connection* c, char* path) {
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    idle_unlink(loop, c);
+    c->state = CONN_RELAYING;
+
+    struct cgi_job job;
+    job.conn = c;
+    job.path = path;
+    pthread_mutex_lock(&cgi_jobs_lock);
+    cgi_jobs.push_back(job);
+    pthread_cond_signal(&cgi_jobs_cond);
+    pthread_mutex_unlock(&cgi_jobs_lock);
+}
+
+/*
+The relay's done() for an event loop connection, on the poller's thread: put the connection back into its loop's
+epoll set, writable right away, so the loop picks it up in relay_returned(). Returns -1 if epoll couldn't take it.
+*/
+int return_connection(struct cgi_relay* relay, int reusable) {
+    struct connection* c = (struct connection*) relay->owner;
+    c->relayed = relay->sent;
+    c->relay_reusable = reusable;
+    struct epoll_event ev;
+    ev.events = EPOLLOUT;
+    ev.data.ptr = c;
+    return epoll_ctl(c->loop->epfd, EPOLL_CTL_ADD, c->fd, &ev); // publishes the fields above to the loop
+}
+
+/*
+-g 0: hand the connection to a CGI relay (spawn_cgi()) until it has sent fib.cgi's answer. The connection
+leaves the epoll set and the idle list first, so the loop doesn't touch it while the poller does.
+Returns 1 if the relay has it, 0 if the answer is in c->res instead and the connection is back in the loop.
+*/
+int relay_cgi(struct event_loop_state* loop, struct connection* c, char* path) {
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    idle_unlink(loop, c);
+    c->state = CONN_RELAYING;
+    if (spawn_cgi(c->fd, path, c->res, c->keep_alive, return_connection, c)) {
+        return 1;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    epoll_ctl(loop->epfd, EPOLL_CTL_ADD, c->fd, &ev); // serve_buffered() sets what it waits for
+    touch(loop, c);
+    return 0;
+}
+
+void serve_buffered(struct event_loop_state* loop, struct connection* c);
+
+/*
+A connection is back from its CGI relay: count the request the relay answered, then carry on with the
+connection (or close it) the way on_writable() does after a response of the loop's own.
+*/
+void relay_returned(struct event_loop_state* loop, struct connection* c) {
+    finish_request(&c->trace, STATS_CGI, c->relayed.code, c->relayed.bytes);
+    arena_reset(&c->scratch);
+    if (!c->relay_reusable) {
+        close_connection(loop, c);
+        return;
+    }
+    c->state = CONN_READING;
+    touch(loop, c);
+    memmove(c->buffer, c->buffer + c->request_len, c->total_bytes - c->request_len);
+    c->total_bytes -= c->request_len;
+    http_parser_init(&c->parser);
+    serve_buffered(loop, c);
+}
+
+/*
+Answer whatever complete requests are sitting in the buffer, one at a time and in order.
+Stops when the buffer has no complete request left (wait for EPOLLIN), the socket is full (wait for
+EPOLLOUT), or the connection is done.
+*/
+void serve_buffered(struct event_loop_state* loop, struct connection* c) {
+    while (1) {
+        struct http_request req;
+        int ready = request_ready(&c->parser, c->buffer, c->total_bytes, &req);
+        if (ready == HTTP_PARSE_INCOMPLETE) { // rest of the request has not arrived yet
+            if (c->total_bytes == 0) { // nothing buffered, an idle keep-alive connection doesn't need to hold a buffer
+                arena_block_put(c->inbuf);
+                c->inbuf = NULL;
+                c->buffer = NULL;
+            }
+            c->state = CONN_READING;
+            watch(loop, c, EPOLLIN);
+            return;
+        }
+        c->requests_served++;
+        trace_start(&c->trace, ready == HTTP_PARSE_DONE ? &req : NULL);
+
+        if (c->res == NULL) {
+            c->res = new struct response;
+            clear_response(c->res); // a CGI request never fills it in, close_connection() must still see it empty
+            c->res->scratch = &c->scratch;
+        }
+        if (ready == HTTP_PARSE_DONE) {
+            c->request_len = req.length;
+            c->keep_alive = keepalive_secs > 0 && c->requests_served < max_requests && http_keep_alive(&req);
+            char* path;
+            if (route_request(&req, c->res, &path, &c->keep_alive) == ROUTE_CGI) {
+                if (cgi_workers > 0) {
+                    start_cgi(loop, c, path);
+                    return;
+                }
+                if (relay_cgi(loop, c, path)) {
+                    return;
+                }
+            }
+        } else {
+            unparsable_response(c->res, ready);
+            c->request_len = c->total_bytes;
+            c->keep_alive = 0;
+        }
+
+        c->state = CONN_WRITING;
+        int rv = send_some(c->fd, c->res);
+        if (rv == 0) {
+            watch(loop, c, EPOLLOUT);
+            return;
+        }
+        count_response(c->res, &c->trace);
+        free_response(c->res);
+        arena_reset(&c->scratch);
+        if (rv == -1 || !c->keep_alive) {
+            close_connection(loop, c);
+            return;
+        }
+
+        // move the next pipelined request (if any) to the front of the buffer
+        memmove(c->buffer, c->buffer + c->request_len, c->total_bytes - c->request_len);
+        c->total_bytes -= c->request_len;
+        http_parser_init(&c->parser);
+    }
+}
+
+void on_readable(struct event_loop_state* loop, struct connection* c) {
+    ssize_t max_chars = HTTP_MAX_REQUEST;
+    if (c->inbuf == NULL) {
+        c->inbuf = arena_block_get(max_chars);
+        c->buffer = c->inbuf->data;
+    }
+    while (c->total_bytes < max_chars) {
+        ssize_t bytes_read = read(c->fd, c->buffer + c->total_bytes, max_chars - c->total_bytes);
+        if (bytes_read == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break; // that's everything for now
+        }
+        if (bytes_read <= 0) { // client hung up (or read failed)
+            close_connection(loop, c);
+            return;
+        }
+        c->total_bytes += bytes_read;
+    }
+    touch(loop, c);
+    serve_buffered(loop, c);
+}
+
+void on_writable(struct event_loop_state* loop, struct connection* c) {
+    int rv = send_some(c->fd, c->res);
+    if (rv == 0) {
+        touch(loop, c);
+        return;
+    }
+    count_response(c->res, &c->trace);
+    free_response(c->res);
+    arena_reset(&c->scratch);
+    if (rv == -1 || !c->keep_alive) {
+        close_connection(loop, c);
+        return;
+    }
+    touch(loop, c);
+    memmove(c->buffer, c->buffer + c->request_len, c->total_bytes - c->request_len);
+    c->total_bytes -= c->request_len;
+    http_parser_init(&c->parser);
+    serve_buffered(loop, c);
+}
+
+void accept_connections(struct event_loop_state* loop, int listen_fd) {
+    while (1) {
+        struct sockaddr_storage their_addr;
+        socklen_t sin_size = sizeof their_addr;
+        int new_fd = accept4(listen_fd, (struct sockaddr*) &their_addr, &sin_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (new_fd == -1) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept");
+            }
+            return; // no more pending connections (or out of descriptors, try again on the next wakeup)
+        }
+
+        struct connection* c = new struct connection;
+        c->fd = new_fd;
+        c->state = CONN_READING;
+        c->inbuf = NULL;
+        c->buffer = NULL;
+        c->total_bytes = 0;
+        c->request_len = 0;
+        http_parser_init(&c->parser);
+        c->requests_served = 0;
+        c->keep_alive = 0;
+        c->res = NULL;
+        arena_init(&c->scratch);
+        c->loop = loop;
+        client_addr_set(&c->client, &their_addr);
+        c->trace.client = &c->client;
+        c->trace.queue_us = 0; // accepted by the loop that serves it, nothing to wait in
+        c->prev = c->next = NULL;
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, new_fd, &ev) == -1) {
+            perror("epoll_ctl");
+            close(new_fd);
+            delete c;
+            continue;
+        }
+        touch(loop, c);
+    }
+}
+
+void* event_loop(void* arg) {
+    struct shard* shard = (struct shard*) arg;
+    int listen_fd = shard->listen_fd;
+    pin_thread(shard->cpu);
+    stats_register(STATS_EVENT_LOOP);
+
+    struct event_loop_state loop;
+    loop.idle_head = loop.idle_tail = NULL;
+    loop.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop.epfd == -1) {
+        perror("epoll_create1");
+        exit(1);
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = NULL; // NULL marks the listening socket, every other event carries its struct connection
+    if (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, listen_fd, &ev) == -1) {
+        perror("epoll_ctl listener");
+        exit(1);
+    }
+
+    // wake up at least once a second to close idle connections
+    int timeout_ms = keepalive_secs > 0 ? 1000 : -1;
+
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        stats_busy(0);
+        int n = epoll_wait(loop.epfd, events, MAX_EVENTS, timeout_ms);
+        stats_busy(1);
+        if (n == -1) {
+            if (errno == EINTR) continue; // interrupted by a signal, try again
+            perror("epoll_wait");
+            exit(1);
+        }
+
+        for (int i = 0; i < n; i++) {
+            struct connection* c = (struct connection*) events[i].data.ptr;
+            if (c == NULL) {
+                accept_connections(&loop, listen_fd);
+            } else if (c->state == CONN_RELAYING) {
+                relay_returned(&loop, c);
+            } else if (events[i].events & (EPOLLERR | EPOLLHUP) && c->state == CONN_READING) {
+                close_connection(&loop, c);
+            } else if (c->state == CONN_READING) {
+                on_readable(&loop, c);
+            } else {
+                on_writable(&loop, c);
+            }
+        }
+
+        if (keepalive_secs > 0) {
+            close_idle(&loop);
+        }
+    }
+}
+
+/*
+Runtime statistics are printed to stderr on SIGUSR1 (kill -USR1 <pid>).
+main() blocks SIGUSR1 in every thread, this thread picks it up with sigwait(), so the printing happens
+in a normal thread instead of inside a signal handler.
+*/
+void* stats_thread(void* arg) {
+    sigset_t* set = (sigset_t*) arg;
+    while (1) {
+        int sig;
+        if (sigwait(set, &sig) != 0) {
+            continue;
+        }
+        char buf[512];
+        if (cache_mb > 0) {
+            file_cache_stats(&file_cache, buf, sizeof buf);
+        } else {
+            snprintf(buf, sizeof buf, "file cache: off\n");
+        }
+        write_all(STDERR_FILENO, buf, strlen(buf));
+        if (gzip_level > 0) {
+            compress_stats(buf, sizeof buf);
+            write_all(STDERR_FILENO, buf, strlen(buf));
+            file_cache_stats(&gzip_cache, buf, sizeof buf);
+            write_all(STDERR_FILENO, buf, strlen(buf));
+        }
+        if (dynamic_ttl > 0) {
+            dynamic_cache_stats(&dynamic_cache, buf, sizeof buf);
+        } else {
+            snprintf(buf, sizeof buf, "dynamic cache: off\n");
+        }
+        write_all(STDERR_FILENO, buf, strlen(buf));
+        if (cgi_workers > 0) {
+            cgi_pool_stats(&cgi_pool, buf, sizeof buf);
+            write_all(STDERR_FILENO, buf, strlen(buf));
+            flight_stats(&cgi_flights, buf, sizeof buf);
+        } else {
+            child_watch_stats(&cgi_children, buf, sizeof buf);
+            write_all(STDERR_FILENO, buf, strlen(buf));
+            cgi_stream_stats(buf, sizeof buf);
+        }
+        write_all(STDERR_FILENO, buf, strlen(buf));
+        arena_stats(buf, sizeof buf);
+        write_all(STDERR_FILENO, buf, strlen(buf));
+        if (access_log.on) {
+            access_log_stats(&access_log, buf, sizeof buf);
+            write_all(STDERR_FILENO, buf, strlen(buf));
+        }
+    }
+}
+
+void parse_argv(int argc, char* argv[], char** port, char** thread_str, char** buffer_str, char** mode_str) {
     // default values
     *(port) = (char*) DEF_PORT;
     *(thread_str) = (char*) DEF_THREADS;
     *(buffer_str) = (char*) DEF_BUFFS;
+    *(mode_str) = (char*) DEF_MODE;
 
     for (int i = 1; i < argc; i+=2) {
         if ((i+1) >= argc) {
@@ -488,6 +1905,123 @@ void parse_argv(int argc, char* argv[], char** port, char** thread_str, char** b
             }
             *(buffer_str) = argv[i+1];
         }
+        else if (strcmp("-k", argv[i]) == 0) {
+            if (atoi(argv[i+1]) < 0) {
+                fprintf(stderr, "keep-alive timeout is not a non-negative integer.\n");
+                exit(1);
+            }
+            keepalive_secs = atoi(argv[i+1]);
+        }
+        else if (strcmp("-r", argv[i]) == 0) {
+            if (atoi(argv[i+1]) < 1) {
+                fprintf(stderr, "max requests per connection is not a positive integer.\n");
+                exit(1);
+            }
+            max_requests = atoi(argv[i+1]);
+        }
+        else if (strcmp("-c", argv[i]) == 0) {
+            if (atoi(argv[i+1]) < 0) {
+                fprintf(stderr, "file cache size is not a non-negative integer.\n");
+                exit(1);
+            }
+            cache_mb = atoi(argv[i+1]);
+        }
+        else if (strcmp("-m", argv[i]) == 0) {
+            if (strcmp(argv[i+1], "threads") != 0 && strcmp(argv[i+1], "epoll") != 0) {
+                fprintf(stderr, "mode must be threads or epoll.\n");
+                exit(1);
+            }
+            *(mode_str) = argv[i+1];
+        }
+        else if (strcmp("-s", argv[i]) == 0) {
+            if (atoi(argv[i+1]) < 1) {
+                fprintf(stderr, "number of shards is not a positive integer.\n");
+                exit(1);
+            }
+            num_shards = atoi(argv[i+1]);
+        }
+        else if (strcmp("-g", argv[i]) == 0) {
+            if (atoi(argv[i+1]) < 0) {
+                fprintf(stderr, "number of CGI workers is not a non-negative integer.\n");
+                exit(1);
+            }
+            cgi_workers = atoi(argv[i+1]);
+        }
+        else if (strcmp("-d", argv[i]) == 0) {
+            handlers_dir = argv[i+1];
+        }
+        else if (strcmp("-e", argv[i]) == 0) {
+            if (atoi(argv[i+1]) < 0) {
+                fprintf(stderr, "dynamic cache ttl is not a non-negative integer.\n");
+                exit(1);
+            }
+            dynamic_ttl = atoi(argv[i+1]);
+        }
+        else if (strcmp("-f", argv[i]) == 0) {
+            if (atoi(argv[i+1]) < 1) {
+                fprintf(stderr, "dynamic cache size is not a positive integer.\n");
+                exit(1);
+            }
+            dynamic_mb = atoi(argv[i+1]);
+        }
+        else if (strcmp("-w", argv[i]) == 0) {
+            if (atoi(argv[i+1]) < 0) {
+                fprintf(stderr, "cgi timeout is not a non-negative integer.\n");
+                exit(1);
+            }
+            cgi_timeout = atoi(argv[i+1]);
+        }
+        else if (strcmp("-q", argv[i]) == 0) {
+            if (strcmp(argv[i+1], "steal") != 0 && strcmp(argv[i+1], "shared") != 0) {
+                fprintf(stderr, "queue must be steal or shared.\n");
+                exit(1);
+            }
+            work_stealing = strcmp(argv[i+1], "steal") == 0;
+        }
+        else if (strcmp("-l", argv[i]) == 0) {
+            access_log_file = argv[i+1];
+        }
+        else if (strcmp("-z", argv[i]) == 0) {
+            if (atoi(argv[i+1]) < 1) {
+                fprintf(stderr, "access log size is not a positive integer.\n");
+                exit(1);
+            }
+            access_log_mb = atoi(argv[i+1]);
+        }
+        else if (strcmp("-u", argv[i]) == 0) {
+            if (cache_rule_add(argv[i+1]) == -1) {
+                fprintf(stderr, "cache rule must be prefix=seconds.\n");
+                exit(1);
+            }
+        }
+        else if (strcmp("-o", argv[i]) == 0) {
+            if (atoi(argv[i+1]) < 0 || atoi(argv[i+1]) > 9) {
+                fprintf(stderr, "gzip level must be between 0 and 9.\n");
+                exit(1);
+            }
+            gzip_level = atoi(argv[i+1]);
+        }
+        else if (strcmp("-i", argv[i]) == 0) {
+            if (atoi(argv[i+1]) < 1) {
+                fprintf(stderr, "gzip cache size is not a positive integer.\n");
+                exit(1);
+            }
+            gzip_mb = atoi(argv[i+1]);
+        }
+        else if (strcmp("-x", argv[i]) == 0) {
+            if (strcmp(argv[i+1], "0") != 0 && strcmp(argv[i+1], "1") != 0) {
+                fprintf(stderr, "status pages must be 0 or 1.\n");
+                exit(1);
+            }
+            status_pages = atoi(argv[i+1]);
+        }
+        else if (strcmp("-a", argv[i]) == 0) {
+            if (strcmp(argv[i+1], "0") != 0 && strcmp(argv[i+1], "1") != 0) {
+                fprintf(stderr, "cpu pinning must be 0 or 1.\n");
+                exit(1);
+            }
+            pin_cpus = atoi(argv[i+1]);
+        }
         else {
             fprintf(stderr, "setup improperly formatted.\n");
             exit(1);
@@ -499,31 +2033,20 @@ int main(int argc, char* argv[]) {
     char* port;
     char* thread_str;
     char* buffer_str;
-    parse_argv(argc, argv, &port, &thread_str, &buffer_str);
+    char* mode_str;
+    parse_argv(argc, argv, &port, &thread_str, &buffer_str, &mode_str);
 
     /* parse_argv testing
     printf("argc: %i\n", argc);
     printf("port: %s\n", port);
     printf("thread_str: %s\n", thread_str);
     printf("buffer_str: %s\n", buffer_str);
+    printf("mode_str: %s\n", mode_str);
     */
 
-    pthread_t producer;
-    pthread_t consumer_threads[atoi(thread_str)]; // thread_str = # of consumer threads requested by command line
-    
-    if (sem_init(&full, 0, 0) == -1) { // initialized to how many slots in the Queue of connections are full
-        perror("semaphore initialization 1 in main");
-    }
-    if (sem_init(&empty, 0, atoi(buffer_str)) == -1) { // initialized to how many slots in the Queue of connections are empty (size of buffer = size of Queue)
-        perror("semaphore initialization 2 in main");
-    }
-
-    if (pthread_mutex_init(&queue_mutex, NULL) == -1) {
-        perror("mutex initialization 1 in main");
-    }
-    if (pthread_mutex_init(&socket_mutex, NULL) == -1) {
-        perror("mutex initialization 2 in main");
-    }
+    int threads = atoi(thread_str); // # of consumer threads (or event loops) per shard requested by command line
+    shards = new struct shard[num_shards];
+    int cpus = sysconf(_SC_NPROCESSORS_ONLN);
 
     struct addrinfo* servinfo; // return value for get_addresses
     get_addresses(&servinfo, port); // mutates servinfo, no return needed
@@ -532,37 +2055,121 @@ int main(int argc, char* argv[]) {
         return -1;
     }
 
-    if ((sockfd = make_bound_socket(servinfo)) == -1) {
-        fprintf(stderr, "server: failed to bind\n"); 
-        exit(1);
-    };
+    // a client that hangs up mid-response should only fail that write(), not kill the whole server
+    signal(SIGPIPE, SIG_IGN);
 
-    // being here means socket has binded, ready to listen
-    struct sigaction sa; // structure that specifies how to handle a signal
-    prepare_for_connection(sockfd, &sa, atoi(buffer_str));
+    // event loops have no shared buffer to size, they accept as fast as connections arrive, so don't let a small -b drop SYNs
+    int backlog = strcmp(mode_str, "epoll") == 0 && atoi(buffer_str) < SOMAXCONN ? SOMAXCONN : atoi(buffer_str);
+
+    for (int i = 0; i < num_shards; i++) {
+        shards[i].id = i;
+        shards[i].cpu = pin_cpus ? i % cpus : -1;
+        // a single listener keeps SO_REUSEPORT off, so a second server can't silently share the port
+        if ((shards[i].listen_fd = make_bound_socket(servinfo, num_shards > 1)) == -1) {
+            fprintf(stderr, "server: failed to bind\n");
+            exit(1);
+        }
+        // being here means socket has binded, ready to listen
+        prepare_for_connection(shards[i].listen_fd, backlog);
+        // buffer_str slots split over the queues (each rounded up to a power of 2)
+        work_pool_init(&shards[i].pool, work_stealing ? threads : 1, atoi(buffer_str));
+    }
 
     freeaddrinfo(servinfo);
 
-    // I don't need to worry about making q a fixed size because the semaphore's waits and posts will manage how many free spots there are based on initial buffer_str
-    std::pair<std::queue<int>*, int*> producer_args(&q, &sockfd);
+    // SIGUSR1 is blocked here, before any other thread (the Date ticker is the first) exists, so only stats_thread ever receives it
+    sigset_t stats_set;
+    sigemptyset(&stats_set);
+    sigaddset(&stats_set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &stats_set, NULL);
+
+    http_messaging_init(); // constant header fragments and the Date ticker
+    stats_init();
+    server_mode = mode_str;
+
+    struct rlimit fd_limit;
+    if (getrlimit(RLIMIT_NOFILE, &fd_limit) == 0) {
+        accepted_conns_max = fd_limit.rlim_cur < ACCEPTED_CONNS_CAP ? fd_limit.rlim_cur : ACCEPTED_CONNS_CAP;
+    }
+    accepted_conns = (struct accepted_conn*) calloc(accepted_conns_max > 0 ? accepted_conns_max : 1, sizeof (struct accepted_conn));
+
+    if (access_log_file != NULL) {
+        access_log_init(&access_log, access_log_file, (size_t) access_log_mb * 1024 * 1024);
+        pthread_t log_writer;
+        pthread_create(&log_writer, NULL, access_log_thread, (void*)&access_log);
+    }
+
+    content_types_init(MIME_TYPES_FILE);
+    file_cache_init(&file_cache, "file cache", (size_t) cache_mb * 1024 * 1024);
+    file_cache_init(&gzip_cache, "gzip cache", (size_t) gzip_mb * 1024 * 1024);
+    dynamic_cache_init(&dynamic_cache, (size_t) dynamic_mb * 1024 * 1024, dynamic_ttl);
+    flight_group_init(&cgi_flights);
+
+    if (handlers_dir != NULL) {
+        plugins_load(handlers_dir); // before any worker can look a plugin up
+    }
 
-    pthread_create(&producer, NULL, produce, (void*)&producer_args);
-    for (int i = 0; i < atoi(thread_str); i++) {
-        pthread_create(&consumer_threads[i], NULL, consume, (void*)&q);
+    // the CGI workers are started before the workers and event loops start
+    if (cgi_workers == -1) {
+        cgi_workers = cpus;
+    }
+    if (cgi_workers > 0) {
+        cgi_pool_init(&cgi_pool, cgi_workers, "fib.cgi");
+    } else {
+        child_watch_init(&cgi_children, cgi_timeout);
+        pthread_t watcher;
+        pthread_create(&watcher, NULL, child_watch_thread, (void*)&cgi_children);
     }
 
-    pthread_join(producer, NULL);
+    pthread_t stats;
+    pthread_create(&stats, NULL, stats_thread, (void*)&stats_set);
+
+    if (strcmp(mode_str, "epoll") == 0) {
+        // -t event loop threads per shard share that shard's listening socket
+        pthread_t loop_threads[num_shards * threads];
+        for (int s = 0; s < num_shards; s++) {
+            fcntl(shards[s].listen_fd, F_SETFL, fcntl(shards[s].listen_fd, F_GETFL) | O_NONBLOCK);
+            for (int i = 0; i < threads; i++) {
+                pthread_create(&loop_threads[s * threads + i], NULL, event_loop, (void*)&shards[s]);
+            }
+        }
+        int job_count = cgi_workers; // none with -g 0, the loops spawn and the child watch's poller relays
+        pthread_t job_threads[job_count > 0 ? job_count : 1];
+        for (int i = 0; i < job_count; i++) {
+            pthread_create(&job_threads[i], NULL, cgi_job_thread, NULL);
+        }
+        for (int i = 0; i < num_shards * threads; i++) {
+            pthread_join(loop_threads[i], NULL);
+        }
+        return 0;
+    }
+
+    pthread_t producers[num_shards];
+    pthread_t consumer_threads[num_shards * threads];
+    struct worker* workers = new struct worker[num_shards * threads];
+    for (int s = 0; s < num_shards; s++) {
+        pthread_create(&producers[s], NULL, produce, (void*)&shards[s]);
+        for (int i = 0; i < threads; i++) {
+            struct worker* w = &workers[s * threads + i];
+            w->shard = &shards[s];
+            w->id = i;
+            pthread_create(&consumer_threads[s * threads + i], NULL, consume, (void*)w);
+        }
+    }
+
+    for (int s = 0; s < num_shards; s++) {
+        pthread_join(producers[s], NULL);
+    }
     // Cancel each consumer thread
-    for (int i = 0; i < atoi(thread_str); i++) {
+    for (int i = 0; i < num_shards * threads; i++) {
         pthread_cancel(consumer_threads[i]);
     }
 
-    // Destroy semaphores
-    sem_destroy(&full);
-    sem_destroy(&empty);
-
-    // Destory mutexes
-    pthread_mutex_destroy(&queue_mutex);
-    pthread_mutex_destroy(&socket_mutex);
+    // Destroy the queues
+    for (int s = 0; s < num_shards; s++) {
+        work_pool_destroy(&shards[s].pool);
+    }
+    delete[] workers;
+    delete[] shards;
 
 }
\ No newline at end of file